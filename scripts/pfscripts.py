@@ -9,11 +9,14 @@ import ConfigParser
 ROOT = os.path.abspath(os.path.dirname(__file__))
 ROOT_PATH = lambda *args: os.path.join(ROOT, *args)
 pftool = ROOT_PATH("..", "bin", "pftool")
+config_file = ROOT_PATH("..", "etc", "pftool.cfg")
 
 class Work:
   COPY = 0
   LS = 1
   COMPARE = 2
+  QUERY = 3
+  DU = 4
 
 class Commands:
   def __init__(self):
@@ -43,7 +46,7 @@ def get_jid():
   jid = user+time_id+hostname
   return jid
 
-def parse_config(options_path=ROOT_PATH("..", "etc", "pftool.cfg")):
+def parse_config(options_path=config_file):
   config = ConfigParser.ConfigParser()
   config.read(options_path)
   return config
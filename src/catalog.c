@@ -0,0 +1,369 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+/**
+* Implements metadata catalogs (see catalog.h)
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "catalog.h"
+
+#define CATALOG_WRITE_BUFFER 1048576			// stdio buffer of each column being written
+
+// File suffixes of the columns, in enum catalog_column order
+static const char *catalog_columns[] = {"ino", "size", "blocks", "mtime", "atime", "uid", "gid", "mode", "pathoff", "path"};
+
+/**
+* Sets up a catalog directory for a run: creates it if
+* needed, and removes the manifest of the last catalog
+* written there, so that it is not read with new shards.
+* Called by the manager before the walk.
+*
+* @param dir		the catalog directory
+*
+* @return 0 on success, -1 on failure
+*/
+int prepare_catalog(const char *dir) {
+    char file[PATHSIZE_PLUS];
+
+    if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(file, PATHSIZE_PLUS, "%s/%s", dir, CATALOG_MANIFEST);
+    if (unlink(file) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Initializes this rank's shard of a catalog. Nothing is
+* written until the first row.
+*
+* @param c		the shard to initialize
+* @param dir		the catalog directory. "" -> no catalog
+* @param rank		the rank of the worker
+*/
+void init_catalog(catalog *c, const char *dir, int rank) {
+    memset(c, 0, sizeof(catalog));
+    strncpy(c->dir, dir, PATHSIZE_PLUS);
+    c->dir[PATHSIZE_PLUS-1] = '\0';
+    c->rank = rank;
+}
+
+/**
+* Opens the column files of this rank's shard, with large
+* stdio buffers so that rows are written in big pieces.
+*
+* @param c		the shard
+*
+* @return 0 on success, -1 on failure
+*/
+static int open_catalog(catalog *c) {
+    char file[PATHSIZE_PLUS];
+    int i;
+
+    for (i = 0; i < CAT_COLUMNS; i++) {
+        snprintf(file, PATHSIZE_PLUS, "%s/shard.%d.%s", c->dir, c->rank, catalog_columns[i]);
+        if ((c->col[i] = fopen(file, "w")) == NULL) {
+            return -1;
+        }
+        setvbuf(c->col[i], NULL, _IOFBF, CATALOG_WRITE_BUFFER);
+    }
+    return 0;
+}
+
+/**
+* Adds a row to this rank's shard of a catalog.
+*
+* @param c		the shard
+* @param path		the path of the entry
+* @param st		the stat of the entry
+*/
+void catalog_add(catalog *c, const char *path, struct stat *st) {
+    uint64_t ino = st->st_ino, pathoff = c->heap;
+    int64_t size = st->st_size, blocks = st->st_blocks, mtime = st->st_mtime, atime = st->st_atime;
+    uint32_t uid = st->st_uid, gid = st->st_gid, mode = st->st_mode;
+    size_t pathlen = strlen(path) + 1;
+    int n = 0;
+
+    if (!c->dir[0] || c->failed) {
+        return;
+    }
+    if (c->col[0] == NULL && open_catalog(c) != 0) {
+        errsend(NONFATAL, "Failed to open catalog shard");
+        c->failed = 1;
+        return;
+    }
+    n += fwrite(&ino, sizeof(ino), 1, c->col[CAT_INO]);
+    n += fwrite(&size, sizeof(size), 1, c->col[CAT_SIZE]);
+    n += fwrite(&blocks, sizeof(blocks), 1, c->col[CAT_BLOCKS]);
+    n += fwrite(&mtime, sizeof(mtime), 1, c->col[CAT_MTIME]);
+    n += fwrite(&atime, sizeof(atime), 1, c->col[CAT_ATIME]);
+    n += fwrite(&uid, sizeof(uid), 1, c->col[CAT_UID]);
+    n += fwrite(&gid, sizeof(gid), 1, c->col[CAT_GID]);
+    n += fwrite(&mode, sizeof(mode), 1, c->col[CAT_MODE]);
+    n += fwrite(&pathoff, sizeof(pathoff), 1, c->col[CAT_PATHOFF]);
+    n += fwrite(path, pathlen, 1, c->col[CAT_PATH]);
+    if (n != CAT_COLUMNS) {
+        errsend(NONFATAL, "Failed to write catalog shard");
+        c->failed = 1;
+        return;
+    }
+    c->heap += pathlen;
+    c->rows++;
+}
+
+/**
+* Closes this rank's shard of a catalog. This happens after
+* the manager stopped counting errors, so failures are
+* returned, for the manager to leave the manifest unwritten.
+*
+* @param c		the shard
+* @param rows		gets the number of rows written
+*
+* @return 0 on success, -1 if the shard could not be written
+*/
+int close_catalog(catalog *c, uint64_t *rows) {
+    int rc = (c->failed)?-1:0;
+    int i;
+
+    for (i = 0; i < CAT_COLUMNS; i++) {
+        if (c->col[i] != NULL && fclose(c->col[i]) != 0) {
+            rc = -1;
+        }
+        c->col[i] = NULL;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Failed to write catalog shard %s/shard.%d\n", c->dir, c->rank);
+    }
+    *rows = c->rows;
+    return rc;
+}
+
+/**
+* Writes the manifest of a catalog. Called by the manager once
+* every rank has closed its shard.
+*
+* @param dir		the catalog directory
+* @param rows		the rows of each rank's shard. < 0 -> the
+* 			shard failed
+* @param nshards	the number of ranks
+*
+* @return 0 on success, -1 on failure
+*/
+int write_catalog_manifest(const char *dir, const double *rows, int nshards) {
+    char file[PATHSIZE_PLUS], tmp[PATHSIZE_PLUS];
+    FILE *fp;
+    int i;
+
+    for (i = 0; i < nshards; i++) {
+        if (rows[i] < 0) {
+            return -1;
+        }
+    }
+    snprintf(file, PATHSIZE_PLUS, "%s/%s", dir, CATALOG_MANIFEST);
+    snprintf(tmp, PATHSIZE_PLUS, "%s/%s.tmp", dir, CATALOG_MANIFEST);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        return -1;
+    }
+    fprintf(fp, "%s\n", CATALOG_VERSION);
+    for (i = 0; i < nshards; i++) {
+        if (rows[i] > 0) {
+            fprintf(fp, "shard %d %.0f\n", i, rows[i]);
+        }
+    }
+    if (fclose(fp) != 0) {
+        return -1;
+    }
+    return rename(tmp, file);
+}
+
+/**
+* Reads the manifest of a catalog.
+*
+* @param dir		the catalog directory
+* @param ranks		gets the ranks of the shards (free() it)
+* @param rows		gets the rows of the shards (free() it)
+*
+* @return the number of shards, or -1 if the manifest could
+* 	not be read
+*/
+int read_catalog_manifest(const char *dir, int **ranks, uint64_t **rows) {
+    char file[PATHSIZE_PLUS], line[256];
+    unsigned long long n;
+    FILE *fp;
+    int count = 0, size = 0, rank;
+
+    *ranks = NULL;
+    *rows = NULL;
+    snprintf(file, PATHSIZE_PLUS, "%s/%s", dir, CATALOG_MANIFEST);
+    if ((fp = fopen(file, "r")) == NULL) {
+        return -1;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, CATALOG_VERSION, strlen(CATALOG_VERSION))) {
+        fclose(fp);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "shard %d %llu", &rank, &n) != 2) {
+            continue;
+        }
+        if (count == size) {
+            size = (size)?2*size:64;
+            *ranks = (int *) realloc(*ranks, size * sizeof(int));
+            *rows = (uint64_t *) realloc(*rows, size * sizeof(uint64_t));
+        }
+        (*ranks)[count] = rank;
+        (*rows)[count] = n;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+/**
+* Maps the columns of a shard of a catalog in memory.
+*
+* @param s		gets the mapped shard
+* @param dir		the catalog directory
+* @param rank		the rank that wrote the shard
+*
+* @return 0 on success, -1 on failure
+*/
+int open_catalog_shard(catalog_shard *s, const char *dir, int rank) {
+    char file[PATHSIZE_PLUS];
+    struct stat st;
+    int fd;
+    int i;
+
+    memset(s, 0, sizeof(catalog_shard));
+    for (i = 0; i < CAT_COLUMNS; i++) {
+        snprintf(file, PATHSIZE_PLUS, "%s/shard.%d.%s", dir, rank, catalog_columns[i]);
+        if ((fd = open(file, O_RDONLY)) < 0) {
+            close_catalog_shard(s);
+            return -1;
+        }
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            close_catalog_shard(s);
+            return -1;
+        }
+        s->col[i] = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (s->col[i] == MAP_FAILED) {
+            s->col[i] = NULL;
+            close_catalog_shard(s);
+            return -1;
+        }
+        s->len[i] = st.st_size;
+        madvise(s->col[i], st.st_size, MADV_SEQUENTIAL);
+    }
+    s->rows = s->len[CAT_INO] / sizeof(uint64_t);
+    return 0;
+}
+
+/**
+* Tests a filter on rows of a mapped shard. The number terms
+* are tested first, a column at a time; the globs only on the
+* rows left.
+*
+* @param s		the shard
+* @param f		the filter
+* @param first		the first row
+* @param count		the number of rows (at most CATALOG_BLOCK)
+* @param mask		gets 1 per row that matches
+*
+* @return the number of rows that match
+*/
+size_t catalog_match(catalog_shard *s, filter *f, uint64_t first, size_t count, unsigned char *mask) {
+    filter_term *t;
+    const char *path;
+    size_t matches = 0;
+    size_t j;
+    int i;
+
+    memset(mask, 1, count);
+    for (i = 0; i < f->count; i++) {
+        t = &f->terms[i];
+        switch (t->field) {
+            case FILTER_SIZE: filter_int64(t, (int64_t *)s->col[CAT_SIZE] + first, mask, count); break;
+            case FILTER_BLOCKS: filter_int64(t, (int64_t *)s->col[CAT_BLOCKS] + first, mask, count); break;
+            case FILTER_MTIME: filter_int64(t, (int64_t *)s->col[CAT_MTIME] + first, mask, count); break;
+            case FILTER_ATIME: filter_int64(t, (int64_t *)s->col[CAT_ATIME] + first, mask, count); break;
+            case FILTER_UID: filter_uint32(t, (uint32_t *)s->col[CAT_UID] + first, mask, count); break;
+            case FILTER_GID: filter_uint32(t, (uint32_t *)s->col[CAT_GID] + first, mask, count); break;
+            case FILTER_TYPE: filter_type(t, (uint32_t *)s->col[CAT_MODE] + first, mask, count); break;
+            default: break;
+        }
+    }
+    for (j = 0; j < count; j++) {
+        if (mask[j]) {
+            for (i = 0; i < f->count; i++) {
+                t = &f->terms[i];
+                if (t->field == FILTER_NAME || t->field == FILTER_PATH) {
+                    path = s->col[CAT_PATH] + ((uint64_t *)s->col[CAT_PATHOFF])[first + j];
+                    if (!filter_glob(t, path)) {
+                        mask[j] = 0;
+                        break;
+                    }
+                }
+            }
+            matches += mask[j];
+        }
+    }
+    return matches;
+}
+
+/**
+* Gets a row of a mapped shard.
+*
+* @param s		the shard
+* @param row		the row
+* @param path		gets the path
+* @param st		gets the fields of the row (the others are 0)
+*/
+void catalog_row(catalog_shard *s, uint64_t row, const char **path, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = ((uint64_t *)s->col[CAT_INO])[row];
+    st->st_size = ((int64_t *)s->col[CAT_SIZE])[row];
+    st->st_blocks = ((int64_t *)s->col[CAT_BLOCKS])[row];
+    st->st_mtime = ((int64_t *)s->col[CAT_MTIME])[row];
+    st->st_atime = ((int64_t *)s->col[CAT_ATIME])[row];
+    st->st_uid = ((uint32_t *)s->col[CAT_UID])[row];
+    st->st_gid = ((uint32_t *)s->col[CAT_GID])[row];
+    st->st_mode = ((uint32_t *)s->col[CAT_MODE])[row];
+    *path = s->col[CAT_PATH] + ((uint64_t *)s->col[CAT_PATHOFF])[row];
+}
+
+/**
+* Unmaps a shard of a catalog.
+*
+* @param s		the shard
+*/
+void close_catalog_shard(catalog_shard *s) {
+    int i;
+
+    for (i = 0; i < CAT_COLUMNS; i++) {
+        if (s->col[i] != NULL) {
+            munmap(s->col[i], s->len[i]);
+        }
+        s->col[i] = NULL;
+    }
+}
@@ -0,0 +1,101 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+//
+// Defines for metadata catalogs (-O). A catalog is a directory. Each
+// rank that walks writes its own shard: one file per column, of fixed
+// width records, and a heap of NUL terminated paths:
+//
+//	shard.<rank>.ino	uint64_t
+//	shard.<rank>.size	int64_t
+//	shard.<rank>.blocks	int64_t
+//	shard.<rank>.mtime	int64_t
+//	shard.<rank>.atime	int64_t
+//	shard.<rank>.uid	uint32_t
+//	shard.<rank>.gid	uint32_t
+//	shard.<rank>.mode	uint32_t
+//	shard.<rank>.pathoff	uint64_t (offset of the path in the heap)
+//	shard.<rank>.path	the path heap
+//
+// Row i of a shard is record i of every column. When the walk is done
+// the manager writes the manifest, which lists the shards and their rows:
+//
+//	pftool catalog 1
+//	shard <rank> <rows>
+//
+// Queries (-w 3) map the columns of a range of rows, and test the
+// filter on them a column at a time (see filter.h).
+//
+
+#ifndef      __CATALOG_H
+#define      __CATALOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "pfutils.h"
+#include "filter.h"
+
+#define CATALOG_MANIFEST "manifest"
+#define CATALOG_VERSION "pftool catalog 1"
+#define CATALOG_BLOCK 4096				// rows a query tests at once
+#define CATALOG_RANGE 1048576				// rows of a query task
+
+// The columns, in catalog_columns[] order
+enum catalog_column {
+    CAT_INO,
+    CAT_SIZE,
+    CAT_BLOCKS,
+    CAT_MTIME,
+    CAT_ATIME,
+    CAT_UID,
+    CAT_GID,
+    CAT_MODE,
+    CAT_PATHOFF,
+    CAT_PATH,
+    CAT_COLUMNS
+};
+
+// This rank's shard of a catalog being written
+struct catalog {
+    char dir[PATHSIZE_PLUS];				// the catalog directory. "" -> no catalog
+    int rank;
+    FILE *col[CAT_COLUMNS];				// opened with the first row
+    uint64_t rows;
+    uint64_t heap;					// bytes in the path heap
+    int failed;
+};
+typedef struct catalog catalog;
+
+// A shard of a catalog, mapped in memory
+struct catalog_shard {
+    char *col[CAT_COLUMNS];
+    size_t len[CAT_COLUMNS];
+    uint64_t rows;
+};
+typedef struct catalog_shard catalog_shard;
+
+int prepare_catalog(const char *dir);
+void init_catalog(catalog *c, const char *dir, int rank);
+void catalog_add(catalog *c, const char *path, struct stat *st);
+int close_catalog(catalog *c, uint64_t *rows);
+int write_catalog_manifest(const char *dir, const double *rows, int nshards);
+int read_catalog_manifest(const char *dir, int **ranks, uint64_t **rows);
+int open_catalog_shard(catalog_shard *s, const char *dir, int rank);
+size_t catalog_match(catalog_shard *s, filter *f, uint64_t first, size_t count, unsigned char *mask);
+void catalog_row(catalog_shard *s, uint64_t row, const char **path, struct stat *st);
+void close_catalog_shard(catalog_shard *s);
+
+#endif
@@ -17,6 +17,8 @@
 
 #define CTM_TEST_XATTR "user.xfer._test_"
 
+static CTM_ITYPE _defaultCTM = CTM_NONE;		// implementation to use for every file. CTM_NONE -> test each file
+
 /**
 * Returns a CTM Impleentation in String format.
 * See ctm.h for the list of implementations.
@@ -35,6 +37,17 @@ char *_impl2str(CTM_ITYPE implidx) {
 	return((implidx > CTM_UNKNOWN)?"Unknown CTM":IMPLSTR[implidx]);
 }
 
+/**
+* Sets the implementation used to store CTM for all files,
+* instead of testing each file for xattr support. Passing
+* CTM_NONE goes back to testing each file.
+*
+* @param implidx	the implementation type to use
+*/
+void setCTMImpl(CTM_ITYPE implidx) {
+	_defaultCTM = (implidx == CTM_FILE || implidx == CTM_XATTR)?implidx:CTM_NONE;
+}
+
 /**
 * This function determines how CTM is stored in the persistent
 * store, based on where the file is stored. That is to say,
@@ -51,6 +64,8 @@ char *_impl2str(CTM_ITYPE implidx) {
 CTM_ITYPE _whichCTM(const char *transfilename) {
 	CTM_ITYPE itype =  CTM_NONE;			// implementation type. Start with no CTM implementation
 
+	if(!strIsBlank(transfilename) && _defaultCTM != CTM_NONE)
+	  return(_defaultCTM);				// implementation set for the file system -> no need to test
 	if(!strIsBlank(transfilename)) {		// non-blank filename -> test if tranferred file supports xattrs
 	  if(!setxattr(transfilename,CTM_TEST_XATTR,"novalue",strlen("novalue")+1,0)) {
 	    removexattr(transfilename,CTM_TEST_XATTR);	// done with test -> remove it.
@@ -140,6 +155,7 @@ void freeCTM(CTM **pctmptr) {
 
 	if(ctmptr) {
 	  if(ctmptr->chnkflags) free(ctmptr->chnkflags);
+	  if(ctmptr->chnkpart) free(ctmptr->chnkpart);
 	  if(!strIsBlank(ctmptr->chnkfname)) free(ctmptr->chnkfname);
 	  free(ctmptr);
 	  *pctmptr = (CTM*)NULL;				// make sure that the pointer to the structure is zeroed out. Note in order to change value, need to
@@ -53,6 +53,7 @@ struct ctm_struct {
 	long chnknum;					// number of chunks to transfer
 	size_t chnksz;					// size of the chunk for this file during a transfer
 	unsigned long *chnkflags;			// a bit array of longs (64 bit), which indicate if a chunk has been transferred or not
+	off_t *chnkpart;				// bytes transferred of chunks that were split. Not kept in the persistent store
 	CTM_IMPL impl;					// structure holding the function pointers for this CTM storage implementation
 };
 
@@ -77,6 +78,7 @@ CTM *getCTM(const char *transfilename, long numchunks, size_t chunksize);
 int updateCTM(CTM *ctmptr, long chnkidx);
 int removeCTM(CTM **pctmptr);
 int hasCTM(const char *transfilename);
+void setCTMImpl(CTM_ITYPE implidx);
 void purgeCTM(const char *transfilename);
 
 #endif //__CTM_H
@@ -0,0 +1,306 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+/**
+* Implements usage totals (see du.h)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "du.h"
+
+/**
+* Initializes the usage tables of a rank.
+*
+* @param du		the tables to initialize
+* @param depth		deepest directories reported. < 0 -> no totals
+* @param root		where the walk starts. "" -> /
+*/
+void init_du(du_table *du, int depth, const char *root) {
+    memset(du, 0, sizeof(du_table));
+    du->depth = depth;
+    strncpy(du->root, root, PATHSIZE_PLUS);
+    du->root[PATHSIZE_PLUS-1] = '\0';
+    while (du->root[0] && du->root[strlen(du->root) - 1] == '/') {
+        du->root[strlen(du->root) - 1] = '\0';
+    }
+}
+
+/**
+* Finds the totals of a key, adding them if they are new. The
+* table grows to keep it at most half full.
+*
+* @param du		the tables
+* @param kind		enum du_kind
+* @param key		the directory, or the uid/gid
+*
+* @return the totals of the key
+*/
+static du_totals *du_find(du_table *du, int kind, const char *key) {
+    du_entry *old_slots = du->slots;
+    size_t old_size = du->size;
+    size_t i, j;
+
+    if (2*(du->count + 1) > du->size) {
+        du->size = (du->size)?2*du->size:1024;
+        du->slots = (du_entry *) calloc(du->size, sizeof(du_entry));
+        for (i = 0; i < old_size; i++) {
+            if (old_slots[i].key != NULL) {
+                for (j = (name_hash(old_slots[i].key) + old_slots[i].kind) & (du->size - 1); du->slots[j].key != NULL; j = (j + 1) & (du->size - 1));
+                du->slots[j] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+    for (j = (name_hash(key) + kind) & (du->size - 1); du->slots[j].key != NULL; j = (j + 1) & (du->size - 1)) {
+        if (du->slots[j].kind == kind && !strcmp(du->slots[j].key, key)) {
+            return &du->slots[j].t;
+        }
+    }
+    du->slots[j].key = strdup(key);
+    du->slots[j].kind = kind;
+    du->count++;
+    return &du->slots[j].t;
+}
+
+// Adds totals to others
+static void du_sum(du_totals *to, const du_totals *from) {
+    to->bytes += from->bytes;
+    to->blocks += from->blocks;
+    to->files += from->files;
+    to->dirs += from->dirs;
+}
+
+/**
+* Adds an entry of the walk to the tables of a rank. A file
+* counts for its directory, a directory for itself, and both
+* for the ancestor at the -m depth if they are deeper.
+*
+* @param du		the tables
+* @param path		the path of the entry
+* @param st		the stat of the entry
+*/
+void du_add(du_table *du, const char *path, struct stat *st) {
+    char key[PATHSIZE_PLUS], id[32];
+    du_totals t;
+    size_t rootlen = strlen(du->root);
+    char *rel, *end;
+    int depth;
+
+    if (du->depth < 0) {
+        return;
+    }
+    memset(&t, 0, sizeof(du_totals));
+    t.blocks = st->st_blocks;
+    if (S_ISDIR(st->st_mode)) {
+        t.dirs = 1;
+    }
+    else {
+        t.files = 1;
+        t.bytes = st->st_size;
+    }
+    strncpy(key, path, PATHSIZE_PLUS);
+    key[PATHSIZE_PLUS-1] = '\0';
+    if (!S_ISDIR(st->st_mode) && (end = strrchr(key, '/')) != NULL) {	// a file counts for its directory
+        *end = '\0';
+    }
+    if (!strncmp(key, du->root, rootlen) && (key[rootlen] == '/' || key[rootlen] == '\0')) {
+        rel = key + rootlen;
+        for (depth = 0; *rel == '/'; depth++) {
+            if (depth == du->depth) {					// deeper -> counts for its ancestor
+                *rel = '\0';
+                break;
+            }
+            rel = strchr(rel + 1, '/');
+            if (rel == NULL) {
+                break;
+            }
+        }
+    }
+    if (!key[0]) {
+        strcpy(key, "/");
+    }
+    du_sum(du_find(du, DU_DIR, key), &t);
+    snprintf(id, sizeof(id), "%lu", (unsigned long) st->st_uid);
+    du_sum(du_find(du, DU_UID, id), &t);
+    snprintf(id, sizeof(id), "%lu", (unsigned long) st->st_gid);
+    du_sum(du_find(du, DU_GID, id), &t);
+}
+
+/**
+* Merges the tables of all ranks into the manager's, up a
+* binary tree: in round s, rank r + s sends its tables to rank
+* r (for r a multiple of 2s), so that there are log2(ranks)
+* rounds and no rank receives more than one message per round.
+* Every rank has to call it, after the walk.
+*
+* @param du		the tables of this rank. The manager's end up
+* 			with the totals of all ranks
+* @param rank		the rank of this process
+*/
+void du_reduce(du_table *du, int rank) {
+    MPI_Status status;
+    char *buf, *p;
+    char key[PATHSIZE_PLUS];
+    int len, keylen, kind;
+    du_totals t;
+    int nproc, step;
+    size_t i;
+
+    MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+    for (step = 1; step < nproc; step *= 2) {
+        if (rank % (2*step) == step) {				// send up the tree, and stop
+            len = 0;
+            for (i = 0; i < du->size; i++) {
+                if (du->slots[i].key != NULL) {
+                    len += 2*sizeof(int) + sizeof(du_totals) + strlen(du->slots[i].key);
+                }
+            }
+            p = buf = (char *) malloc(len + 1);
+            for (i = 0; i < du->size; i++) {
+                if (du->slots[i].key != NULL) {
+                    keylen = strlen(du->slots[i].key);
+                    memcpy(p, &du->slots[i].kind, sizeof(int));
+                    memcpy(p + sizeof(int), &keylen, sizeof(int));
+                    memcpy(p + 2*sizeof(int), &du->slots[i].t, sizeof(du_totals));
+                    memcpy(p + 2*sizeof(int) + sizeof(du_totals), du->slots[i].key, keylen);
+                    p += 2*sizeof(int) + sizeof(du_totals) + keylen;
+                }
+            }
+            if (MPI_Send(&len, 1, MPI_INT, rank - step, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+                MPI_Send(buf, len, MPI_CHAR, rank - step, 0, MPI_COMM_WORLD) != MPI_SUCCESS) {
+                fprintf(stderr, "Failed to send usage totals to rank %d\n", rank - step);
+            }
+            free(buf);
+            return;
+        }
+        if (rank % (2*step) == 0 && rank + step < nproc) {		// merge the tables of rank + step
+            if (MPI_Recv(&len, 1, MPI_INT, rank + step, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+                fprintf(stderr, "Failed to receive usage totals from rank %d\n", rank + step);
+                continue;
+            }
+            buf = (char *) malloc(len + 1);
+            if (MPI_Recv(buf, len, MPI_CHAR, rank + step, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+                fprintf(stderr, "Failed to receive usage totals from rank %d\n", rank + step);
+                free(buf);
+                continue;
+            }
+            for (p = buf; p < buf + len; p += 2*sizeof(int) + sizeof(du_totals) + keylen) {
+                memcpy(&kind, p, sizeof(int));
+                memcpy(&keylen, p + sizeof(int), sizeof(int));
+                memcpy(&t, p + 2*sizeof(int), sizeof(du_totals));
+                memcpy(key, p + 2*sizeof(int) + sizeof(du_totals), keylen);
+                key[keylen] = '\0';
+                du_sum(du_find(du, kind, key), &t);
+            }
+            free(buf);
+        }
+    }
+}
+
+// qsort() order of the report: directories by path, then uids and gids by number
+static int du_entry_cmp(const void *a, const void *b) {
+    const du_entry *x = *(const du_entry **)a, *y = *(const du_entry **)b;
+
+    if (x->kind != y->kind) {
+        return x->kind - y->kind;
+    }
+    if (x->kind != DU_DIR) {
+        return (strtoul(x->key, NULL, 10) < strtoul(y->key, NULL, 10))?-1:(strtoul(x->key, NULL, 10) > strtoul(y->key, NULL, 10));
+    }
+    return strcmp(x->key, y->key);
+}
+
+/**
+* Prints the usage report of the merged tables: every directory
+* down to the -m depth with the totals of everything below it,
+* then the totals of each uid and gid. Called by the manager
+* after du_reduce().
+*
+* @param du		the merged tables
+*/
+void du_report(du_table *du) {
+    static const char *kinds[] = {"DIR", "UID", "GID"};
+    const char *rootkey = (du->root[0])?du->root:"/";
+    size_t rootlen = strlen(du->root);
+    char key[PATHSIZE_PLUS];
+    char **dirs;
+    du_totals *own;
+    du_entry **entries;
+    size_t i, n = 0;
+    char *end;
+
+    if (du->depth < 0) {
+        return;
+    }
+    //add the totals of each directory to the directories above it, up to the root.
+    //du_find() may move the entries, so their keys and totals are copied first
+    dirs = (char **) malloc(du->count * sizeof(char *));
+    own = (du_totals *) malloc(du->count * sizeof(du_totals));
+    for (i = 0; i < du->size; i++) {
+        if (du->slots[i].key != NULL && du->slots[i].kind == DU_DIR) {
+            dirs[n] = du->slots[i].key;
+            own[n] = du->slots[i].t;
+            n++;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (strncmp(dirs[i], du->root, rootlen) || (dirs[i][rootlen] != '/' && dirs[i][rootlen] != '\0')) {
+            continue;						// not below the root
+        }
+        strncpy(key, dirs[i], PATHSIZE_PLUS);
+        while (strcmp(key, rootkey) && (end = strrchr(key, '/')) != NULL) {
+            if (end == key) {
+                end++;							// the parent of /x is /
+            }
+            *end = '\0';
+            du_sum(du_find(du, DU_DIR, key), &own[i]);
+        }
+    }
+    free(dirs);
+    free(own);
+    entries = (du_entry **) malloc(du->count * sizeof(du_entry *));
+    for (i = 0, n = 0; i < du->size; i++) {
+        if (du->slots[i].key != NULL) {
+            entries[n++] = &du->slots[i];
+        }
+    }
+    qsort(entries, n, sizeof(du_entry *), du_entry_cmp);
+    printf("INFO  DU       %-4s %21s %21s %12s %10s %s\n", "", "Bytes", "Allocated", "Files", "Dirs", "Path/Id");
+    for (i = 0; i < n; i++) {
+        printf("INFO  DU       %-4s %21llu %21llu %12llu %10llu %s\n", kinds[entries[i]->kind],
+               (unsigned long long) entries[i]->t.bytes, (unsigned long long) entries[i]->t.blocks * 512,
+               (unsigned long long) entries[i]->t.files, (unsigned long long) entries[i]->t.dirs, entries[i]->key);
+    }
+    fflush(stdout);
+    free(entries);
+}
+
+/**
+* Frees the usage tables of a rank.
+*
+* @param du		the tables
+*/
+void free_du(du_table *du) {
+    size_t i;
+
+    for (i = 0; i < du->size; i++) {
+        free(du->slots[i].key);
+    }
+    free(du->slots);
+    du->slots = NULL;
+    du->size = 0;
+    du->count = 0;
+}
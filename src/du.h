@@ -0,0 +1,69 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+//
+// Defines for usage totals (-m, and -w 4). Every rank adds up what it
+// walks in its own tables: bytes, files, directories and allocated
+// blocks per directory, and per uid and gid. Directories deeper than
+// the -m depth below the start of the walk are added to their ancestor
+// at that depth. At the end of the run the tables are merged up a
+// binary tree of ranks, and the manager adds each directory to the
+// directories above it and prints the report.
+//
+
+#ifndef      __DU_H
+#define      __DU_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "pfutils.h"
+
+enum du_kind {
+    DU_DIR,
+    DU_UID,
+    DU_GID
+};
+
+struct du_totals {
+    uint64_t bytes;					// sizes of the files and links
+    uint64_t blocks;					// 512 byte blocks allocated, directories too
+    uint64_t files;
+    uint64_t dirs;
+};
+typedef struct du_totals du_totals;
+
+struct du_entry {
+    char *key;						// a directory, or a uid/gid in decimal
+    int kind;						// enum du_kind
+    du_totals t;
+};
+typedef struct du_entry du_entry;
+
+struct du_table {
+    du_entry *slots;					// open addressing, at most half full
+    size_t size;
+    size_t count;
+    int depth;						// deepest directories reported. < 0 -> no totals
+    char root[PATHSIZE_PLUS];				// where the walk starts. "" -> /
+};
+typedef struct du_table du_table;
+
+void init_du(du_table *du, int depth, const char *root);
+void du_add(du_table *du, const char *path, struct stat *st);
+void du_reduce(du_table *du, int rank);
+void du_report(du_table *du);
+void free_du(du_table *du);
+
+#endif
@@ -0,0 +1,390 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+/**
+* Implements filter expressions (see filter.h)
+*/
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "str.h"
+
+// Field names, in enum filter_field order
+static const char *filter_fields[] = {"size", "blocks", "mtime", "atime", "uid", "gid", "type", "name", "path", NULL};
+
+/**
+* Parses an age: a number of seconds, or of the unit of its
+* suffix (s, m, h, d, w or y).
+*
+* @param str		the age
+* @param age		gets the age in seconds
+*
+* @return 0 on success, -1 if the age is not valid
+*/
+static int parse_age(const char *str, int64_t *age) {
+    char *end;
+    double n = strtod(str, &end);
+
+    switch (tolower(*end)) {
+        case '\0': case 's': break;
+        case 'm': n *= 60; break;
+        case 'h': n *= 3600; break;
+        case 'd': n *= 86400; break;
+        case 'w': n *= 7*86400; break;
+        case 'y': n *= 365*86400; break;
+        default: return -1;
+    }
+    if (end == str || (*end && end[1])) {
+        return -1;
+    }
+    *age = (int64_t) n;
+    return 0;
+}
+
+/**
+* Sorts the glob of a term, so that the common shapes are
+* matched with a string compare (see filter_glob()).
+*
+* @param t		the term
+*/
+static void sort_glob(filter_term *t) {
+    char *p = t->pattern;
+    size_t len = strlen(p);
+
+    t->match = FILTER_GLOB;
+    if (strpbrk(p, "*?[\\") == NULL) {
+        t->match = FILTER_EXACT;
+    }
+    else if (p[0] == '*' && strpbrk(p + 1, "*?[\\") == NULL) {
+        t->match = FILTER_SUFFIX;
+        memmove(p, p + 1, len);
+        len--;
+    }
+    else if (p[len - 1] == '*' && strpbrk(p, "*?[\\") == p + len - 1) {
+        t->match = FILTER_PREFIX;
+        p[--len] = '\0';
+    }
+    t->patlen = len;
+}
+
+/**
+* Parses a filter expression (see filter.h).
+*
+* @param f		gets the parsed filter
+* @param expr		the expression
+* @param now		the time ages are counted from
+* @param errmsg		gets a message if the expression is not valid
+* @param errlen		the size of errmsg
+*
+* @return 0 on success, -1 if the expression is not valid
+*/
+int parse_filter(filter *f, const char *expr, time_t now, char *errmsg, int errlen) {
+    char buf[1024];
+    char *term, *save, *op, *value;
+    filter_term *t;
+    int i;
+
+    memset(f, 0, sizeof(filter));
+    strncpy(buf, expr, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (term = strtok_r(buf, ",", &save); term != NULL; term = strtok_r(NULL, ",", &save)) {
+        if (f->count >= FILTER_TERMS) {
+            snprintf(errmsg, errlen, "More than %d terms in filter %s", FILTER_TERMS, expr);
+            return -1;
+        }
+        t = &f->terms[f->count];
+        if ((op = strpbrk(term, "<>=!")) == NULL) {
+            snprintf(errmsg, errlen, "No operator in filter term %s", term);
+            return -1;
+        }
+        for (i = 0; filter_fields[i] != NULL; i++) {
+            if (strlen(filter_fields[i]) == (size_t)(op - term) && !strncmp(term, filter_fields[i], op - term)) {
+                break;
+            }
+        }
+        if (filter_fields[i] == NULL) {
+            snprintf(errmsg, errlen, "Unknown field in filter term %s", term);
+            return -1;
+        }
+        t->field = i;
+        value = op + 1;
+        if (op[0] == '<') {
+            t->op = (op[1] == '=')?FILTER_LE:FILTER_LT;
+        }
+        else if (op[0] == '>') {
+            t->op = (op[1] == '=')?FILTER_GE:FILTER_GT;
+        }
+        else if (op[0] == '=') {
+            t->op = FILTER_EQ;
+        }
+        else if (op[1] == '=') {
+            t->op = FILTER_NE;
+        }
+        else {
+            snprintf(errmsg, errlen, "Bad operator in filter term %s", term);
+            return -1;
+        }
+        if (t->op == FILTER_LE || t->op == FILTER_GE || t->op == FILTER_NE) {
+            value++;
+        }
+        switch (t->field) {
+            case FILTER_SIZE:
+            case FILTER_BLOCKS:
+                t->value = (int64_t) str2Size(value);
+                break;
+            case FILTER_MTIME:
+            case FILTER_ATIME:
+                if (parse_age(value, &t->value) != 0) {
+                    snprintf(errmsg, errlen, "Bad age in filter term %s", term);
+                    return -1;
+                }
+                t->value = now - t->value;				// older is a smaller time
+                if (t->op != FILTER_EQ && t->op != FILTER_NE) {
+                    t->op = FILTER_GT + FILTER_LT - t->op;
+                }
+                break;
+            case FILTER_UID:
+            case FILTER_GID:
+                t->value = strtoll(value, NULL, 10);
+                break;
+            case FILTER_TYPE:
+                if (value[0] == '\0' || value[1] != '\0' || strchr("fdl", value[0]) == NULL) {
+                    snprintf(errmsg, errlen, "Bad type in filter term %s (f, d or l)", term);
+                    return -1;
+                }
+                t->value = (*value == 'd')?S_IFDIR:(*value == 'l')?S_IFLNK:S_IFREG;
+                break;
+            default:
+                strncpy(t->pattern, value, FILTER_PATTERN - 1);
+                sort_glob(t);
+                break;
+        }
+        if ((t->field == FILTER_TYPE || t->field == FILTER_NAME || t->field == FILTER_PATH) && t->op != FILTER_EQ && t->op != FILTER_NE) {
+            snprintf(errmsg, errlen, "Only = and != work with filter term %s", term);
+            return -1;
+        }
+        f->count++;
+    }
+    return 0;
+}
+
+// Compares two numbers with a filter operator
+#define FILTER_CMP(op, a, b) \
+    ((op) == FILTER_LT?(a) < (b):(op) == FILTER_LE?(a) <= (b):(op) == FILTER_EQ?(a) == (b): \
+     (op) == FILTER_NE?(a) != (b):(op) == FILTER_GE?(a) >= (b):(a) > (b))
+
+/**
+* Tests a name or path term.
+*
+* @param t		the term
+* @param path		the path of the entry
+*
+* @return 1 if the entry matches, 0 otherwise
+*/
+int filter_glob(filter_term *t, const char *path) {
+    const char *name = path;
+    size_t len;
+    int match;
+
+    if (t->field == FILTER_NAME && (name = strrchr(path, '/')) != NULL) {
+        name++;
+    }
+    else if (name == NULL) {
+        name = path;
+    }
+    switch (t->match) {
+        case FILTER_EXACT:
+            match = !strcmp(name, t->pattern);
+            break;
+        case FILTER_PREFIX:
+            match = !strncmp(name, t->pattern, t->patlen);
+            break;
+        case FILTER_SUFFIX:
+            len = strlen(name);
+            match = (len >= (size_t) t->patlen && !memcmp(name + len - t->patlen, t->pattern, t->patlen));
+            break;
+        default:
+            match = (fnmatch(t->pattern, name, 0) == 0);
+            break;
+    }
+    return (t->op == FILTER_EQ)?match:!match;
+}
+
+/**
+* Tests an entry against a filter.
+*
+* @param f		the filter
+* @param path		the path of the entry
+* @param st		the stat of the entry
+*
+* @return 1 if the entry matches every term, 0 otherwise
+*/
+int filter_stat(filter *f, const char *path, struct stat *st) {
+    filter_term *t;
+    int64_t v;
+    int i;
+
+    for (i = 0; i < f->count; i++) {
+        t = &f->terms[i];
+        switch (t->field) {
+            case FILTER_SIZE: v = st->st_size; break;
+            case FILTER_BLOCKS: v = st->st_blocks; break;
+            case FILTER_MTIME: v = st->st_mtime; break;
+            case FILTER_ATIME: v = st->st_atime; break;
+            case FILTER_UID: v = st->st_uid; break;
+            case FILTER_GID: v = st->st_gid; break;
+            case FILTER_TYPE: v = st->st_mode & S_IFMT; break;
+            default:
+                if (!filter_glob(t, path)) {
+                    return 0;
+                }
+                continue;
+        }
+        if (!FILTER_CMP(t->op, v, t->value)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+* Tests the terms of a filter that need no stat: the globs,
+* and the type if it is known. Used to drop entries of a walk
+* before they are stat'ed.
+*
+* @param f		the filter
+* @param path		the path of the entry
+* @param type		the S_IFMT type of the entry. 0 -> not known
+*
+* @return 0 if the entry does not match, 1 if it may
+*/
+int filter_names(filter *f, const char *path, mode_t type) {
+    filter_term *t;
+    int i;
+
+    for (i = 0; i < f->count; i++) {
+        t = &f->terms[i];
+        if (t->field == FILTER_NAME || t->field == FILTER_PATH) {
+            if (!filter_glob(t, path)) {
+                return 0;
+            }
+        }
+        else if (t->field == FILTER_TYPE && type != 0) {
+            if ((t->op == FILTER_EQ) != ((int64_t) type == t->value)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+* Tests if a filter has a term on a field.
+*
+* @param f		the filter
+* @param field		the field (enum filter_field)
+*
+* @return 1 if it does, 0 otherwise
+*/
+int filter_has_field(filter *f, int field) {
+    int i;
+
+    for (i = 0; i < f->count; i++) {
+        if (f->terms[i].field == field) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The loop of a column filter, with the comparison fixed so that the compiler vectorizes it
+#define FILTER_LOOP(cmp) \
+    for (i = 0; i < n; i++) { \
+        mask[i] &= (col[i] cmp v); \
+    }
+
+/**
+* Applies a term to a column of 64 bit numbers: clears the
+* mask of the rows that do not match.
+*
+* @param t		the term
+* @param col		the column
+* @param mask		1 per row that matches so far
+* @param n		the number of rows
+*/
+void filter_int64(filter_term *t, const int64_t *col, unsigned char *mask, size_t n) {
+    int64_t v = t->value;
+    size_t i;
+
+    switch (t->op) {
+        case FILTER_LT: FILTER_LOOP(<); break;
+        case FILTER_LE: FILTER_LOOP(<=); break;
+        case FILTER_EQ: FILTER_LOOP(==); break;
+        case FILTER_NE: FILTER_LOOP(!=); break;
+        case FILTER_GE: FILTER_LOOP(>=); break;
+        default: FILTER_LOOP(>); break;
+    }
+}
+
+/**
+* Applies a term to a column of 32 bit numbers (see
+* filter_int64()).
+*
+* @param t		the term
+* @param col		the column
+* @param mask		1 per row that matches so far
+* @param n		the number of rows
+*/
+void filter_uint32(filter_term *t, const uint32_t *col, unsigned char *mask, size_t n) {
+    int64_t v = t->value;
+    size_t i;
+
+    switch (t->op) {
+        case FILTER_LT: FILTER_LOOP(<); break;
+        case FILTER_LE: FILTER_LOOP(<=); break;
+        case FILTER_EQ: FILTER_LOOP(==); break;
+        case FILTER_NE: FILTER_LOOP(!=); break;
+        case FILTER_GE: FILTER_LOOP(>=); break;
+        default: FILTER_LOOP(>); break;
+    }
+}
+
+/**
+* Applies a type term to a column of modes (see
+* filter_int64()).
+*
+* @param t		the term
+* @param mode		the column of modes
+* @param mask		1 per row that matches so far
+* @param n		the number of rows
+*/
+void filter_type(filter_term *t, const uint32_t *mode, unsigned char *mask, size_t n) {
+    uint32_t v = t->value;
+    size_t i;
+
+    if (t->op == FILTER_EQ) {
+        for (i = 0; i < n; i++) {
+            mask[i] &= ((mode[i] & S_IFMT) == v);
+        }
+    }
+    else {
+        for (i = 0; i < n; i++) {
+            mask[i] &= ((mode[i] & S_IFMT) != v);
+        }
+    }
+}
@@ -0,0 +1,98 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+//
+// Defines for filter expressions (-e). An expression is a comma
+// separated list of terms, all of which an entry has to match:
+//
+//	size>1G,mtime>730d,uid=1000,type=f,name=*.h5
+//
+// Fields are size, blocks, mtime, atime, uid, gid, type (f, d or l),
+// name (a glob on the last component) and path (a glob on the whole
+// path). Times are ages: mtime>730d is "modified more than 730 days
+// ago" (suffixes s, m, h, d, w, y). Operators are <, <=, =, !=, >=, >.
+// Expressions are parsed once, by the manager, and the parsed filter
+// is broadcast to all ranks. Globs are sorted when parsed: the common
+// "*.h5", "run*" and "name" shapes are then matched without fnmatch().
+//
+// Copies and listings (-w 0, 1, 2) test the filter on every entry of the
+// walk. Entries that do not match are not processed, but directories are
+// always walked.
+//
+
+#ifndef      __FILTER_H
+#define      __FILTER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define FILTER_TERMS 16					// most terms in an expression
+#define FILTER_PATTERN 256				// longest glob
+
+enum filter_field {
+    FILTER_SIZE,
+    FILTER_BLOCKS,
+    FILTER_MTIME,
+    FILTER_ATIME,
+    FILTER_UID,
+    FILTER_GID,
+    FILTER_TYPE,
+    FILTER_NAME,
+    FILTER_PATH
+};
+
+enum filter_op {
+    FILTER_LT,
+    FILTER_LE,
+    FILTER_EQ,
+    FILTER_NE,
+    FILTER_GE,
+    FILTER_GT
+};
+
+// How a glob is matched
+enum filter_match {
+    FILTER_GLOB,					// fnmatch()
+    FILTER_EXACT,					// no wildcards
+    FILTER_PREFIX,					// "abc*"
+    FILTER_SUFFIX					// "*abc"
+};
+
+struct filter_term {
+    int field;						// enum filter_field
+    int op;						// enum filter_op
+    int match;						// enum filter_match of a glob
+    int patlen;						// length of the literal part of a glob
+    int64_t value;					// times are absolute here (ages are turned around when parsed)
+    char pattern[FILTER_PATTERN];			// the glob of name and path terms
+};
+typedef struct filter_term filter_term;
+
+struct filter {
+    int count;						// number of terms. 0 -> everything matches
+    filter_term terms[FILTER_TERMS];
+};
+typedef struct filter filter;
+
+int parse_filter(filter *f, const char *expr, time_t now, char *errmsg, int errlen);
+int filter_stat(filter *f, const char *path, struct stat *st);
+int filter_names(filter *f, const char *path, mode_t type);
+int filter_has_field(filter *f, int field);
+void filter_int64(filter_term *t, const int64_t *col, unsigned char *mask, size_t n);
+void filter_uint32(filter_term *t, const uint32_t *col, unsigned char *mask, size_t n);
+void filter_type(filter_term *t, const uint32_t *mode, unsigned char *mask, size_t n);
+int filter_glob(filter_term *t, const char *path);
+
+#endif
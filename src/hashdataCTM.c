@@ -49,7 +49,9 @@ void hashdata_destroy(HASHDATA **theData) {
 /**
 * Updates the HASHDATA structure. This reads given
 * path_item and uses the chkidx to update the CTM
-* structure apropriately.
+* structure apropriately. A split piece of a chunk
+* (chklen > 0) only marks the chunk transferred once
+* all of the pieces of the chunk are in.
 * 
 * @param theData	the HASHDATA structure to
 * 			update
@@ -57,7 +59,19 @@ void hashdata_destroy(HASHDATA **theData) {
 * 			updating the CTM
 */
 void hashdata_update(HASHDATA *theData,path_item fileinfo) {
-	updateCTM((CTM *)theData,fileinfo.chkidx);			// marks the chunk transferred
+	CTM *ctm = (CTM *)theData;
+
+	if(fileinfo.chklen > 0) {					// a piece of a split chunk
+	  off_t offset = fileinfo.chkidx*fileinfo.chksz;
+	  off_t length = ((offset+fileinfo.chksz)>fileinfo.st.st_size)?(fileinfo.st.st_size-offset):fileinfo.chksz;
+
+	  if(!ctm->chnkpart)
+	    ctm->chnkpart = (off_t *)calloc(ctm->chnknum,sizeof(off_t));
+	  ctm->chnkpart[fileinfo.chkidx] += fileinfo.chklen;
+	  if(ctm->chnkpart[fileinfo.chkidx] < length)
+	    return;							// more pieces to come
+	}
+	updateCTM(ctm,fileinfo.chkidx);					// marks the chunk transferred
 	return;
 }
 
@@ -0,0 +1,135 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+/**
+* Implements histograms (see hist.h)
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pfutils.h"
+#include "hist.h"
+
+// Names of the metrics, in enum hist_metric order
+static const char *hist_metrics[] = {"size", "blocks", "mtime_age", "atime_age"};
+
+/**
+* Initializes the histograms of a rank.
+*
+* @param h		the histograms
+* @param on		0 -> nothing is counted
+* @param now		the time ages are counted from
+*/
+void init_histogram(histogram *h, int on, time_t now) {
+    memset(h, 0, sizeof(histogram));
+    h->on = on;
+    h->now = now;
+}
+
+/**
+* Gets the log2 bucket of a value.
+*
+* @param v		the value
+*
+* @return 0 for 0, else 1 + the index of the highest bit set
+*/
+static int hist_bucket(unsigned long long v) {
+    return (v == 0)?0:64 - __builtin_clzll(v);
+}
+
+/**
+* Counts a file or link of the walk. Directories are not
+* counted.
+*
+* @param h		the histograms
+* @param st		the stat of the entry
+*/
+void histogram_add(histogram *h, struct stat *st) {
+    double size = st->st_size;
+    int b;
+
+    if (!h->on || S_ISDIR(st->st_mode)) {
+        return;
+    }
+    b = hist_bucket(st->st_size);
+    h->count[HIST_SIZE][b]++;
+    h->bytes[HIST_SIZE][b] += size;
+    b = hist_bucket(st->st_blocks);
+    h->count[HIST_BLOCKS][b]++;
+    h->bytes[HIST_BLOCKS][b] += size;
+    b = hist_bucket((st->st_mtime < h->now)?h->now - st->st_mtime:0);
+    h->count[HIST_MTIME][b]++;
+    h->bytes[HIST_MTIME][b] += size;
+    b = hist_bucket((st->st_atime < h->now)?h->now - st->st_atime:0);
+    h->count[HIST_ATIME][b]++;
+    h->bytes[HIST_ATIME][b] += size;
+}
+
+/**
+* Sums the histograms of all ranks into the manager's. Every
+* rank has to call it, after the walk.
+*
+* @param h		the histograms of this rank
+* @param sum		gets the sums (on the manager only)
+* @param rank		the rank of this process
+*/
+void histogram_reduce(histogram *h, histogram *sum, int rank) {
+    MPI_Reduce(h->count, (rank == MANAGER_PROC)?sum->count:NULL, HIST_METRICS * HIST_BUCKETS, MPI_DOUBLE, MPI_SUM, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Reduce(h->bytes, (rank == MANAGER_PROC)?sum->bytes:NULL, HIST_METRICS * HIST_BUCKETS, MPI_DOUBLE, MPI_SUM, MANAGER_PROC, MPI_COMM_WORLD);
+}
+
+/**
+* Prints the summed histograms, or writes them as CSV. Empty
+* buckets are left out.
+*
+* @param h		the summed histograms
+* @param csv		the CSV file. "-" -> print INFO HIST lines
+*
+* @return 0 on success, -1 if the CSV file could not be written
+*/
+int histogram_report(histogram *h, const char *csv) {
+    FILE *fp = stdout;
+    double lo, hi;
+    int m, b;
+
+    if (strcmp(csv, "-") && (fp = fopen(csv, "w")) == NULL) {
+        return -1;
+    }
+    if (fp == stdout) {
+        printf("INFO  HIST     %-10s %21s %21s %15s %21s\n", "Metric", "From", "Below", "Files", "Bytes");
+    }
+    else {
+        fprintf(fp, "metric,from,below,files,bytes\n");
+    }
+    for (m = 0; m < HIST_METRICS; m++) {
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            if (h->count[m][b] == 0) {
+                continue;
+            }
+            lo = (b == 0)?0:(double)(1ULL << (b - 1));
+            hi = (b == 0)?1:2*lo;
+            if (fp == stdout) {
+                printf("INFO  HIST     %-10s %21.0f %21.0f %15.0f %21.0f\n", hist_metrics[m], lo, hi, h->count[m][b], h->bytes[m][b]);
+            }
+            else {
+                fprintf(fp, "%s,%.0f,%.0f,%.0f,%.0f\n", hist_metrics[m], lo, hi, h->count[m][b], h->bytes[m][b]);
+            }
+        }
+    }
+    if (fp == stdout) {
+        fflush(stdout);
+        return 0;
+    }
+    return fclose(fp);
+}
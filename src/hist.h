@@ -0,0 +1,52 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+//
+// Defines for histograms (-H). Every rank counts the files and links it
+// walks in log2 buckets of size, blocks, mtime age and atime age, with
+// the bytes of each bucket. Bucket 0 holds 0; bucket i holds values from
+// 2^(i-1) up to 2^i. The manager sums the ranks' buckets with MPI_Reduce
+// at the end of the run, and prints them or writes them as CSV.
+//
+
+#ifndef      __HIST_H
+#define      __HIST_H
+
+#include <time.h>
+#include <sys/stat.h>
+
+#define HIST_BUCKETS 64
+
+enum hist_metric {
+    HIST_SIZE,
+    HIST_BLOCKS,
+    HIST_MTIME,						// age of the mtime, in seconds
+    HIST_ATIME,
+    HIST_METRICS
+};
+
+struct histogram {
+    double count[HIST_METRICS][HIST_BUCKETS];		// doubles, to be summed by MPI_Reduce
+    double bytes[HIST_METRICS][HIST_BUCKETS];
+    time_t now;						// ages are counted from here
+    int on;
+};
+typedef struct histogram histogram;
+
+void init_histogram(histogram *h, int on, time_t now);
+void histogram_add(histogram *h, struct stat *st);
+void histogram_reduce(histogram *h, histogram *sum, int rank);
+int histogram_report(histogram *h, const char *csv);
+
+#endif
@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <syslog.h>
+#include <pthread.h>
 
 // include that is associated with pftool itself
 #include "pftool.h"
@@ -46,6 +47,16 @@ int main(int argc, char *argv[]) {
     char src_path[PATHSIZE_PLUS], dest_path[PATHSIZE_PLUS];
     struct stat dest_stat;
     int statrc;
+    //file system profile
+    char profile_file[PATHSIZE_PLUS];
+    fs_profile *profile;
+    int fstype_set = 0, blocksize_set = 0, chunk_at_set = 0, chunksize_set = 0, io_threads_set = 0, stat_threads_set = 0;
+    //tree snapshot
+    char snapshot_info[PATHSIZE_PLUS];
+    int snapshot_matches = 0;
+    //query filter
+    char filter_expr[PATHSIZE_PLUS];
+    char errmsg[MESSAGESIZE];
     if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
         fprintf(stderr, "Error in MPI_Init\n");
         return -1;
@@ -73,6 +84,8 @@ int main(int argc, char *argv[]) {
         o.parallel_dest = 0;
         //1MB
         o.blocksize = 1048576;
+        o.min_blocksize = 0;
+        o.max_blocksize = 0;
         //10GB
         o.chunk_at = 107374182400;
         o.chunksize = 107374182400;
@@ -91,12 +104,44 @@ int main(int argc, char *argv[]) {
         o.plfs_chunksize = 104857600;
 #endif
         o.work_type = LSWORK;
+        o.io_threads = 1;
+        o.stat_threads = 1;
+        o.chunk_secs = 0;
+        o.split_at = 0;
+        o.batch_bytes = COPYBYTES;
+        o.batch_count = COPYBUFFER;
+        o.fixed_batches = 0;
+        o.split_dir = SPLITDIR_AT;
+        o.dest_listing = 0;
+        o.snapshot[0] = '\0';
+        o.snapshot_filter = 0;
+        o.catalog[0] = '\0';
+        o.filter.count = 0;
+        o.du_depth = -1;
+        o.histogram[0] = '\0';
+        o.plan[0] = '\0';
+        o.run_plan[0] = '\0';
+        o.queue_memory = 0;
+        o.backlog_high = 0;
+        o.backlog_low = 0;
+        o.backlog_high_items = 0;
+        o.backlog_low_items = 0;
+        o.locality_wait = -1;
+        o.dir_limit = 0;
+        o.dev_limit = 0;
+        o.copy_window = -1;
+        o.rate_bytes = 0.0;
+        o.rate_ops = 0.0;
+        o.rate_control[0] = '\0';
+        filter_expr[0] = '\0';
+        profile_file[0] = '\0';
+        dest_path[0] = '\0';
 #ifdef GEN_SYNDATA
 	o.syn_pattern[0] = '\0';		// Make sure synthetic data pattern file or name is clear
 	o.syn_size = 0;				// Clear the synthetic data size
 #endif
         // start MPI - if this fails we cant send the error to thtooloutput proc so we just die now
-        while ((c = getopt(argc, argv, "p:c:j:w:i:s:C:S:a:f:d:W:A:t:X:x:z:vrlPMnh")) != -1)
+        while ((c = getopt(argc, argv, "p:c:j:w:i:s:b:B:C:S:D:k:y:Y:u:I:O:e:m:H:g:G:q:Q:N:J:K:R:U:a:f:d:W:A:t:X:x:z:T:E:F:oLvrlPMnh")) != -1)
             switch(c) {
             case 'p':
                 //Get the source/beginning path
@@ -111,6 +156,7 @@ int main(int argc, char *argv[]) {
                 break;
             case 't':
                 strncpy(o.dest_fstype, optarg, 128);
+                fstype_set = 1;
                 break;
             case 'w':
                 o.work_type = atoi(optarg);
@@ -121,12 +167,59 @@ int main(int argc, char *argv[]) {
                 break;
             case 's':
                 o.blocksize = str2Size(optarg);
+                blocksize_set = 1;
+                break;
+            case 'b':
+                o.min_blocksize = str2Size(optarg);
+                break;
+            case 'B':
+                o.max_blocksize = str2Size(optarg);
                 break;
             case 'C':
                 o.chunk_at = str2Size(optarg);
+                chunk_at_set = 1;
                 break;
             case 'S':
                 o.chunksize = str2Size(optarg);
+                chunksize_set = 1;
+                break;
+            case 'D':
+                o.chunk_secs = atoi(optarg);
+                break;
+            case 'k':
+                o.split_at = str2Size(optarg);
+                break;
+            case 'y':
+                o.batch_bytes = str2Size(optarg);
+                break;
+            case 'Y':
+                o.batch_count = atoi(optarg);
+                if (o.batch_count < 1) {
+                    o.batch_count = 1;
+                }
+                break;
+            case 'u':
+                o.split_dir = atoi(optarg);
+                if (o.split_dir < 0) {
+                    o.split_dir = 0;
+                }
+                break;
+            case 'T':
+                o.io_threads = atoi(optarg);
+                if (o.io_threads < 1) {
+                    o.io_threads = 1;
+                }
+                io_threads_set = 1;
+                break;
+            case 'E':
+                o.stat_threads = atoi(optarg);
+                if (o.stat_threads < 1) {
+                    o.stat_threads = 1;
+                }
+                stat_threads_set = 1;
+                break;
+            case 'F':
+                strncpy(profile_file, optarg, PATHSIZE_PLUS);
                 break;
 	    case 'X':
 #ifdef GEN_SYNDATA
@@ -185,6 +278,72 @@ int main(int argc, char *argv[]) {
             case 'v':
                 o.verbose = 1;
                 break;
+            case 'o':
+                o.fixed_batches = 1;
+                break;
+            case 'L':
+                o.dest_listing = 1;
+                break;
+            case 'I':
+                strncpy(o.snapshot, optarg, PATHSIZE_PLUS);
+                break;
+            case 'O':
+                strncpy(o.catalog, optarg, PATHSIZE_PLUS);
+                break;
+            case 'e':
+                strncpy(filter_expr, optarg, PATHSIZE_PLUS);
+                break;
+            case 'H':
+                strncpy(o.histogram, optarg, PATHSIZE_PLUS);
+                break;
+            case 'g':
+                strncpy(o.plan, optarg, PATHSIZE_PLUS);
+                break;
+            case 'G':
+                strncpy(o.run_plan, optarg, PATHSIZE_PLUS);
+                break;
+            case 'q':
+                o.queue_memory = str2Size(optarg);
+                break;
+            case 'N':
+                o.locality_wait = atof(optarg)/1000.0;
+                if (o.locality_wait < 0) {
+                    o.locality_wait = 0;
+                }
+                break;
+            case 'R':
+                if (parse_rate(optarg, &o.rate_bytes, &o.rate_ops) != 0) {
+                    fprintf(stderr, "Bad rate: %s\n", optarg);
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+                }
+                break;
+            case 'U':
+                strncpy(o.rate_control, optarg, PATHSIZE_PLUS);
+                break;
+            case 'K':
+                o.copy_window = atoi(optarg);
+                if (o.copy_window < 0) {
+                    o.copy_window = 0;
+                }
+                break;
+            case 'J':
+                if (parse_target_limits(optarg, &o) != 0) {
+                    fprintf(stderr, "Bad target limits: %s\n", optarg);
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+                }
+                break;
+            case 'Q':
+                if (parse_backlog_marks(optarg, &o) != 0) {
+                    fprintf(stderr, "Bad backlog watermarks: %s\n", optarg);
+                    MPI_Abort(MPI_COMM_WORLD, -1);
+                }
+                break;
+            case 'm':
+                o.du_depth = atoi(optarg);
+                if (o.du_depth < 0) {
+                    o.du_depth = 0;
+                }
+                break;
             case 'h':
                 //Help -- incoming!
                 usage();
@@ -194,6 +353,58 @@ int main(int argc, char *argv[]) {
             default:
                 break;
             }
+        //pick the tuning profile of the destination file system. Options given on the command line win
+        if (profile_file[0] && load_fs_profiles(profile_file) < 0) {
+            fprintf(stderr, "Failed to read profiles from config file %s\n", profile_file);
+        }
+        profile = find_fs_profile((o.work_type == LSWORK || !dest_path[0])?src_path:dest_path, (fstype_set)?o.dest_fstype:NULL);
+        o.dest_profile = *profile;
+        if (!fstype_set) strncpy(o.dest_fstype, profile->name, 128);
+        if (!blocksize_set) o.blocksize = profile->blocksize;
+        if (!chunk_at_set) o.chunk_at = profile->chunk_at;
+        if (!chunksize_set) o.chunksize = profile->chunksize;
+        if (!io_threads_set && profile->io_threads > 0) o.io_threads = profile->io_threads;
+        profile = find_fs_profile(src_path, NULL);				// the tree walk stats the source file system
+        if (!stat_threads_set && profile->stat_threads > 0) o.stat_threads = profile->stat_threads;
+        //start the next tree snapshot. Unchanged files are only skipped if the last one was written by the same kind of copy
+        if (o.snapshot[0]) {
+            snprintf(snapshot_info, PATHSIZE_PLUS, "%d %s\n", o.work_type, dest_path);
+            if (prepare_snapshot(o.snapshot, snapshot_info, &snapshot_matches) != 0) {
+                fprintf(stderr, "Failed to set up snapshot directory %s. Not using snapshots\n", o.snapshot);
+                o.snapshot[0] = '\0';
+            }
+            o.snapshot_filter = (snapshot_matches && o.work_type == COPYWORK && o.different);
+        }
+        if (o.catalog[0] && prepare_catalog(o.catalog) != 0) {
+            fprintf(stderr, "Failed to set up catalog directory %s. Not writing a catalog\n", o.catalog);
+            o.catalog[0] = '\0';
+        }
+        //a plan-only run must not copy anything, so a plan that cannot be written stops it
+        if ((o.plan[0] || o.run_plan[0]) && (o.work_type != COPYWORK || o.use_file_list || (o.plan[0] && o.run_plan[0]))) {
+            fprintf(stderr, "Plans (-g and -G) are only made and run by copies (-w 0) of a tree (-p)\n");
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        if (o.plan[0] && prepare_plan(o.plan) != 0) {
+            fprintf(stderr, "Failed to set up plan directory %s\n", o.plan);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        if (filter_expr[0] && parse_filter(&o.filter, filter_expr, time(NULL), errmsg, MESSAGESIZE) != 0) {
+            fprintf(stderr, "%s\n", errmsg);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        //a du is a listing that only reports the usage totals
+        if (o.work_type == DUWORK) {
+            o.work_type = LSWORK;
+            o.verbose = 0;
+            if (o.du_depth < 0) {
+                o.du_depth = 1;
+            }
+        }
+        //a query reads the whole catalog given as the source path
+        if (o.work_type == QUERYWORK) {
+            o.recurse = 1;
+            o.catalog[0] = '\0';
+        }
     }
     MPI_Barrier(MPI_COMM_WORLD);
     //broadcast all the options
@@ -206,8 +417,47 @@ int main(int argc, char *argv[]) {
     MPI_Bcast(&o.work_type, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
     MPI_Bcast(&o.meta_data_only, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
     MPI_Bcast(&o.blocksize, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.min_blocksize, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.max_blocksize, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
     MPI_Bcast(&o.chunk_at, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
     MPI_Bcast(&o.chunksize, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.chunk_secs, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.split_at, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.batch_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.batch_count, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.fixed_batches, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.split_dir, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.dest_listing, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(o.snapshot, PATHSIZE_PLUS, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.snapshot_filter, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(o.catalog, PATHSIZE_PLUS, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.filter, sizeof(filter), MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.du_depth, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(o.histogram, PATHSIZE_PLUS, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(o.plan, PATHSIZE_PLUS, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(o.run_plan, PATHSIZE_PLUS, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.queue_memory, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.backlog_high, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.backlog_low, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.backlog_high_items, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.backlog_low_items, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.locality_wait, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.dir_limit, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.dev_limit, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.copy_window, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.rate_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.rate_ops, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(o.rate_control, PATHSIZE_PLUS, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
+    if (o.rate_control[0]) {					// SIGUSR1 -> the manager reads the rates again
+        catch_rate_signal(rank);
+    }
+    o.batch.dir = DIRBUFFER;					// starting batch sizes. The manager tunes them unless -o
+    o.batch.stat = STATBUFFER;
+    o.batch.copy = o.batch_count;
+    o.batch.message = MESSAGEBUFFER;
+    MPI_Bcast(&o.io_threads, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.stat_threads, 1, MPI_INT, MANAGER_PROC, MPI_COMM_WORLD);
+    MPI_Bcast(&o.dest_profile, sizeof(fs_profile), MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
 #ifdef FUSE_CHUNKER
     MPI_Bcast(o.archive_path, PATHSIZE_PLUS, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
     MPI_Bcast(o.fuse_path, PATHSIZE_PLUS, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
@@ -225,6 +475,12 @@ int main(int argc, char *argv[]) {
     MPI_Bcast(o.syn_pattern, 128, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
     MPI_Bcast(&o.syn_size, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
 #endif
+    if (!strcmp(o.dest_profile.ctm, "xattr")) {			// store CTM the way the destination profile asks
+        setCTMImpl(CTM_XATTR);
+    }
+    else if (!strcmp(o.dest_profile.ctm, "file")) {
+        setCTMImpl(CTM_FILE);
+    }
 
     //freopen( "/dev/null", "w", stderr );
     //Modifies the path based on recursion/wildcards
@@ -275,9 +531,27 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
     int work_rank, sending_rank;
     int i;
     int *proc_status;
+    int *split_status;						// 0 -> not copying, 1 -> copying, 2 -> asked to split its chunk
+    batch_control batches;					// batch size controller
+    flow_control flow;						// keeps the copy backlog between the watermarks
+    locality loc;						// nodes of the ranks, for dispatching copy work
+    int local_only;
+    target_limits targets;					// copy batches in flight per directory and device
+    copy_window window;						// AIMD control of the number of ranks copying
+    rate_limit rates;						// job-wide limits of bytes and files per second
+    size_t queued_bytes, batch_bytes;
+    int batch_count;
+    int queued;
+    int free_count, split_count;
     struct timeval in, out;
     int non_fatal = 0, examined_file_count = 0, examined_dir_count = 0;
     size_t examined_byte_count = 0;
+    char snapshot_info[PATHSIZE_PLUS];
+    int snap_failed, snap_failures;
+    double cat_count, *cat_rows;
+    double plan_count, *plan_items;
+    du_table du;
+    histogram hist, hist_sum;
 #ifdef TAPE
     int examined_tape_count = 0;
     size_t examined_tape_byte_count = 0;
@@ -290,8 +564,13 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
     path_list *iter = NULL;
     int  num_copied_files = 0;
     size_t num_copied_bytes = 0;
-    work_buf_list *stat_buf_list = NULL, *process_buf_list = NULL, *dir_buf_list = NULL;
-    int stat_buf_list_size = 0, process_buf_list_size = 0, dir_buf_list_size = 0;
+    size_t min_blocksize = 0, max_blocksize = 0;	// range of copy block sizes used by the workers
+    double blocksize_bytes = 0.0;			// sum of block size * bytes copied with it
+    size_t blocked_bytes = 0;				// bytes copied with a block size
+    size_t spilled_buffers, spilled_bytes;		// queued work that went to segment files
+    work_buf_list *stat_buf_list = NULL, *dir_buf_list = NULL;
+    int stat_buf_list_size = 0, dir_buf_list_size = 0;
+    size_queue process_queue;					// copy/compare work, by size
 #ifdef TAPE
     work_buf_list *tape_buf_list = NULL;
     int tape_buf_list_size = 0;
@@ -303,6 +582,7 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
     if (input_queue_count > 1) {
         wildcard = 1;
     }
+    init_locality(&loc, rank, nproc, o.locality_wait);
     //make directories if it's a copy job
     if (o.work_type == COPYWORK) {
         makedir = 1;
@@ -311,7 +591,7 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
         //setup paths
         strncpy(beginning_node.path, input_queue_head->data.path, PATHSIZE_PLUS);
         strncpy(base_path, get_base_path(beginning_node.path, wildcard), PATHSIZE_PLUS);
-        if (o.work_type != LSWORK) {
+        if (o.work_type != LSWORK && o.work_type != QUERYWORK) {
 
             //need to stat_item sooner, we're doing a mkdir we shouldn't be here.
             rc = stat_item(&beginning_node, o);
@@ -345,7 +625,7 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
         }
     }
     iter = input_queue_head;				// Make sure there are no multiple roots for a recursive operation
-    if (strncmp(base_path, ".", PATHSIZE_PLUS) != 0 && o.recurse == 1 && o.work_type != LSWORK) {
+    if (strncmp(base_path, ".", PATHSIZE_PLUS) != 0 && o.recurse == 1 && o.work_type != LSWORK && o.work_type != QUERYWORK) {
         while (iter != NULL) {
             if (strncmp(get_base_path(iter->data.path, wildcard), base_path, PATHSIZE_PLUS) != 0) {
                 errsend(FATAL, "All sources for a recursive operation must be contained within the same directory.");
@@ -360,15 +640,40 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
         snprintf(errmsg, MESSAGESIZE, "%s: No such file or directory", dest_path);
         errsend(FATAL, errmsg);
     }
-    //pack our list into a buffer:
-    pack_list(input_queue_head, input_queue_count, &dir_buf_list, &dir_buf_list_size);
+    //queued work past this budget spills to segment files
+    init_queue_spill(o.queue_memory);
+    //pack our list into a buffer. A file list is read in ranges, by as many ranks as are free, and so is a plan
+    if (o.run_plan[0]) {
+        if (pack_plan(o.run_plan, &dir_buf_list, &dir_buf_list_size) != 0) {
+            snprintf(errmsg, MESSAGESIZE, "Failed to read the manifest of plan %s", o.run_plan);
+            errsend(FATAL, errmsg);
+        }
+    }
+    else if (o.use_file_list) {
+        if (pack_file_list(o.file_list, &dir_buf_list, &dir_buf_list_size) != 0) {
+            snprintf(errmsg, MESSAGESIZE, "Failed to read file list %s", o.file_list);
+            errsend(FATAL, errmsg);
+        }
+    }
+    else {
+        pack_list(input_queue_head, input_queue_count, &dir_buf_list, &dir_buf_list_size);
+    }
     delete_queue_path(&input_queue_head, &input_queue_count);
     //proc stuff
     proc_status = malloc(nproc * sizeof(int));
+    split_status = malloc(nproc * sizeof(int));
     //initialize proc_status
     for (i = 0; i < nproc; i++) {
         proc_status[i] = 0;
-    }
+        split_status[i] = 0;
+    }
+    init_size_queue(&process_queue);
+    process_queue.loc = &loc;
+    init_batch_control(&batches, nproc, &o.batch);
+    init_flow_control(&flow, nproc, o);
+    init_target_limits(&targets, nproc, o);
+    init_copy_window(&window, nproc, o);
+    init_rate_limit(&rates, nproc, o);
     sprintf(message, "INFO  HEADER   ========================  %s  ============================\n", o.jid);
     write_output(message, 1);
     sprintf(message, "INFO  HEADER   Starting Path: %s\n", beginning_node.path);
@@ -378,6 +683,7 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
     //this is how we start the whole thing
     proc_status[START_PROC] = 1;
     send_worker_readdir(START_PROC, &dir_buf_list, &dir_buf_list_size);
+    flow_started(&flow, START_PROC, DIRCMD);
     while (1) {
         //poll for message
 #ifndef THREADS_ONLY
@@ -392,7 +698,7 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
             }
             if  (probecount % 3000 == 0) {
                 PRINT_POLL_DEBUG("Rank %d: Waiting for a message\n", rank);
-                PRINT_POLL_DEBUG("process_buf_list_size = %d\n", process_buf_list_size);
+                PRINT_POLL_DEBUG("process_queue.size = %d\n", process_queue.size);
                 PRINT_POLL_DEBUG("stat_buf_list_size = %d\n", stat_buf_list_size);
                 PRINT_POLL_DEBUG("dir_buf_list_size = %d\n", dir_buf_list_size);
             }
@@ -403,17 +709,42 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
                     PRINT_PROC_DEBUG("Rank %d, Status %d\n", i, proc_status[i]);
                 }
                 PRINT_PROC_DEBUG("=============\n");
+                free_count = 0;
+                for (i = START_PROC; i < nproc; i++) {
+                    if (proc_status[i] == 0) {
+                        free_count++;
+                    }
+                }
+                if (!o.fixed_batches) {
+                    tune_batch_sizes(&batches, dir_buf_list_size, process_queue.size, free_count, nproc - START_PROC, o.batch_count);
+                }
+                flow_report(&flow, dir_buf_list_size, stat_buf_list_size, process_queue.bytes, process_queue.size, nproc - START_PROC - free_count);
                 //work_rank = get_free_rank(proc_status, 3, nproc - 1);
                 work_rank = get_free_rank(proc_status, 3, nproc - 1);
-                if (((start == 1 || o.recurse) && work_rank != -1 && dir_buf_list_size != 0) ||
-                    (o.use_file_list && dir_buf_list_size != 0 && stat_buf_list_size < nproc*3)) {
+                if (work_rank != -1 && dir_buf_list_size != 0 &&
+                    (start == 1 || o.recurse || ((o.use_file_list || o.run_plan[0]) && stat_buf_list_size < nproc*3)) &&
+                    flow_may_walk(&flow, process_queue.bytes, process_queue.size)) {
                     proc_status[work_rank] = 1;
+                    batch_sync(&batches, work_rank);
+                    queued = dir_buf_list->size;
                     send_worker_readdir(work_rank, &dir_buf_list, &dir_buf_list_size);
+                    batch_started(&batches, work_rank, DIRCMD, queued);
+                    flow_started(&flow, work_rank, DIRCMD);
                     start = 0;
                 }
-                else if (!o.recurse) {
+                else if (!o.recurse && !o.use_file_list && !o.run_plan[0]) {
                     delete_buf_list(&dir_buf_list, &dir_buf_list_size);
                 }
+                //names handed off from huge directories
+                for (i = 0; i < 3; i ++) {
+                    work_rank = get_free_rank(proc_status, 3, nproc - 1);
+                    if (work_rank > -1 && stat_buf_list_size > 0 && flow_may_walk(&flow, process_queue.bytes, process_queue.size)) {
+                        proc_status[work_rank] = 1;
+                        batch_sync(&batches, work_rank);
+                        send_worker_stat_path(work_rank, &stat_buf_list, &stat_buf_list_size);
+                        flow_started(&flow, work_rank, STATCMD);
+                    }
+                }
 #ifdef TAPE
                 //handle tape
                 work_rank = get_free_rank(proc_status, 3, nproc - 1);
@@ -422,27 +753,79 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
                     send_worker_tape_path(work_rank, &tape_buf_list, &tape_buf_list_size);
                 }
 #endif
+                tune_copy_window(&window, o.verbose);
+                if (check_rate_control(&rates, o.verbose)) {
+                    rate_push(&rates, split_status, nproc);
+                }
                 if (o.work_type == COPYWORK) {
-                    for (i = 0; i < 3; i ++) {
-                        work_rank = get_free_rank(proc_status, 3, nproc - 1);
-                        if (work_rank > -1 && process_buf_list_size > 0) {
+                    for (i = 0; i < 3 && copy_room(&window) > 0; i ++) {
+                        work_rank = get_local_rank(proc_status, &loc, 3, nproc - 1, &local_only);
+                        if (work_rank > -1 && process_queue.size > 0) {
+                            if (rate_limited(&rates) && !rate_may_send(&rates)) {
+                                break;					// the job is at its rate
+                            }
+                            batch_sync(&batches, work_rank);
+                            batch_bytes = o.batch_bytes;
+                            batch_count = batches.sizes.copy;
+                            rate_cut_batch(&rates, split_status, nproc, &batch_bytes, &batch_count);
+                            queued = process_queue.size;
+                            queued_bytes = process_queue.bytes;
+                            if (send_worker_copy_path(work_rank, &process_queue, batch_bytes, batch_count, &loc, local_only, &targets) == 0 &&
+                                (!local_only || send_worker_copy_path(work_rank, &process_queue, batch_bytes, batch_count, &loc, 0, &targets) == 0)) {
+                                break;					// all the work in reach is on targets at their limits. The work of the rank's node may be out of reach -> it takes any
+                            }
                             proc_status[work_rank] = 1;
-                            send_worker_copy_path(work_rank, &process_buf_list, &process_buf_list_size);
+                            split_status[work_rank] = 1;
+                            batch_started(&batches, work_rank, COPYCMD, queued - process_queue.size);
+                            copy_started(&window, work_rank, queued_bytes - process_queue.bytes, queued - process_queue.size);
+                            rate_charge(&rates, queued_bytes - process_queue.bytes, queued - process_queue.size);
+                            rate_push(&rates, split_status, nproc);		// one more copier -> smaller shares, and the new copier's
+                        }
+                    }
+                    //nothing left to hand out -> have a copier split off the tail of its chunk for each idle worker
+                    if (o.split_at && process_queue.size == 0 && dir_buf_list_size == 0) {
+                        free_count = 0;
+                        split_count = 0;
+                        for (i = START_PROC; i < nproc; i++) {
+                            if (proc_status[i] == 0) {
+                                free_count++;
+                            }
+                            else if (split_status[i] == 2) {
+                                split_count++;
+                            }
+                        }
+                        if (free_count > copy_room(&window)) {		// only split for ranks that may copy
+                            free_count = copy_room(&window);
+                        }
+                        for (i = START_PROC; i < nproc && split_count < free_count; i++) {
+                            if (proc_status[i] == 1 && split_status[i] == 1) {
+                                split_status[i] = 2;
+                                send_worker_split(i);
+                                split_count++;
+                            }
                         }
                     }
                 }
                 else if (o.work_type == COMPAREWORK) {
-                    for (i = 0; i < 3; i ++) {
-                        work_rank = get_free_rank(proc_status, 3, nproc - 1);
-                        if (work_rank > -1 && process_buf_list_size > 0) {
+                    for (i = 0; i < 3 && copy_room(&window) > 0; i ++) {
+                        work_rank = get_local_rank(proc_status, &loc, 3, nproc - 1, &local_only);
+                        if (work_rank > -1 && process_queue.size > 0) {
+                            batch_sync(&batches, work_rank);
+                            queued = process_queue.size;
+                            queued_bytes = process_queue.bytes;
+                            if (send_worker_compare_path(work_rank, &process_queue, o.batch_bytes, batches.sizes.copy, &loc, local_only, &targets) == 0 &&
+                                (!local_only || send_worker_compare_path(work_rank, &process_queue, o.batch_bytes, batches.sizes.copy, &loc, 0, &targets) == 0)) {
+                                break;
+                            }
                             proc_status[work_rank] = 1;
-                            send_worker_compare_path(work_rank, &process_buf_list, &process_buf_list_size);
+                            batch_started(&batches, work_rank, COMPARECMD, queued - process_queue.size);
+                            copy_started(&window, work_rank, queued_bytes - process_queue.bytes, queued - process_queue.size);
                         }
                     }
                 }
                 else {
                     //delete the queue here
-                    delete_buf_list(&process_buf_list, &process_buf_list_size);
+                    delete_size_queue(&process_queue);
 #ifdef TAPE
                     delete_buf_list(&tape_buf_list, &tape_buf_list_size);
 #endif
@@ -450,13 +833,13 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
 #ifndef THREADS_ONLY
             }
             //are we finished?
-            if (process_buf_list_size == 0 && stat_buf_list_size == 0 && dir_buf_list_size == 0 && processing_complete(proc_status, nproc) == 0) {
+            if (process_queue.size == 0 && stat_buf_list_size == 0 && dir_buf_list_size == 0 && processing_complete(proc_status, nproc) == 0) {
                 break;
             }
             usleep(1);
         }
 #endif
-        if (process_buf_list_size == 0 && stat_buf_list_size == 0 && dir_buf_list_size == 0 && processing_complete(proc_status, nproc) == 0) {
+        if (process_queue.size == 0 && stat_buf_list_size == 0 && dir_buf_list_size == 0 && processing_complete(proc_status, nproc) == 0) {
             break;
         }
         //grab message type
@@ -470,6 +853,14 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
         case WORKDONECMD:
             //worker finished their tasks
             manager_workdone(rank, sending_rank, proc_status);
+            if (split_status[sending_rank] != 0) {			// one copier less -> bigger shares
+                split_status[sending_rank] = 0;
+                rate_push(&rates, split_status, nproc);
+            }
+            batch_done(&batches, sending_rank);
+            flow_done(&flow, sending_rank);
+            target_done(&targets, sending_rank);
+            copy_done(&window, sending_rank);
             break;
         case NONFATALINCCMD:
             //non fatal errsend encountered
@@ -479,7 +870,7 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
             proc_status[ACCUM_PROC] = 1;
             break;
         case COPYSTATSCMD:
-            manager_add_copy_stats(rank, sending_rank, &num_copied_files, &num_copied_bytes);
+            manager_add_copy_stats(rank, sending_rank, &num_copied_files, &num_copied_bytes, &min_blocksize, &max_blocksize, &blocked_bytes, &blocksize_bytes);
             break;
         case EXAMINEDSTATSCMD:
             manager_add_examined_stats(rank, sending_rank, &examined_file_count, &examined_byte_count, &examined_dir_count);
@@ -490,7 +881,12 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
             break;
 #endif
         case PROCESSCMD:
-            manager_add_buffs(rank, sending_rank, &process_buf_list, &process_buf_list_size);
+            queued_bytes = process_queue.bytes;
+            manager_add_process_buffs(rank, sending_rank, &process_queue);
+            if (split_status[sending_rank] == 2) {			// the tail of a split chunk -> the copier can be split again
+                split_status[sending_rank] = 1;
+                copy_returned(&window, sending_rank, process_queue.bytes - queued_bytes);
+            }
             break;
         case DIRCMD:
             manager_add_buffs(rank, sending_rank, &dir_buf_list, &dir_buf_list_size);
@@ -509,6 +905,26 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
         case QUEUESIZECMD:
             send_worker_queue_count(sending_rank, stat_buf_list_size);
             break;
+        case PLANINFOCMD:
+            {
+                int free_workers = 0;
+                double worker_rate = 0.0;
+                struct timeval now;
+                double secs;
+
+                for (i = START_PROC; i < nproc; i++) {
+                    if (proc_status[i] == 0) {
+                        free_workers++;
+                    }
+                }
+                gettimeofday(&now, NULL);
+                secs = (now.tv_sec - in.tv_sec) + (now.tv_usec - in.tv_usec)/1000000.0;
+                if (num_copied_bytes > 0 && secs > 0.0 && nproc > START_PROC) {
+                    worker_rate = num_copied_bytes/secs/(nproc - START_PROC);
+                }
+                send_worker_plan_info(sending_rank, free_workers, worker_rate);
+            }
+            break;
         default:
             break;
         }
@@ -526,7 +942,7 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
     write_output(message, 1);
     sprintf(message, "INFO  FOOTER   Total Files/Links Examined: %d\n", examined_file_count);
     write_output(message, 1);
-    if (o.work_type == LSWORK) {
+    if (o.work_type == LSWORK || o.work_type == QUERYWORK) {
         sprintf(message, "INFO  FOOTER   Total Bytes Examined: %zd\n", examined_byte_count);
         write_output(message, 1);
     }
@@ -551,6 +967,15 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
             sprintf(message, "INFO  FOOTER   Data Rate: %zd MB/second\n", (num_copied_bytes/(1024*1024))/(elapsed_time+1));
             write_output(message, 1);
         }
+        if (max_blocksize > 0) {
+            if (min_blocksize == max_blocksize) {
+                sprintf(message, "INFO  FOOTER   Block Size: %zd\n", max_blocksize);
+            }
+            else {
+                sprintf(message, "INFO  FOOTER   Block Size: %zd to %zd (average %zd)\n", min_blocksize, max_blocksize, (size_t)(blocksize_bytes/blocked_bytes));
+            }
+            write_output(message, 1);
+        }
     }
     else if (o.work_type == COMPAREWORK) {
         sprintf(message, "INFO  FOOTER   Total Files Compared: %d\n", num_copied_files);
@@ -560,6 +985,44 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
             write_output(message, 1);
         }
     }
+    free_queue_spill(&spilled_buffers, &spilled_bytes);
+    if (spilled_buffers > 0) {
+        sprintf(message, "INFO  FOOTER   Queue Spill: %zd buffers, %zd bytes\n", spilled_buffers, spilled_bytes);
+        write_output(message, 1);
+    }
+    free_flow_control(&flow);
+    if (loc.wait >= 0 && loc.local + loc.remote > 0) {
+        sprintf(message, "INFO  FOOTER   Locality: %zd items on the node that found them, %zd elsewhere (%d nodes)\n", loc.local, loc.remote, loc.nodes);
+        write_output(message, 1);
+    }
+    free_locality(&loc);
+    if (targets.held_back > 0) {
+        sprintf(message, "INFO  FOOTER   Target Limits: work held back %zd times\n", targets.held_back);
+        write_output(message, 1);
+    }
+    free_target_limits(&targets);
+    if (window.window > 0) {
+        sprintf(message, "INFO  FOOTER   Copy Window: %d ranks at the end (%d to %d), %d increases, %d decreases, batch mix changed %d times\n",
+                window.window, window.low, window.high, window.increases, window.decreases, window.mix_changes);
+        write_output(message, 1);
+    }
+    free_copy_window(&window);
+    if (rate_limited(&rates) || rates.changes > 0) {
+        sprintf(message, "INFO  FOOTER   Rate Limit: %.0f bytes/s, %.0f files/s at the end (0 -> no limit), changed %d times, copies held back %.0f seconds\n",
+                rates.bytes_rate, rates.ops_rate, rates.changes, rates.held_secs);
+        write_output(message, 1);
+    }
+    free_rate_limit(&rates);
+    if (flow.throttles > 0) {
+        sprintf(message, "INFO  FOOTER   Walk Stopped: %d times, %.0f seconds\n", flow.throttles, flow.throttled_secs);
+        write_output(message, 1);
+    }
+    if (o.verbose) {
+        sprintf(message, "INFO  FOOTER   Batch Sizes: dir %d (%d to %d)  stat %d (%d to %d)  copy %d (%d to %d)  message %d (%d to %d)\n",
+                batches.sizes.dir, batches.low.dir, batches.high.dir, batches.sizes.stat, batches.low.stat, batches.high.stat,
+                batches.sizes.copy, batches.low.copy, batches.high.copy, batches.sizes.message, batches.low.message, batches.high.message);
+        write_output(message, 1);
+    }
     if (elapsed_time == 1) {
         sprintf(message, "INFO  FOOTER   Elapsed Time: %d second\n", elapsed_time);
     }
@@ -570,8 +1033,65 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
     for(i = 1; i < nproc; i++) {
         send_worker_exit(i);
     }
+    //make the snapshot of this walk the current one, if nothing went wrong
+    if (o.snapshot[0]) {
+        snap_failed = 0;
+        MPI_Reduce(&snap_failed, &snap_failures, 1, MPI_INT, MPI_SUM, MANAGER_PROC, MPI_COMM_WORLD);
+        snprintf(snapshot_info, PATHSIZE_PLUS, "%d %s\n", o.work_type, dest_path);
+        if (non_fatal > 0 || snap_failures > 0) {
+            fprintf(stderr, "Snapshot %s not updated, because of errors\n", o.snapshot);
+        }
+        else if (commit_snapshot(o.snapshot, snapshot_info) != 0) {
+            fprintf(stderr, "Failed to update snapshot %s\n", o.snapshot);
+        }
+    }
+    //list the shards of the catalog in its manifest
+    if (o.catalog[0]) {
+        cat_count = 0.0;
+        cat_rows = (double *) malloc(nproc * sizeof(double));
+        MPI_Gather(&cat_count, 1, MPI_DOUBLE, cat_rows, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+        if (write_catalog_manifest(o.catalog, cat_rows, nproc) != 0) {
+            fprintf(stderr, "Catalog %s has no manifest, because of errors\n", o.catalog);
+        }
+        free(cat_rows);
+    }
+    //list the shards of the plan in its manifest
+    if (o.plan[0]) {
+        plan_count = 0.0;
+        plan_items = (double *) malloc(nproc * sizeof(double));
+        MPI_Gather(&plan_count, 1, MPI_DOUBLE, plan_items, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+        if (write_plan_manifest(o.plan, plan_items, nproc) != 0) {
+            fprintf(stderr, "Plan %s has no manifest, because of errors\n", o.plan);
+        }
+        else {
+            for (i = 0; i < nproc; i++) {
+                plan_count += plan_items[i];
+            }
+            printf("INFO  PLAN     %s: %.0f files and chunks to copy\n", o.plan, plan_count);
+        }
+        free(plan_items);
+    }
+    //merge the usage totals of all ranks, and report them
+    if (o.du_depth >= 0) {
+        init_du(&du, o.du_depth, (o.use_file_list)?"":base_path);
+        du_reduce(&du, rank);
+        du_report(&du);
+        free_du(&du);
+    }
+    //sum the histograms of all ranks, and report them
+    if (o.histogram[0]) {
+        init_histogram(&hist, 0, 0);
+        init_histogram(&hist_sum, 1, 0);
+        histogram_reduce(&hist, &hist_sum, rank);
+        if (histogram_report(&hist_sum, o.histogram) != 0) {
+            fprintf(stderr, "Failed to write histograms to %s\n", o.histogram);
+        }
+    }
     //free any allocated stuff
     free(proc_status);
+    free(split_status);
+    delete_size_queue(&process_queue);
+    free_batch_control(&batches);
 }
 
 int manager_add_paths(int rank, int sending_rank, path_list **queue_head, path_list **queue_tail, int *queue_count) {
@@ -626,12 +1146,50 @@ void manager_add_buffs(int rank, int sending_rank, work_buf_list **workbuflist,
     if (path_count > 0) {
         enqueue_buf_list(workbuflist, workbufsize, workbuf, path_count);
     }
+    else {
+        free(workbuf);
+    }
+}
+
+void manager_add_process_buffs(int rank, int sending_rank, size_queue *queue) {
+    MPI_Status status;
+    int path_count;
+    char *workbuf;
+    int worksize;
+    //gather the # of files
+    PRINT_MPI_DEBUG("rank %d: manager_add_process_buffs() Receiving path_count from rank %d\n", rank, sending_rank);
+    if (MPI_Recv(&path_count, 1, MPI_INT, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive path_count\n");
+    }
+    worksize =  path_count * sizeof(path_list);
+    workbuf = (char *) malloc(worksize * sizeof(char));
+    //gather the paths to copy or compare
+    PRINT_MPI_DEBUG("rank %d: manager_add_process_buffs() Receiving worksize from rank %d\n", rank, sending_rank);
+    if (MPI_Recv(workbuf, worksize, MPI_PACKED, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive worksize\n");
+    }
+    enqueue_size_queue(queue, workbuf, path_count);			// sorts the items into the size buckets
+}
+
+void worker_batch_sizes(int rank, int sending_rank, batch_sizes *sizes) {
+    MPI_Status status;
+    PRINT_MPI_DEBUG("rank %d: worker_batch_sizes() Receiving the batch sizes from %d\n", rank, sending_rank);
+    if (MPI_Recv(sizes, sizeof(batch_sizes)/sizeof(int), MPI_INT, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive batch sizes\n");
+    }
+}
+
+void worker_rate(int rank, int sending_rank) {
+    PRINT_MPI_DEBUG("rank %d: worker_rate() Receiving the share of the rates from %d\n", rank, sending_rank);
+    receive_pace(sending_rank);
 }
 
-void manager_add_copy_stats(int rank, int sending_rank, int *num_copied_files, size_t *num_copied_bytes) {
+void manager_add_copy_stats(int rank, int sending_rank, int *num_copied_files, size_t *num_copied_bytes, size_t *min_blocksize, size_t *max_blocksize, size_t *blocked_bytes, double *blocksize_bytes) {
     MPI_Status status;
     int num_files;
     size_t num_bytes;
+    size_t min_bs, max_bs, bs_count;
+    double bs_bytes;
     //gather the # of copied files
     PRINT_MPI_DEBUG("rank %d: manager_add_copy_stats() Receiving num_copied_files from rank %d\n", rank, sending_rank);
     if (MPI_Recv(&num_files, 1, MPI_INT, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
@@ -642,8 +1200,29 @@ void manager_add_copy_stats(int rank, int sending_rank, int *num_copied_files, s
     if (MPI_Recv(&num_bytes, 1, MPI_DOUBLE, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
         errsend(FATAL, "Failed to receive worksize\n");
     }
+    //gather the block sizes used
+    if (MPI_Recv(&min_bs, 1, MPI_DOUBLE, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive min_blocksize\n");
+    }
+    if (MPI_Recv(&max_bs, 1, MPI_DOUBLE, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive max_blocksize\n");
+    }
+    if (MPI_Recv(&bs_count, 1, MPI_DOUBLE, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive blocked_bytes\n");
+    }
+    if (MPI_Recv(&bs_bytes, 1, MPI_DOUBLE, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive blocksize_bytes\n");
+    }
     *num_copied_files += num_files;
     *num_copied_bytes += num_bytes;
+    if (min_bs && (!*min_blocksize || min_bs < *min_blocksize)) {
+        *min_blocksize = min_bs;
+    }
+    if (max_bs > *max_blocksize) {
+        *max_blocksize = max_bs;
+    }
+    *blocked_bytes += bs_count;
+    *blocksize_bytes += bs_bytes;
 }
 
 void manager_add_examined_stats(int rank, int sending_rank, int *num_examined_files, size_t *num_examined_bytes, int *num_examined_dirs) {
@@ -709,6 +1288,14 @@ void worker(int rank, struct options o) {
     HASHTBL *chunk_hash;
     int base_count = 100, hash_count = 0;
     int output_count = 0;
+    //block size policy of a copy worker
+    blocksize_policy blocksize;
+    //destination cache, tree snapshots and catalog shard
+    walk_state walk;
+    int snap_failed;
+    locality loc;
+    uint64_t cat_rows, plan_items;
+    double cat_count, plan_count;
     if (rank == OUTPUT_PROC) {
         output_buffer = (char *) malloc(MESSAGESIZE*MESSAGEBUFFER*sizeof(char));
         memset(output_buffer,'\0', sizeof(MESSAGESIZE*MESSAGEBUFFER));
@@ -721,9 +1308,11 @@ void worker(int rank, struct options o) {
     if (o.work_type == COPYWORK) {
         makedir = 1;
     }
+    init_locality(&loc, rank, 0, o.locality_wait);		// sends the node of this rank to the manager
+    memset(&dest_node, 0, sizeof(path_item));			// no destination to skip with a file list
     if (!o.use_file_list) {
         //PRINT_MPI_DEBUG("rank %d: worker() MPI_Bcast the dest_path\n", rank);
-        if (o.work_type != LSWORK) {
+        if (o.work_type != LSWORK && o.work_type != QUERYWORK) {
             mpi_ret_code = MPI_Bcast(&dest_node, sizeof(path_item), MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD);
             if (mpi_ret_code < 0) {
                 errsend(FATAL, "Failed to Receive Bcast dest_path");
@@ -735,13 +1324,23 @@ void worker(int rank, struct options o) {
             errsend(FATAL, "Failed to Receive Bcast base_path");
         }
         get_stat_fs_info(base_path, &o.sourcefs);
-        if (o.parallel_dest == 0 && o.work_type != LSWORK) {
+        if (o.parallel_dest == 0 && o.work_type != LSWORK && o.work_type != QUERYWORK) {
             get_stat_fs_info(dest_node.path, &o.destfs);
             if (o.destfs != ANYFS) {
                 o.parallel_dest = 1;
             }
         }
     }
+    init_blocksize_policy(&blocksize, (!o.use_file_list && o.work_type == COPYWORK)?dest_node.st.st_blksize:0, o);
+#ifdef PLFS
+    o.dest_listing = 0;
+#endif
+    init_dest_cache(&walk.dc, o.dest_listing && o.work_type != LSWORK);
+    init_snapshot(&walk.snap, o.snapshot, rank);
+    init_catalog(&walk.cat, o.catalog, rank);
+    init_du(&walk.du, o.du_depth, (o.use_file_list)?"":base_path);
+    init_histogram(&walk.hist, o.histogram[0] != '\0', time(NULL));
+    init_plan(&walk.plan, o.plan, rank);
     //This should only be done once and by one proc to get everything started
     if (rank == START_PROC) {
         if (MPI_Recv(&type_cmd, 1, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
@@ -749,7 +1348,7 @@ void worker(int rank, struct options o) {
         }
         sending_rank = status.MPI_SOURCE;
         PRINT_MPI_DEBUG("rank %d: worker() Receiving the command %s from rank %d\n", rank, cmd2str(type_cmd), sending_rank);
-        worker_readdir(rank, sending_rank, base_path, dest_node, 1, makedir, o);
+        worker_readdir(rank, sending_rank, base_path, dest_node, 1, makedir, &walk, o);
     }
     //change this to get request first, process, then get work
     while ( all_done == 0) {
@@ -790,7 +1389,10 @@ void worker(int rank, struct options o) {
             worker_update_chunk(rank, sending_rank, &chunk_hash, &hash_count, base_path, dest_node, o);
             break;
         case DIRCMD:
-            worker_readdir(rank, sending_rank, base_path, dest_node, 0, makedir, o);
+            worker_readdir(rank, sending_rank, base_path, dest_node, 0, makedir, &walk, o);
+            break;
+        case STATCMD:
+            worker_stat(rank, sending_rank, base_path, dest_node, &walk, o);
             break;
 #ifdef TAPE
         case TAPECMD:
@@ -798,11 +1400,17 @@ void worker(int rank, struct options o) {
             break;
 #endif
         case COPYCMD:
-            worker_copylist(rank, sending_rank, base_path, dest_node, o);
+            worker_copylist(rank, sending_rank, base_path, dest_node, &blocksize, o);
             break;
         case COMPARECMD:
             worker_comparelist(rank, sending_rank, base_path, dest_node, o);
             break;
+        case BATCHSIZECMD:
+            worker_batch_sizes(rank, sending_rank, &o.batch);
+            break;
+        case RATECMD:
+            worker_rate(rank, sending_rank);
+            break;
         case EXITCMD:
             all_done = 1;
             break;
@@ -816,6 +1424,26 @@ void worker(int rank, struct options o) {
     if (rank == ACCUM_PROC) {
         hashtbl_destroy(chunk_hash);
     }
+    free_dest_cache(&walk.dc);
+    snap_failed = (close_snapshot(&walk.snap) != 0);
+    if (o.snapshot[0]) {						// the manager commits the snapshot if no shard failed
+        MPI_Reduce(&snap_failed, NULL, 1, MPI_INT, MPI_SUM, MANAGER_PROC, MPI_COMM_WORLD);
+    }
+    cat_count = (close_catalog(&walk.cat, &cat_rows) != 0)?-1.0:(double)cat_rows;
+    if (o.catalog[0]) {						// the manager lists the shards in the manifest
+        MPI_Gather(&cat_count, 1, MPI_DOUBLE, NULL, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    }
+    plan_count = (close_plan(&walk.plan, &plan_items) != 0)?-1.0:(double)plan_items;
+    if (o.plan[0]) {						// the manager lists the shards in the manifest
+        MPI_Gather(&plan_count, 1, MPI_DOUBLE, NULL, 1, MPI_DOUBLE, MANAGER_PROC, MPI_COMM_WORLD);
+    }
+    if (o.du_depth >= 0) {					// the manager reports the usage totals of all ranks
+        du_reduce(&walk.du, rank);
+    }
+    free_du(&walk.du);
+    if (o.histogram[0]) {					// the manager reports the sums of all ranks
+        histogram_reduce(&walk.hist, NULL, rank);
+    }
     if (rank == OUTPUT_PROC) {
         worker_flush_output(output_buffer, &output_count);
         free(output_buffer);
@@ -871,6 +1499,8 @@ void worker_update_chunk(int rank, int sending_rank, HASHTBL **chunk_hash, int *
         strcpy(out_node.path, get_output_path(base_path, work_node, dest_node, o));		// CTM is based off of destination file. Populate out_node
 	out_node.chkidx = work_node.chkidx;							// with necessary data from work_node.
 	out_node.chksz = work_node.chksz;
+	out_node.chkoff = work_node.chkoff;
+	out_node.chklen = work_node.chklen;
 	out_node.st.st_size = work_node.st.st_size;
 	
 
@@ -978,7 +1608,7 @@ void worker_flush_output(char *output_buffer, int *output_count) {
     }
 }
 
-void worker_readdir(int rank, int sending_rank, const char *base_path, path_item dest_node, int start, int makedir, struct options o) {
+void worker_readdir(int rank, int sending_rank, const char *base_path, path_item dest_node, int start, int makedir, walk_state *ws, struct options o) {
     //When a worker is told to readdir, it comes here
     MPI_Status status;
     char *workbuf;
@@ -989,16 +1619,25 @@ void worker_readdir(int rank, int sending_rank, const char *base_path, path_item
     char errmsg[MESSAGESIZE];
     char mkdir_path[PATHSIZE_PLUS];
     path_item work_node;
-    path_item workbuffer[STATBUFFER];
+    path_item *workbuffer = (path_item *) malloc(o.batch.stat * sizeof(path_item));	// entries are stat'ed and processed o.batch.stat at a time
     int buffer_count = 0;
-    DIR *dip;
-    struct dirent *dit;
+    path_item *namebuffer = NULL;					// names past o.split_dir in a directory, for other ranks to stat
+    int name_count = 0;
+    size_t entries;
+    int stat_from, pending;					// workbuffer[stat_from..] are names not stat'ed yet
+    dir_stream ds;
+    const char *dname_p;
+    unsigned char d_type;
+    struct stat dir_st;
+    int snap_same;						// 1 -> the directory is unchanged since the last snapshot. Its names come from there
+    int read_errno = 0;						// errno of the read_dir_stream() call that ended the directory
+    int skipped_files = 0;					// files unchanged since the last snapshot
+    size_t skipped_bytes = 0;
+    ino_t d_ino;
 #ifdef PLFS
     char dname[PATHSIZE_PLUS];
     Plfs_dirp *pdirp;
 #endif
-    //filelist
-    FILE *fp;
     int i, rc;
     PRINT_MPI_DEBUG("rank %d: worker_readdir() Receiving the read_count %d\n", rank, sending_rank);
     if (MPI_Recv(&read_count, 1, MPI_INT, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
@@ -1015,8 +1654,16 @@ void worker_readdir(int rank, int sending_rank, const char *base_path, path_item
     for (i = 0; i < read_count; i++) {
         PRINT_MPI_DEBUG("rank %d: worker_readdir() Unpacking the work_node %d\n", rank, sending_rank);
         MPI_Unpack(workbuf, worksize, &position, &work_node, sizeof(path_item), MPI_CHAR, MPI_COMM_WORLD);
+        //a query: the "directories" are the catalog and ranges of its shards
+        if (o.work_type == QUERYWORK) {
+            worker_query(work_node, start, o);
+        }
+        //a plan: the "directories" are ranges of its shards
+        else if (o.run_plan[0]) {
+            read_plan_range(work_node, base_path, dest_node, o, rank);
+        }
         //first time through, not using a filelist
-        if (start == 1 && o.use_file_list == 0) {
+        else if (start == 1 && o.use_file_list == 0) {
             rc = stat_item(&work_node, o);
             if (rc != 0) {
                 snprintf(errmsg, MESSAGESIZE, "Failed to stat path %s", work_node.path);
@@ -1028,10 +1675,14 @@ void worker_readdir(int rank, int sending_rank, const char *base_path, path_item
                     errsend(FATAL, errmsg);
                 }
             }
+            if (!S_ISDIR(work_node.st.st_mode) && !filter_stat(&o.filter, work_node.path, &work_node.st)) {
+                continue;
+            }
             workbuffer[buffer_count] = work_node;
             buffer_count++;
         }
-        else if (o.use_file_list == 0) {
+        //directories named in a file list are only read when recursing
+        else if (o.use_file_list == 0 || (S_ISDIR(work_node.st.st_mode) && o.recurse)) {
 #ifdef PLFS
             if (work_node.ftype == PLFSFILE){
                 if ((rc = plfs_opendir_c(work_node.path,&pdirp)) != 0){
@@ -1043,7 +1694,7 @@ void worker_readdir(int rank, int sending_rank, const char *base_path, path_item
 
             else{
 #endif
-                if ((dip = opendir(work_node.path)) == NULL) {
+                if (open_dir_stream(&ds, work_node.path) != 0) {
                     snprintf(errmsg, MESSAGESIZE, "Failed to open dir %s\n", work_node.path);
                     errsend(NONFATAL, errmsg);
                     continue;
@@ -1060,7 +1711,9 @@ void worker_readdir(int rank, int sending_rank, const char *base_path, path_item
                 }
                 else{
 #endif
-                    mkdir(mkdir_path, S_IRWXU);
+                    if (mkdir(mkdir_path, S_IRWXU) == 0) {
+                        dest_cache_created(&ws->dc, mkdir_path);
+                    }
 #ifdef PLFS
                 }
 #endif
@@ -1097,42 +1750,77 @@ void worker_readdir(int rank, int sending_rank, const char *base_path, path_item
                                 errsend(FATAL, errmsg);
                             }
                         }
+                        if (!S_ISDIR(work_node.st.st_mode) && !filter_stat(&o.filter, work_node.path, &work_node.st)) {
+                            continue;
+                        }
                         workbuffer[buffer_count] = work_node;
                         buffer_count++;
-                        if (buffer_count != 0 && buffer_count % STATBUFFER == 0) {
-                            process_stat_buffer(workbuffer, &buffer_count, base_path, dest_node, o, rank);
+                        if (buffer_count >= o.batch.stat) {
+                            process_stat_buffer(workbuffer, &buffer_count, base_path, dest_node, ws, o, rank);
                         }
                     }
                 }
             }
             else{
 #endif
-                while ((dit = readdir(dip)) != NULL) {
-                    if (strncmp(dit->d_name, ".", PATHSIZE_PLUS) != 0 && strncmp(dit->d_name, "..", PATHSIZE_PLUS) != 0) {
+                entries = 0;
+                stat_from = buffer_count;
+                dir_st = work_node.st;
+                snap_same = snapshot_begin_dir(&ws->snap, path, &dir_st);
+                while ((dname_p = (snap_same)?snapshot_next_name(&ws->snap, &d_type, &d_ino):read_dir_stream(&ds, &d_type, &d_ino)) != NULL) {
+                    if (strncmp(dname_p, ".", PATHSIZE_PLUS) != 0 && strncmp(dname_p, "..", PATHSIZE_PLUS) != 0) {
                         strncpy(full_path, path, PATHSIZE_PLUS);
                         if (full_path[strlen(full_path) - 1 ] != '/') {
                             strncat(full_path, "/", 1);
                         }
-                        strncat(full_path, dit->d_name, PATHSIZE_PLUS - strlen(full_path) - 1);
+                        strncat(full_path, dname_p, PATHSIZE_PLUS - strlen(full_path) - 1);
                         strncpy(work_node.path, full_path, PATHSIZE_PLUS);
-                        rc = stat_item(&work_node, o);
-                        if (rc != 0) {
-                            snprintf(errmsg, MESSAGESIZE, "Failed to stat path %s", work_node.path);
-                            if (o.work_type == LSWORK) {
-                                errsend(NONFATAL, errmsg);
-                                continue;
+                        memset(&work_node.st, 0, sizeof(struct stat));	// what the directory entry tells (see stat_item_walk())
+                        work_node.st.st_mode = DTTOIF(d_type);
+                        work_node.st.st_ino = d_ino;
+                        //names and types the filter rules out are dropped before they are stat'ed
+                        if (d_type != DT_DIR && d_type != DT_UNKNOWN && !filter_names(&o.filter, full_path, DTTOIF(d_type))) {
+                            snapshot_add_entry(&ws->snap, dname_p, NULL);
+                            continue;
+                        }
+                        entries++;
+                        //a huge directory: hand the names past o.split_dir to the manager, so
+                        //that other ranks stat them while this rank keeps reading
+                        if (o.split_dir > 0 && entries > o.split_dir) {
+                            if (namebuffer == NULL) {
+                                namebuffer = (path_item *) malloc(NAMEBUFFER * sizeof(path_item));
                             }
-                            else {
-                                errsend(FATAL, errmsg);
+                            namebuffer[name_count] = work_node;
+                            name_count++;
+                            snapshot_add_entry(&ws->snap, dname_p, NULL);
+                            if (name_count >= NAMEBUFFER) {
+                                send_manager_new_buffer(namebuffer, &name_count);
                             }
+                            continue;
                         }
+                        //the names are stat'ed o.stat_threads at a time as the batch fills
                         workbuffer[buffer_count] = work_node;
                         buffer_count++;
-                        if (buffer_count != 0 && buffer_count % STATBUFFER == 0) {
-                            process_stat_buffer(workbuffer, &buffer_count, base_path, dest_node, o, rank);
+                        if (buffer_count >= o.batch.stat) {
+                            pending = buffer_count - stat_from;
+                            stat_name_buffer(workbuffer + stat_from, &pending, o);
+                            filter_items(workbuffer + stat_from, &pending, &ws->snap, o);
+                            snapshot_items(&ws->snap, workbuffer + stat_from, &pending, o.snapshot_filter, &skipped_files, &skipped_bytes);
+                            buffer_count = stat_from + pending;
+                            process_stat_buffer(workbuffer, &buffer_count, base_path, dest_node, ws, o, rank);
+                            stat_from = 0;
                         }
                     }
                 }
+                read_errno = (snap_same)?0:errno;			// read_dir_stream() zeroes errno at the end of the directory
+                pending = buffer_count - stat_from;
+                if (pending > 0) {
+                    stat_name_buffer(workbuffer + stat_from, &pending, o);
+                    filter_items(workbuffer + stat_from, &pending, &ws->snap, o);
+                    snapshot_items(&ws->snap, workbuffer + stat_from, &pending, o.snapshot_filter, &skipped_files, &skipped_bytes);
+                    buffer_count = stat_from + pending;
+                }
+                snapshot_end_dir(&ws->snap, path, &dir_st);
 #ifdef PLFS
             }
             if (work_node.ftype == PLFSFILE){
@@ -1144,7 +1832,14 @@ void worker_readdir(int rank, int sending_rank, const char *base_path, path_item
             }
             else{
 #endif
-                if (closedir(dip) == -1) {
+                if (read_errno != 0) {
+                    snprintf(errmsg, MESSAGESIZE, "Failed to read dir %s: %s", work_node.path, strerror(read_errno));
+                    errsend(NONFATAL, errmsg);
+                }
+                if (name_count > 0) {
+                    send_manager_new_buffer(namebuffer, &name_count);
+                }
+                if (close_dir_stream(&ds) == -1) {
                     snprintf(errmsg, MESSAGESIZE, "Failed to closedir: %s", work_node.path);
                     errsend(1, errmsg);
                 }
@@ -1152,29 +1847,356 @@ void worker_readdir(int rank, int sending_rank, const char *base_path, path_item
             }
 #endif
         }
-        //we were provided a file list
-        else {
-            fp = fopen(work_node.path, "r");
-            while (fgets(work_node.path, PATHSIZE_PLUS, fp) != NULL) {
-                if (work_node.path[strlen(work_node.path) - 1] == '\n') {
-                    work_node.path[strlen(work_node.path) - 1] = '\0';
-                }
-                workbuffer[buffer_count] = work_node;
-                buffer_count++;
-                if (buffer_count != 0 && buffer_count % STATBUFFER == 0) {
-                    process_stat_buffer(workbuffer, &buffer_count, base_path, dest_node, o, rank);
-                }
-            }
-            fclose(fp);
+        //we were provided a file list: read a range of it
+        else if (!S_ISDIR(work_node.st.st_mode)) {
+            read_list_range(work_node, workbuffer, &buffer_count, base_path, dest_node, ws, o, rank);
         }
     }
   while(buffer_count != 0) {
-        process_stat_buffer(workbuffer, &buffer_count, base_path, dest_node, o, rank);
+        process_stat_buffer(workbuffer, &buffer_count, base_path, dest_node, ws, o, rank);
+    }
+    if (skipped_files > 0) {					// unchanged files were examined, just not processed
+        send_manager_examined_stats(skipped_files, skipped_bytes, 0);
+    }
+    free(namebuffer);
+    free(workbuffer);
+    free(workbuf);
+    send_manager_work_done(rank);
+}
+
+/**
+* Stats a batch of names that another rank read from a huge
+* directory (see -u), and processes them like the entries
+* worker_readdir() stats itself.
+*
+* @param rank		the rank of this worker
+* @param sending_rank	the rank that sent the batch (the manager)
+* @param base_path	the source base path
+* @param dest_node	the destination
+* @param o		the options of the run
+*/
+void worker_stat(int rank, int sending_rank, const char *base_path, path_item dest_node, walk_state *ws, struct options o) {
+    MPI_Status status;
+    char *workbuf;
+    int worksize;
+    int position;
+    int read_count;
+    path_item *workbuffer;
+    int buffer_count = 0;
+    int i;
+
+    if (MPI_Recv(&read_count, 1, MPI_INT, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive read_count\n");
+    }
+    worksize = read_count * sizeof(path_list);
+    workbuf = (char *) malloc(worksize * sizeof(char));
+    if (MPI_Recv(workbuf, worksize, MPI_PACKED, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive workbuf\n");
+    }
+    workbuffer = (path_item *) malloc(read_count * sizeof(path_item));
+    position = 0;
+    for (i = 0; i < read_count; i++) {
+        MPI_Unpack(workbuf, worksize, &position, &workbuffer[i], sizeof(path_item), MPI_CHAR, MPI_COMM_WORLD);
+    }
+    //stat o.batch.stat names at a time (o.stat_threads at once), and process them
+    for (i = 0; i < read_count; i += o.batch.stat) {
+        buffer_count = (read_count - i < o.batch.stat)?(read_count - i):o.batch.stat;
+        stat_name_buffer(workbuffer + i, &buffer_count, o);
+        filter_items(workbuffer + i, &buffer_count, NULL, o);
+        while (buffer_count != 0) {
+            process_stat_buffer(workbuffer + i, &buffer_count, base_path, dest_node, ws, o, rank);
+        }
     }
+    free(workbuffer);
     free(workbuf);
     send_manager_work_done(rank);
 }
 
+/**
+* Reads a range of a -i file list (see pack_file_list()), and
+* processes its paths o.batch.stat at a time. A range of a text
+* list holds the lines that start in it: a range that does not
+* start a line skips the rest of the line it starts in, and the
+* last line is read to its end, past the range. Paths from a
+* text list are stat'ed; rows of a catalog are processed with
+* the stats they hold.
+*
+* @param range		the range: path is the list file or catalog,
+* 			chkidx FILELIST_TEXT or the shard, chkoff
+* 			and chklen the range in bytes or rows
+* @param workbuffer	a buffer of o.batch.stat path_items
+* @param buffer_count	the number of items in workbuffer
+* @param base_path	the source base path
+* @param dest_node	the destination
+* @param ws		the walk state of the worker
+* @param o		the options of the run
+* @param rank		the rank of this worker
+*/
+void read_list_range(path_item range, path_item *workbuffer, int *buffer_count, const char *base_path, path_item dest_node, walk_state *ws, struct options o, int rank) {
+    char errmsg[MESSAGESIZE];
+    path_item work_node;
+    catalog_shard shard;
+    const char *path;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    off_t pos, end = range.chkoff + range.chklen;
+    uint64_t row;
+    int stat_from, pending;					// workbuffer[stat_from..] are names not stat'ed yet
+    FILE *fp;
+
+    memset(&work_node, 0, sizeof(path_item));
+    work_node.ftype = REGULARFILE;
+    work_node.desttype = REGULARFILE;
+    if (range.chkidx != FILELIST_TEXT) {
+        if (open_catalog_shard(&shard, range.path, range.chkidx) != 0) {
+            snprintf(errmsg, MESSAGESIZE, "Failed to map catalog shard %s/shard.%d", range.path, range.chkidx);
+            errsend(NONFATAL, errmsg);
+            return;
+        }
+        if (end > shard.rows) {
+            end = shard.rows;
+        }
+        for (row = range.chkoff; row < end; row++) {
+            catalog_row(&shard, row, &path, &work_node.st);
+            strncpy(work_node.path, path, PATHSIZE_PLUS);
+            workbuffer[*buffer_count] = work_node;
+            (*buffer_count)++;
+            if (*buffer_count >= o.batch.stat) {
+                filter_items(workbuffer, buffer_count, NULL, o);
+                process_stat_buffer(workbuffer, buffer_count, base_path, dest_node, ws, o, rank);
+            }
+        }
+        filter_items(workbuffer, buffer_count, NULL, o);
+        while (*buffer_count != 0) {
+            process_stat_buffer(workbuffer, buffer_count, base_path, dest_node, ws, o, rank);
+        }
+        close_catalog_shard(&shard);
+        return;
+    }
+    if ((fp = fopen(range.path, "r")) == NULL) {
+        snprintf(errmsg, MESSAGESIZE, "Failed to open file list %s", range.path);
+        errsend(NONFATAL, errmsg);
+        return;
+    }
+    stat_from = *buffer_count;					// items already in the buffer were stat'ed by the ranges before
+    pos = range.chkoff;
+    if (pos > 0) {						// the line that starts before the range belongs to the range before
+        fseeko(fp, pos - 1, SEEK_SET);
+        if (fgetc(fp) != '\n' && (len = getline(&line, &line_size, fp)) > 0) {
+            pos += len;
+        }
+    }
+    while (pos < end && (len = getline(&line, &line_size, fp)) > 0) {
+        pos += len;
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        strncpy(work_node.path, line, PATHSIZE_PLUS);
+        memset(&work_node.st, 0, sizeof(struct stat));		// type not known: always stat'ed
+        workbuffer[*buffer_count] = work_node;
+        (*buffer_count)++;
+        if (*buffer_count >= o.batch.stat) {
+            pending = *buffer_count - stat_from;
+            stat_name_buffer(workbuffer + stat_from, &pending, o);
+            filter_items(workbuffer + stat_from, &pending, NULL, o);
+            *buffer_count = stat_from + pending;
+            process_stat_buffer(workbuffer, buffer_count, base_path, dest_node, ws, o, rank);
+            stat_from = *buffer_count;
+        }
+    }
+    pending = *buffer_count - stat_from;
+    if (pending > 0) {
+        stat_name_buffer(workbuffer + stat_from, &pending, o);
+        filter_items(workbuffer + stat_from, &pending, NULL, o);
+        *buffer_count = stat_from + pending;
+    }
+    while (*buffer_count != 0) {
+        process_stat_buffer(workbuffer, buffer_count, base_path, dest_node, ws, o, rank);
+    }
+    free(line);
+    fclose(fp);
+}
+
+/**
+* Runs a range of a plan (-G): its records are sent to the
+* manager as copy work, o.batch_count items or o.batch_bytes
+* bytes at a time, like the walk does. The records of a file
+* belong to the range its first record is in, so a range skips
+* the records it starts in the middle of, and reads past its end
+* to finish its last file. The destination of a file, and the
+* CTM of a chunked one, are removed here, before any of its
+* chunks are sent, as the walk would have (see
+* process_stat_buffer()).
+*
+* @param range		the range: path is the plan, chkidx the
+* 			shard, chkoff the first record and chklen
+* 			the number of records
+* @param base_path	the source base path
+* @param dest_node	the destination
+* @param o		the options of the run
+* @param rank		the rank of this worker
+*/
+void read_plan_range(path_item range, const char *base_path, path_item dest_node, struct options o, int rank) {
+    char errmsg[MESSAGESIZE];
+    char *out_path;
+    path_item *regbuffer;
+    int reg_buffer_count = 0;
+    plan_shard shard;
+    struct stat st;
+    int dest_exists;
+    uint64_t i, end = range.chkoff + range.chklen;
+    int num_examined_files = 0;
+    size_t num_examined_bytes = 0;
+    size_t num_bytes_seen = 0;
+
+    if (open_plan_shard(&shard, range.path, range.chkidx) != 0) {
+        snprintf(errmsg, MESSAGESIZE, "Failed to map plan shard %s/shard.%d", range.path, range.chkidx);
+        errsend(NONFATAL, errmsg);
+        return;
+    }
+    regbuffer = (path_item *) malloc(o.batch_count * sizeof(path_item));
+    for (i = range.chkoff; i < shard.count && !(shard.items[i].flags & PLAN_FIRST); i++);	// the file the range starts in belongs to the range before
+    for (; i < shard.count && (i < end || !(shard.items[i].flags & PLAN_FIRST)); i++) {
+        if (plan_item(&shard, i, &regbuffer[reg_buffer_count]) & PLAN_FIRST) {
+            num_examined_files++;
+            num_examined_bytes += regbuffer[reg_buffer_count].st.st_size;
+            out_path = get_output_path(base_path, regbuffer[reg_buffer_count], dest_node, o);
+            dest_exists = (lstat(out_path, &st) == 0);
+            if (dest_exists && (!o.different || regbuffer[reg_buffer_count].st.st_size < o.chunk_at) && unlink(out_path) != 0) {
+                snprintf(errmsg, MESSAGESIZE, "Failed to unlink %s", out_path);
+                errsend(FATAL, errmsg);
+            }
+            if (regbuffer[reg_buffer_count].st.st_size >= o.chunk_at && !(o.different && dest_exists) && hasCTM(out_path)) {
+                purgeCTM(out_path);
+            }
+            free(out_path);
+        }
+        num_bytes_seen += regbuffer[reg_buffer_count].chksz;
+        reg_buffer_count++;
+        if (reg_buffer_count >= o.batch_count || num_bytes_seen >= o.batch_bytes) {
+            PRINT_MPI_DEBUG("rank %d: read_plan_range() sending %d reg buffers to manager.\n", rank, reg_buffer_count);
+            send_manager_regs_buffer(regbuffer, &reg_buffer_count);
+            num_bytes_seen = 0;
+        }
+    }
+    while (reg_buffer_count != 0) {
+        send_manager_regs_buffer(regbuffer, &reg_buffer_count);
+    }
+    send_manager_examined_stats(num_examined_files, num_examined_bytes, 0);
+    free(regbuffer);
+    close_plan_shard(&shard);
+}
+
+/**
+* Runs a piece of a query (-w 3). The first piece is the
+* catalog itself: it is split into ranges of rows, which are
+* sent back to the manager one at a time, so that they are
+* spread over the workers. A range is scanned a block of rows
+* at a time (see catalog_match()), and the entries that match
+* are counted and, with -v, listed.
+*
+* @param work_node	the catalog (start), or a range of rows:
+* 			chkidx is the shard, chkoff the first row and
+* 			chklen the number of rows
+* @param start		1 -> the catalog, 0 -> a range
+* @param o		the options of the run
+*/
+void worker_query(path_item work_node, int start, struct options o) {
+    char errmsg[MESSAGESIZE], statrecord[MESSAGESIZE];
+    char modebuf[15], timebuf[30];
+    struct tm sttm;
+    struct stat st;
+    const char *path;
+    int *ranks;
+    uint64_t *rows;
+    int nshards;
+    path_item range;
+    int range_count;
+    catalog_shard shard;
+    unsigned char mask[CATALOG_BLOCK];
+    uint64_t row, end;
+    size_t count, j;
+    char *writebuf;
+    int writesize, out_position = 0, write_count = 0;
+    int num_examined_files = 0, num_examined_dirs = 0;
+    size_t num_examined_bytes = 0;
+    int i;
+
+    if (start == 1) {
+        if ((nshards = read_catalog_manifest(work_node.path, &ranks, &rows)) < 0) {
+            snprintf(errmsg, MESSAGESIZE, "Failed to read catalog manifest in %s", work_node.path);
+            errsend(NONFATAL, errmsg);
+            return;
+        }
+        range = work_node;
+        for (i = 0; i < nshards; i++) {
+            for (row = 0; row < rows[i]; row += CATALOG_RANGE) {
+                range.chkidx = ranks[i];
+                range.chkoff = row;
+                range.chklen = (rows[i] - row < CATALOG_RANGE)?(rows[i] - row):CATALOG_RANGE;
+                range_count = 1;
+                send_manager_dirs_buffer(&range, &range_count);
+            }
+        }
+        free(ranks);
+        free(rows);
+        return;
+    }
+    if (open_catalog_shard(&shard, work_node.path, work_node.chkidx) != 0) {
+        snprintf(errmsg, MESSAGESIZE, "Failed to map catalog shard %s/shard.%d", work_node.path, work_node.chkidx);
+        errsend(NONFATAL, errmsg);
+        return;
+    }
+    end = work_node.chkoff + work_node.chklen;
+    if (end > shard.rows) {
+        end = shard.rows;
+    }
+    writesize = MESSAGESIZE * o.batch.message;
+    writebuf = (char *) malloc(writesize * sizeof(char));
+    for (row = work_node.chkoff; row < end; row += count) {
+        count = (end - row < CATALOG_BLOCK)?(end - row):CATALOG_BLOCK;
+        if (catalog_match(&shard, &o.filter, row, count, mask) == 0) {
+            continue;
+        }
+        for (j = 0; j < count; j++) {
+            if (!mask[j]) {
+                continue;
+            }
+            catalog_row(&shard, row + j, &path, &st);
+            if (S_ISDIR(st.st_mode)) {
+                num_examined_dirs++;
+            }
+            else {
+                num_examined_files++;
+                num_examined_bytes += st.st_size;
+            }
+            if (o.verbose) {
+                printmode(st.st_mode, modebuf);
+                memcpy(&sttm, localtime(&st.st_mtime), sizeof(sttm));
+                strftime(timebuf, sizeof(timebuf), "%a %b %d %Y %H:%M:%S", &sttm);
+                snprintf(statrecord, MESSAGESIZE, "INFO  DATASTAT - %s %6lu %6d %6d %21zd %s %s\n", modebuf, (long unsigned int) st.st_blocks, st.st_uid, st.st_gid, (size_t) st.st_size, timebuf, path);
+                MPI_Pack(statrecord, MESSAGESIZE, MPI_CHAR, writebuf, writesize, &out_position, MPI_COMM_WORLD);
+                write_count++;
+                if (write_count >= o.batch.message) {
+                    write_buffer_output(writebuf, writesize, write_count);
+                    out_position = 0;
+                    write_count = 0;
+                }
+            }
+        }
+    }
+    if (write_count > 0) {
+        write_buffer_output(writebuf, MESSAGESIZE * write_count, write_count);
+    }
+    send_manager_examined_stats(num_examined_files, num_examined_bytes, num_examined_dirs);
+    free(writebuf);
+    close_catalog_shard(&shard);
+}
+
 int stat_item(path_item *work_node, struct options o) {
     //takes a work node, stats it and figures out some of its characteristics
     struct stat st;
@@ -1287,6 +2309,257 @@ int stat_item(path_item *work_node, struct options o) {
     return 0;
 }
 
+/**
+* A version of stat_item() for destination paths. The path
+* is looked up relative to a directory handle, which stays
+* open while consecutive files go to the same directory.
+* Builds that need stat_item()'s full path handling
+* (PLFS, FUSE, TAPE) just call stat_item().
+*
+* @param work_node	the path_item to stat
+* @param dh		the directory handle to look the path
+* 			up in
+* @param o		the PFTOOL global options structure
+*
+* @return 0 on success, -1 if the path does not exist
+*/
+int stat_item_at(path_item *work_node, dir_handle *dh, struct options o) {
+#if defined(PLFS) || defined(FUSE_CHUNKER) || defined(TAPE)
+    return(stat_item(work_node, o));
+#else
+    struct stat st;
+    const char *name;
+    int dirfd;
+
+    if ((dirfd = get_dir_handle(dh, work_node->path, &name)) < 0) {	// no parent directory -> let stat_item() sort it out
+        return(stat_item(work_node, o));
+    }
+    work_node->desttype = REGULARFILE;
+    work_node->ftype = REGULARFILE;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return -1;
+    }
+#ifdef GEN_SYNDATA
+    if(o.syn_size)
+       st.st_size = o.syn_size;
+#endif
+    work_node->st = st;
+    if (S_ISLNK(st.st_mode)) {
+        work_node->ftype = LINKFILE;
+    }
+    return 0;
+#endif
+}
+
+/**
+* A version of stat_item_at() for the names read while walking
+* the tree. It stats only the fields the run needs (see
+* walk_stat_at()). A listing without -v does not stat
+* directories at all: the type and inode number from the
+* directory entry are all it uses. worker_readdir() leaves those
+* in work_node->st (a zero st_mode if the file system did not
+* report the type). Builds that need stat_item()'s full path
+* handling (PLFS, FUSE, TAPE) just call stat_item().
+*
+* @param work_node	the path_item to stat
+* @param dh		the directory handle to look the path
+* 			up in
+* @param o		the PFTOOL global options structure
+*
+* @return 0 on success, -1 if the path could not be stat'ed
+*/
+int stat_item_walk(path_item *work_node, dir_handle *dh, struct options o) {
+#if defined(PLFS) || defined(FUSE_CHUNKER) || defined(TAPE)
+    return(stat_item(work_node, o));
+#else
+    struct stat st;
+    const char *name;
+    int dirfd;
+
+    work_node->desttype = REGULARFILE;
+    work_node->ftype = REGULARFILE;
+    if (o.work_type == LSWORK && !o.verbose && !o.snapshot[0] && !o.catalog[0] && o.du_depth < 0 && S_ISDIR(work_node->st.st_mode)) {
+        return 0;
+    }
+    if ((dirfd = get_dir_handle(dh, work_node->path, &name)) < 0) {	// no parent directory -> let stat_item() sort it out
+        return(stat_item(work_node, o));
+    }
+    if (walk_stat_at(dirfd, name, &st, o) == -1) {
+        return -1;
+    }
+#ifdef GEN_SYNDATA
+    if(o.syn_size)
+       st.st_size = o.syn_size;
+#endif
+    work_node->st = st;
+    if (S_ISLNK(st.st_mode)) {
+        work_node->ftype = LINKFILE;
+    }
+    return 0;
+#endif
+}
+
+// The work shared by the threads of stat_paths()
+struct stat_batch {
+    path_item *items;
+    int *rcs;
+    int count;
+    int next;						// index of the next item to be claimed
+    int walk;						// 1 -> names from the tree walk (stat_item_walk()), 0 -> stat_item_at()
+    struct options *o;
+    pthread_mutex_t lock;
+};
+
+/**
+* Thread body for stat_paths(). Each thread has its own
+* directory handle, and claims items from the batch until
+* none are left.
+*
+* @param arg		the struct stat_batch to work on
+*
+* @return NULL
+*/
+static void *stat_paths_thread(void *arg) {
+    struct stat_batch *batch = (struct stat_batch *)arg;
+    dir_handle dh;
+    int i;
+
+    init_dir_handle(&dh);
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) {
+            break;
+        }
+        if (batch->walk) {
+            batch->rcs[i] = stat_item_walk(&batch->items[i], &dh, *batch->o);
+        }
+        else {
+            batch->rcs[i] = stat_item_at(&batch->items[i], &dh, *batch->o);
+        }
+    }
+    close_dir_handle(&dh);
+    return NULL;
+}
+
+/**
+* Stats a list of paths with up to num_threads stats in
+* flight at once, so that walking a tree on a file system
+* with slow metadata round trips is bound by concurrency
+* rather than by the latency of each stat. Builds that need
+* stat_item()'s full handling (PLFS, FUSE, TAPE, which may
+* talk to MPI) stat the paths one at a time with stat_item().
+*
+* @param items		the paths to stat. Their struct stat and
+* 			types are filled in
+* @param rcs		gets the return code of the stat of each item
+* @param count		the number of items
+* @param num_threads	the maximum number of concurrent stats
+* @param walk		1 -> the items are names from the tree walk,
+* 			stat'ed with stat_item_walk()
+* @param o		the PFTOOL global options structure
+*/
+void stat_paths(path_item *items, int *rcs, int count, int num_threads, int walk, struct options o) {
+    struct stat_batch batch;
+    pthread_t *threads;
+    int started = 0;
+    int i;
+
+#if defined(PLFS) || defined(FUSE_CHUNKER) || defined(TAPE)
+    num_threads = 1;
+#endif
+    if (num_threads > count) {
+        num_threads = count;
+    }
+    batch.items = items;
+    batch.rcs = rcs;
+    batch.count = count;
+    batch.next = 0;
+    batch.walk = walk;
+    batch.o = &o;
+    pthread_mutex_init(&batch.lock, NULL);
+    threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    for (i = 0; num_threads > 1 && i < num_threads; i++) {
+        if (pthread_create(&threads[started], NULL, stat_paths_thread, &batch) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {								// no threads -> do the work here
+        stat_paths_thread(&batch);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&batch.lock);
+}
+
+/**
+* Stats a buffer of names read from directories with
+* stat_paths(), and drops the ones that could not be stat'ed.
+* The failures are reported as stat_item() failures are in
+* worker_readdir(): NONFATAL for a listing, FATAL otherwise.
+*
+* @param workbuffer	the names to stat
+* @param buffer_count	the number of names. Returns the number
+* 			of items left
+* @param o		the PFTOOL global options structure
+*/
+void stat_name_buffer(path_item *workbuffer, int *buffer_count, struct options o) {
+    char errmsg[MESSAGESIZE];
+    int *rcs = (int *) malloc(*buffer_count * sizeof(int));
+    int i, kept = 0;
+
+    stat_paths(workbuffer, rcs, *buffer_count, o.stat_threads, 1, o);
+    for (i = 0; i < *buffer_count; i++) {
+        if (rcs[i] != 0) {
+            snprintf(errmsg, MESSAGESIZE, "Failed to stat path %s", workbuffer[i].path);
+            if (o.work_type == LSWORK) {
+                errsend(NONFATAL, errmsg);
+                continue;
+            }
+            else {
+                errsend(FATAL, errmsg);
+            }
+        }
+        workbuffer[kept++] = workbuffer[i];
+    }
+    *buffer_count = kept;
+    free(rcs);
+}
+
+/**
+* Drops the stat'ed entries of a walk that the filter (-e)
+* rules out. Directories are kept, so that they are walked.
+*
+* @param workbuffer	the stat'ed entries
+* @param buffer_count	the number of entries. Returns the number
+* 			of entries left
+* @param snap		the snapshots of the worker, or NULL. The
+* 			dropped entries are added unstat'ed, so that
+* 			a run without the filter copies them
+* @param o		the PFTOOL global options structure
+*/
+void filter_items(path_item *workbuffer, int *buffer_count, snapshot *snap, struct options o) {
+    const char *name;
+    int i, kept = 0;
+
+    if (o.filter.count == 0) {
+        return;
+    }
+    for (i = 0; i < *buffer_count; i++) {
+        if (S_ISDIR(workbuffer[i].st.st_mode) || filter_stat(&o.filter, workbuffer[i].path, &workbuffer[i].st)) {
+            workbuffer[kept++] = workbuffer[i];
+        }
+        else if (snap != NULL) {
+            name = strrchr(workbuffer[i].path, '/');
+            snapshot_add_entry(snap, (name)?name + 1:workbuffer[i].path, NULL);
+        }
+    }
+    *buffer_count = kept;
+}
+
 /**
 * This function tests the metadata of the two nodes
 * to see if they are the same. For files that are chunkable,
@@ -1332,7 +2605,7 @@ int samefile(path_item src, path_item dst, struct options o) {
 * @param rank		the process MPI rank of the process
 * 			doing the buffer processing
 */
-void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *base_path, path_item dest_node, struct options o, int rank) {
+void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *base_path, path_item dest_node, walk_state *ws, struct options o, int rank) {
     //When a worker is told to stat, it comes here
     int out_position;
     char *writebuf;
@@ -1357,12 +2630,17 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
     size_t chunk_at = 0;					// current limit at which files are chunked
     int idx = 0;					 	// keeps track of the chunk index
     size_t num_bytes_seen = 0;
-    //500 MB
-    size_t ship_off = 524288000;
     off_t chunk_curr_offset = 0;				// offset into file while chunking
     //classification
-    path_item dirbuffer[DIRBUFFER], regbuffer[COPYBUFFER];
+    path_item *dirbuffer = (path_item *) malloc(o.batch.dir * sizeof(path_item));
+    path_item *regbuffer = (path_item *) malloc(o.batch_count * sizeof(path_item));	// a batch of copy work is shipped at o.batch_count items or o.batch_bytes bytes
     int dir_buffer_count = 0, reg_buffer_count = 0;
+    dir_handle dest_dir;					// open destination directory, for relative lookups
+    path_item *dest_items = NULL;				// destinations of the files, stat'ed ahead o.stat_threads at once
+    char *out_path;
+    int *dest_rcs = NULL;
+    int *dest_idx = NULL;					// index in dest_items of each entry
+    int dest_count = 0;
 #ifdef FUSE_CHUNKER
     struct timeval tv;
     char myhost[512];
@@ -1381,10 +2659,31 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
     //write_count = stat_count;
     writesize = MESSAGESIZE * MESSAGEBUFFER;
     writebuf = (char *) malloc(writesize * sizeof(char));
+    init_dir_handle(&dest_dir);
+    if (o.stat_threads > 1 && *stat_count > 1) {
+        dest_items = (path_item *) malloc(*stat_count * sizeof(path_item));
+        dest_rcs = (int *) malloc(*stat_count * sizeof(int));
+        dest_idx = (int *) malloc(*stat_count * sizeof(int));
+        for (i = 0; i < *stat_count; i++) {
+            dest_idx[i] = -1;
+            if (!S_ISDIR(path_buffer[i].st.st_mode)) {
+                out_path = get_output_path(base_path, path_buffer[i], dest_node, o);
+                strncpy(dest_items[dest_count].path, out_path, PATHSIZE_PLUS);
+                free(out_path);
+                if (dest_may_exist(&ws->dc, dest_items[dest_count].path)) {
+                    dest_idx[i] = dest_count;
+                    dest_count++;
+                }
+            }
+        }
+        stat_paths(dest_items, dest_rcs, dest_count, o.stat_threads, 0, o);
+    }
 
     out_position = 0;
     for (i = 0; i < *stat_count; i++) {
         work_node = path_buffer[i];				// Note that work_node is NOT a pointer. It is a contiguous structure. This assignment copies contigous memory from one structure to another! - cds 2/2015
+        work_node.chkoff = 0;					// whole chunks, until a copy is split
+        work_node.chklen = 0;
         PRINT_IO_DEBUG("rank %d: process_stat_buffer() processing entry %d: %s\n", rank, i, work_node.path);
         st = work_node.st;
         process = FALSE;
@@ -1395,7 +2694,7 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
         else if (S_ISDIR(st.st_mode)) {				// it's a directory
             dirbuffer[dir_buffer_count] = work_node;
             dir_buffer_count++;
-            if (dir_buffer_count % DIRBUFFER == 0) {
+            if (dir_buffer_count >= o.batch.dir) {
                 send_manager_dirs_buffer(dirbuffer, &dir_buffer_count);
             }
             num_examined_dirs++;
@@ -1403,7 +2702,21 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
         else {							// it's a file, not a directory - do this for all regular files AND fuse+symylinks
             parallel_dest = o.parallel_dest;
             strncpy(out_node.path, get_output_path(base_path, work_node, dest_node, o), PATHSIZE_PLUS);
-            dest_exists = !(rc = stat_item(&out_node, o));	// get the struct stat of the destination and set the dest_exists flag
+            if (dest_items != NULL && dest_idx[i] >= 0) {
+                out_node.st = dest_items[dest_idx[i]].st;
+                out_node.ftype = dest_items[dest_idx[i]].ftype;
+                out_node.desttype = dest_items[dest_idx[i]].desttype;
+                rc = dest_rcs[dest_idx[i]];
+            }
+            else if ((dest_items != NULL && dest_idx[i] < 0) || !dest_may_exist(&ws->dc, out_node.path)) {	// known not to exist -> no lookup
+                out_node.ftype = REGULARFILE;
+                out_node.desttype = REGULARFILE;
+                rc = -1;
+            }
+            else {
+                rc = stat_item_at(&out_node, &dest_dir, o);
+            }
+            dest_exists = !rc;					// get the struct stat of the destination and set the dest_exists flag
             if (o.work_type == COPYWORK) {			// prep for COPYWORK
                 process = TRUE;					// set flag to process file
 #ifdef PLFS
@@ -1456,8 +2769,8 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
                             }
                             else {
 #endif
-				if (!o.different || work_node.st.st_size < o.chunk_at)
-                                    rc = unlink(out_node.path);	// remove the destination file only of not doing a conditional transfer, or source file size <= chunk_at size
+				if (!o.plan[0] && (!o.different || work_node.st.st_size < o.chunk_at))
+                                    rc = unlink(out_node.path);	// remove the destination file only of not doing a conditional transfer, or source file size <= chunk_at size. A plan removes it when it is run
 #ifdef PLFS
                             }
 #endif
@@ -1527,7 +2840,7 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
                   regbuffer[reg_buffer_count] = work_node;
                   reg_buffer_count++;
                 }
-									
+
 		if (work_node.st.st_size >= chunk_at) {		// working with a chunkable file
 		  int ctmExists = hasCTM(out_node.path);
 
@@ -1541,9 +2854,23 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
 		      PRINT_IO_DEBUG("rank %d: process_stat_buffer() Reading persistent store of CTM: %s\n", rank, tostringCTM(ctm,&ctmstr,&ctmlen));
 		    }
 		  }
-		  else if (ctmExists)				// get rid of the CTM on the file if we are NOT doing a conditional transfer
+		  else if (ctmExists && !o.plan[0])		// get rid of the CTM on the file if we are NOT doing a conditional transfer. A plan gets rid of it when it is run
 		    purgeCTM(out_node.path);	
 		}
+
+		if (o.chunk_secs > 0 && ctm == NULL && work_node.st.st_size >= chunk_at && chunk_at > 0 &&
+		    work_node.ftype == REGULARFILE && work_node.desttype == REGULARFILE &&
+		    !(o.work_type == COMPAREWORK && o.meta_data_only)) {	// plan the chunk size from the file size, free workers and copy rate. A restart keeps the chunk size of its CTM
+		  int free_workers;
+		  double worker_rate;
+		  size_t align = dest_node.st.st_blksize;
+
+		  if (o.dest_profile.blocksize > align)
+		    align = o.dest_profile.blocksize;
+		  request_chunk_plan_info(&free_workers, &worker_rate);
+		  chunk_size = plan_chunk_size(work_node.st.st_size, chunk_size, align, free_workers, worker_rate, o.chunk_secs);
+		  PRINT_IO_DEBUG("rank %d: process_stat_buffer() planned chunk size %zd for %s (%d free workers, %g bytes/sec)\n", rank, chunk_size, work_node.path, free_workers, worker_rate);
+		}
                 chunk_curr_offset = 0;				// keeps track of current offset in file for chunk.
 		idx = 0;				 	// keeps track of the chunk index
                 while (chunk_curr_offset < work_node.st.st_size) {
@@ -1578,9 +2905,9 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
                         regbuffer[reg_buffer_count] = work_node;// copy source file info into sending buffer
                         reg_buffer_count++;
 			PRINT_IO_DEBUG("rank %d: process_stat_buffer() adding chunk index: %d   chunk size: %ld\n", rank, work_node.chkidx, work_node.chksz);
-                        if (reg_buffer_count % COPYBUFFER == 0 || num_bytes_seen >= ship_off) {
+                        if (reg_buffer_count >= o.batch_count || num_bytes_seen >= o.batch_bytes) {
 			  PRINT_MPI_DEBUG("rank %d: process_stat_buffer() parallel destination - sending %d reg buffers to manager.\n", rank, reg_buffer_count);
-                          send_manager_regs_buffer(regbuffer, &reg_buffer_count);
+                          send_copy_buffer(regbuffer, &reg_buffer_count, ws);
                           num_bytes_seen = 0;
                         }
 		      } // end send test
@@ -1597,14 +2924,17 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
                     num_bytes_seen += work_node.chksz;		// send this off to the manager work list, if ready to
                     regbuffer[reg_buffer_count] = work_node;
                     reg_buffer_count++;
-                    if (reg_buffer_count % COPYBUFFER == 0 || num_bytes_seen >= ship_off) {
+                    if (reg_buffer_count >= o.batch_count || num_bytes_seen >= o.batch_bytes) {
 			PRINT_MPI_DEBUG("rank %d: process_stat_buffer() non-parallel destination - sending %d reg buffers to manager.\n", rank, reg_buffer_count);
-                        send_manager_regs_buffer(regbuffer, &reg_buffer_count);
+                        send_copy_buffer(regbuffer, &reg_buffer_count, ws);
                         num_bytes_seen = 0;
                     }
                 }
             }
         }
+        catalog_add(&ws->cat, work_node.path, &st);
+        du_add(&ws->du, work_node.path, &st);
+        histogram_add(&ws->hist, &st);
         if (! S_ISDIR(st.st_mode)) {
             num_examined_files++;
             num_examined_bytes += st.st_size;
@@ -1631,16 +2961,16 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
             }
             MPI_Pack(statrecord, MESSAGESIZE, MPI_CHAR, writebuf, writesize, &out_position, MPI_COMM_WORLD);
             write_count++;
-            if (write_count % MESSAGEBUFFER == 0) {
+            if (write_count >= o.batch.message) {
                 write_buffer_output(writebuf, writesize, write_count);
                 out_position = 0;
                 write_count = 0;
             }
         }
 
-        if (reg_buffer_count >= COPYBUFFER) {			// regbuffer is full (probably with zero-length files) -> send it off to manager. - cds 8/2015
+        if (reg_buffer_count >= o.batch_count) {			// regbuffer is full (probably with zero-length files) -> send it off to manager. - cds 8/2015
 	    PRINT_MPI_DEBUG("rank %d: process_stat_buffer() sending %d reg buffers to manager.\n", rank, reg_buffer_count);
-            send_manager_regs_buffer(regbuffer, &reg_buffer_count);
+            send_copy_buffer(regbuffer, &reg_buffer_count, ws);
         }
     } //end of stat processing loop
     //incase we tried to copy a file into itself
@@ -1653,7 +2983,7 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
         send_manager_dirs_buffer(dirbuffer, &dir_buffer_count);
     }
     while (reg_buffer_count != 0) {
-        send_manager_regs_buffer(regbuffer, &reg_buffer_count);
+        send_copy_buffer(regbuffer, &reg_buffer_count, ws);
     }
 #ifdef TAPE
     while (tape_buffer_count != 0) {
@@ -1664,9 +2994,36 @@ void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *ba
     send_manager_examined_stats(num_examined_files, num_examined_bytes, num_examined_dirs);
     //free malloc buffers
     free(writebuf);
+    free(regbuffer);
+    free(dirbuffer);
+    free(dest_items);
+    free(dest_rcs);
+    free(dest_idx);
+    close_dir_handle(&dest_dir);
     *stat_count = 0;
 }
 
+/**
+* Ships a batch of copy work: to the manager, or into this
+* rank's shard of the plan, if this is a plan-only run (-g).
+*
+* @param buffer		the work items
+* @param buffer_count	the number of items. Set to 0
+* @param ws		the walk state of the worker
+*/
+void send_copy_buffer(path_item *buffer, int *buffer_count, walk_state *ws) {
+    int i;
+
+    if (!ws->plan.dir[0]) {
+        send_manager_regs_buffer(buffer, buffer_count);
+        return;
+    }
+    for (i = 0; i < *buffer_count; i++) {
+        plan_add(&ws->plan, &buffer[i]);
+    }
+    *buffer_count = 0;
+}
+
 #ifdef TAPE
 void worker_taperecall(int rank, int sending_rank, path_item dest_node, struct options o) {
     MPI_Status status;
@@ -1680,8 +3037,6 @@ void worker_taperecall(int rank, int sending_rank, path_item dest_node, struct o
     path_item workbuffer[STATBUFFER];
     int buffer_count = 0;
     size_t num_bytes_seen = 0;
-    //500 MB
-    size_t ship_off = 524288000;
     int i, rc;
     PRINT_MPI_DEBUG("rank %d: worker_taperecall() Receiving the read_count from %d\n", rank, sending_rank);
     if (MPI_Recv(&read_count, 1, MPI_INT, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
@@ -1703,7 +3058,7 @@ void worker_taperecall(int rank, int sending_rank, path_item dest_node, struct o
         if (rc == 0) {
             workbuffer[buffer_count] = work_node;
             buffer_count += 1;
-            if (buffer_count % COPYBUFFER == 0 || num_bytes_seen >= ship_off) {
+            if (buffer_count >= o.batch_count || buffer_count == STATBUFFER || num_bytes_seen >= o.batch_bytes) {
                 send_manager_regs_buffer(workbuffer, &buffer_count);
             }
             if (o.verbose) {
@@ -1732,7 +3087,7 @@ void worker_taperecall(int rank, int sending_rank, path_item dest_node, struct o
 }
 #endif
 
-void worker_copylist(int rank, int sending_rank, const char *base_path, path_item dest_node, struct options o) {
+void worker_copylist(int rank, int sending_rank, const char *base_path, path_item dest_node, blocksize_policy *bp, struct options o) {
     //When a worker is told to copy, it comes here
     MPI_Status status;
     char *workbuf, *writebuf;
@@ -1743,14 +3098,30 @@ void worker_copylist(int rank, int sending_rank, const char *base_path, path_ite
     int position, out_position;
     int read_count;
     path_item work_node, out_node;
+    path_item tail;						// piece of a chunk handed off to another worker
     char copymsg[MESSAGESIZE];
     off_t offset;
-    size_t length;
+    off_t length;
     int num_copied_files = 0;
     size_t num_copied_bytes = 0;
-    path_item chunks_copied[CHUNKBUFFER];
+    path_item *chunks_copied;					// chunks to report to the ACCUM_PROC
     int buffer_count = 0;
     int i, rc;
+    //small files
+    dir_handle src_dir, dest_dir;				// directories of the last small file copied
+    char *smallbuf = NULL;					// data buffer shared by all small files in the list
+    char errmsg[MESSAGESIZE];
+    int use_small;						// flag to indicate that the current item takes the small-file path
+    path_item *small_src = NULL, *small_dest = NULL;		// small files copied concurrently, ahead of the main loop
+    int *small_rc = NULL;
+    char *small_msg = NULL, *out_path;
+    int small_count = 0, small_idx = 0;
+    //block sizes
+    size_t blocksize;						// block size of the current copy. 0 if the copy does not use one
+    size_t min_blocksize = 0, max_blocksize = 0;		// range of block sizes used in this list
+    size_t blocked_bytes = 0;					// bytes copied with a block size
+    double blocksize_bytes = 0.0;				// sum of blocksize * bytes copied with it, for the average
+    struct timeval copy_start, copy_end;
 #ifdef FUSE_CHUNKER
     //partial file restart
     struct utimbuf ut, chunk_ut;
@@ -1765,6 +3136,7 @@ void worker_copylist(int rank, int sending_rank, const char *base_path, path_ite
     workbuf = (char *) malloc(worksize * sizeof(char));
     writesize = MESSAGESIZE * read_count;
     writebuf = (char *) malloc(writesize * sizeof(char));
+    chunks_copied = (path_item *) malloc(read_count * sizeof(path_item));
     //gather the path to stat
     PRINT_MPI_DEBUG("rank %d: worker_copylist() Receiving the workbuf from %d\n", rank, sending_rank);
     if (MPI_Recv(workbuf, worksize, MPI_PACKED, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
@@ -1775,26 +3147,93 @@ void worker_copylist(int rank, int sending_rank, const char *base_path, path_ite
     if(o.syn_size) 
        synbuf = syndataCreateBuffer(o.syn_pattern[0]?o.syn_pattern:(char*)&rank);		// If no pattern id is given -> use rank as a seed for random data
 #endif
+    init_dir_handle(&src_dir);
+    init_dir_handle(&dest_dir);
+    //with io threads, the small files in the list are copied concurrently first. Results are reported in list order below
+    if (o.io_threads > 1) {
+        small_src = (path_item *) malloc(read_count * sizeof(path_item));
+        small_dest = (path_item *) malloc(read_count * sizeof(path_item));
+        small_rc = (int *) malloc(read_count * sizeof(int));
+        small_msg = (char *) malloc(read_count * MESSAGESIZE * sizeof(char));
+        position = 0;
+        for (i = 0; i < read_count; i++) {
+            MPI_Unpack(workbuf, worksize, &position, &work_node, sizeof(path_item), MPI_CHAR, MPI_COMM_WORLD);
+            use_small = is_small_file(work_node);
+#ifdef GEN_SYNDATA
+            use_small = use_small && !syndataExists(synbuf);
+#endif
+            if (use_small) {
+                small_src[small_count] = work_node;
+                out_path = get_output_path(base_path, work_node, dest_node, o);
+                strncpy(small_dest[small_count].path, out_path, PATHSIZE_PLUS);
+                free(out_path);
+                small_count++;
+            }
+        }
+        if (small_count > 0) {
+            PRINT_IO_DEBUG("rank %d: worker_copylist() copying %d small files with %d threads\n", rank, small_count, o.io_threads);
+            copy_small_files(small_src, small_dest, small_count, small_rc, small_msg, o.io_threads);
+        }
+    }
     position = 0;
     out_position = 0;
     for (i = 0; i < read_count; i++) {
         PRINT_MPI_DEBUG("rank %d: worker_copylist() unpacking work_node from %d\n", rank, sending_rank);
         MPI_Unpack(workbuf, worksize, &position, &work_node, sizeof(path_item), MPI_CHAR, MPI_COMM_WORLD);
-        offset = work_node.chkidx*work_node.chksz;
-        length = ((offset+work_node.chksz)>work_node.st.st_size)?(work_node.st.st_size-offset):work_node.chksz;
+        get_chunk_range(work_node, &offset, &length);
+        tail.chklen = 0;
 PRINT_MPI_DEBUG("rank %d: worker_copylist() chunk index %d unpacked. offset = %ld   length = %ld\n", rank, work_node.chkidx, offset, length);
         strncpy(out_node.path, get_output_path(base_path, work_node, dest_node, o), PATHSIZE_PLUS);
         strncpy(out_node.fstype,o.dest_fstype,128);						// make sure destination filesystem type is assigned for copy - cds 6/2014
+        use_small = is_small_file(work_node);
+#ifdef GEN_SYNDATA
+        use_small = use_small && !syndataExists(synbuf);
+#endif
+        blocksize = (use_small || S_ISLNK(work_node.st.st_mode))?0:pick_blocksize(bp, length);
+        if (use_small) {
+            if (small_count > 0) {					// already copied by copy_small_files() -> pick up the result
+                rc = small_rc[small_idx];
+                strncpy(errmsg, small_msg + small_idx*MESSAGESIZE, MESSAGESIZE);
+                small_idx++;
+            }
+            else {
+                if (smallbuf == NULL) {
+                    smallbuf = (char *) malloc(SMALLFILE_SIZE * sizeof(char));
+                }
+                rc = copy_small_file(work_node, out_node, &src_dir, &dest_dir, smallbuf, errmsg);
+            }
+            if (rc < 0) {
+                errsend(NONFATAL, errmsg);
+            }
+            else if (rc > 0) {						// data was copied, only the metadata failed
+                send_small_file_errors(rc, work_node, out_node);
+                rc = 0;
+            }
+        }
 #ifdef FUSE_CHUNKER
-        if (work_node.desttype != FUSEFILE) {
+        else if (work_node.desttype != FUSEFILE) {
+#else
+        else {
 #endif
+            path_item *tailp = (o.split_at && work_node.desttype == REGULARFILE && work_node.chksz < work_node.st.st_size)?&tail:NULL;	// only chunks of a chunked file are split
+
+            gettimeofday(&copy_start, NULL);
 #ifdef GEN_SYNDATA
-            rc = copy_file(work_node, out_node, o.blocksize, synbuf, rank);
+            rc = copy_file(work_node, out_node, (blocksize)?blocksize:o.blocksize, synbuf, &o.dest_profile, o.split_at, tailp, rank);
 #else
-            rc = copy_file(work_node, out_node, o.blocksize, rank);
+            rc = copy_file(work_node, out_node, (blocksize)?blocksize:o.blocksize, &o.dest_profile, o.split_at, tailp, rank);
 #endif
-#ifdef FUSE_CHUNKER
+            gettimeofday(&copy_end, NULL);
+            if (tail.chklen > 0) {					// the end of the range went to another worker -> account for what was copied here
+                work_node.chkoff = offset - (work_node.chkidx*work_node.chksz);
+                length -= tail.chklen;
+                work_node.chklen = length;
+            }
+            if (rc >= 0 && blocksize) {
+                record_blocksize_rate(bp, blocksize, length, (copy_end.tv_sec - copy_start.tv_sec) + (copy_end.tv_usec - copy_start.tv_usec)/1000000.0);
+            }
         }
+#ifdef FUSE_CHUNKER
         else {
             userid = work_node.st.st_uid;
             groupid = work_node.st.st_gid;
@@ -1807,9 +3246,9 @@ PRINT_MPI_DEBUG("rank %d: worker_copylist() chunk index %d unpacked. offset = %l
                     chunk_ut.actime != ut.actime||
                     chunk_ut.modtime != ut.modtime) { //not a match
 #  ifdef GEN_SYNDATA
-            	rc = copy_file(work_node, out_node, o.blocksize, synbuf, rank);
+            	rc = copy_file(work_node, out_node, (blocksize)?blocksize:o.blocksize, synbuf, &o.dest_profile, 0, NULL, rank);
 #  else
-                rc = copy_file(work_node, out_node, o.blocksize, rank);
+                rc = copy_file(work_node, out_node, (blocksize)?blocksize:o.blocksize, &o.dest_profile, 0, NULL, rank);
 #  endif
                 set_fuse_chunk_attr(out_node.path, offset, length, ut, userid, groupid);
             }
@@ -1818,6 +3257,7 @@ PRINT_MPI_DEBUG("rank %d: worker_copylist() chunk index %d unpacked. offset = %l
             }
         }
 #endif
+        pace((use_small)?length:0, 1);				// big copies were paced by copy_file()
         if (rc >= 0) {
             if (o.verbose) {
                 if (S_ISLNK(work_node.st.st_mode)) {
@@ -1835,6 +3275,12 @@ PRINT_MPI_DEBUG("rank %d: worker_copylist() chunk index %d unpacked. offset = %l
             if (!S_ISLNK(work_node.st.st_mode)) {
                 num_copied_bytes += length;
             }
+            if (blocksize && length > 0) {
+                if (!min_blocksize || blocksize < min_blocksize) min_blocksize = blocksize;
+                if (blocksize > max_blocksize) max_blocksize = blocksize;
+                blocked_bytes += length;
+                blocksize_bytes += (double)blocksize * length;
+            }
             //file is chunked
             if (offset != 0 || (offset == 0 && length != work_node.st.st_size)) {
                 chunks_copied[buffer_count] = work_node;
@@ -1851,12 +3297,20 @@ PRINT_MPI_DEBUG("rank %d: worker_copylist() chunk index %d unpacked. offset = %l
         update_chunk(chunks_copied, &buffer_count);
     }
     if (num_copied_files > 0 || num_copied_bytes > 0) {
-        send_manager_copy_stats(num_copied_files, num_copied_bytes);
+        send_manager_copy_stats(num_copied_files, num_copied_bytes, min_blocksize, max_blocksize, blocked_bytes, blocksize_bytes);
     }
     send_manager_work_done(rank);
 #ifdef GEN_SYNDATA
     syndataDestroyBuffer(synbuf);
 #endif
+    close_dir_handle(&src_dir);
+    close_dir_handle(&dest_dir);
+    if (smallbuf) free(smallbuf);
+    if (small_src) free(small_src);
+    if (small_dest) free(small_dest);
+    if (small_rc) free(small_rc);
+    if (small_msg) free(small_msg);
+    free(chunks_copied);
     free(workbuf);
     free(writebuf);
 }
@@ -1874,7 +3328,7 @@ void worker_comparelist(int rank, int sending_rank, const char *base_path, path_
     size_t length;
     int num_compared_files = 0;
     size_t num_compared_bytes = 0;
-    path_item chunks_copied[CHUNKBUFFER];
+    path_item *chunks_copied;					// chunks to report to the ACCUM_PROC
     int buffer_count = 0;
     int i, rc;
     PRINT_MPI_DEBUG("rank %d: worker_copylist() Receiving the read_count from %d\n", rank, sending_rank);
@@ -1885,6 +3339,7 @@ void worker_comparelist(int rank, int sending_rank, const char *base_path, path_
     workbuf = (char *) malloc(worksize * sizeof(char));
     writesize = MESSAGESIZE * read_count;
     writebuf = (char *) malloc(writesize * sizeof(char));
+    chunks_copied = (path_item *) malloc(read_count * sizeof(path_item));
     //gather the path to stat
     PRINT_MPI_DEBUG("rank %d: worker_copylist() Receiving the workbuf from %d\n", rank, sending_rank);
     if (MPI_Recv(workbuf, worksize, MPI_PACKED, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
@@ -1941,9 +3396,10 @@ void worker_comparelist(int rank, int sending_rank, const char *base_path, path_
     }
     //for all non-chunked files
     if (num_compared_files > 0 || num_compared_bytes > 0) {
-        send_manager_copy_stats(num_compared_files, num_compared_bytes);
+        send_manager_copy_stats(num_compared_files, num_compared_bytes, 0, 0, 0, 0.0);
     }
     send_manager_work_done(rank);
+    free(chunks_copied);
     free(workbuf);
     free(writebuf);
 }
@@ -19,6 +19,24 @@
 
 #include "hashtbl.h"
 #include "pfutils.h"
+#include "snapshot.h"
+#include "catalog.h"
+#include "du.h"
+#include "hist.h"
+#include "plan.h"
+#include "spill.h"
+#include "rate.h"
+
+// What a worker keeps from one walk task to the next
+struct walk_state {
+    dest_cache dc;					// what it knows of destination directories
+    snapshot snap;					// tree snapshots
+    catalog cat;					// its shard of the metadata catalog
+    du_table du;					// its usage totals
+    histogram hist;					// its size and age histograms
+    work_plan plan;					// its shard of the copy plan
+};
+typedef struct walk_state walk_state;
 
 /* Function Prototypes */
 //manager rank operations
@@ -26,7 +44,10 @@ void manager(int rank, struct options o, int nproc, path_list *input_queue_head,
 void manager_workdone(int rank, int sending_rank, int *proc_status);
 int manager_add_paths(int rank, int sending_rank, path_list **queue_head, path_list **queue_tail, int *queue_count);
 void manager_add_buffs(int rank, int sending_rank, work_buf_list **workbuflist, int *workbufsize);
-void manager_add_copy_stats(int rank, int sending_rank, int *num_copied_files, size_t *num_copied_bytes);
+void manager_add_process_buffs(int rank, int sending_rank, size_queue *queue);
+void worker_batch_sizes(int rank, int sending_rank, batch_sizes *sizes);
+void worker_rate(int rank, int sending_rank);
+void manager_add_copy_stats(int rank, int sending_rank, int *num_copied_files, size_t *num_copied_bytes, size_t *min_blocksize, size_t *max_blocksize, size_t *blocked_bytes, double *blocksize_bytes);
 void manager_add_examined_stats(int rank, int sending_rank, int *num_examined_files, size_t *num_examined_bytes, int *num_examined_dirs);
 #ifdef TAPE
 void manager_add_tape_stats(int rank, int sending_rank, int *num_examined_tapes, size_t *num_examined_tape_bytes);
@@ -39,11 +60,21 @@ void worker_flush_output(char *output_buffer, int *output_count);
 void worker_output(int rank, int sending_rank, int log, char *output_buffer, int *output_count, struct options o);
 void worker_buffer_output(int rank, int sending_rank, char *output_buffer, int *output_count, struct options o);
 void worker_update_chunk(int rank, int sending_rank, HASHTBL **chunk_hash, int *hash_count, const char *base_path, path_item dest_node, struct options o);
-void worker_readdir(int rank, int sending_rank, const char *base_path, path_item dest_node, int start, int makedir, struct options o);
+void worker_readdir(int rank, int sending_rank, const char *base_path, path_item dest_node, int start, int makedir, walk_state *ws, struct options o);
+void worker_stat(int rank, int sending_rank, const char *base_path, path_item dest_node, walk_state *ws, struct options o);
+void read_list_range(path_item range, path_item *workbuffer, int *buffer_count, const char *base_path, path_item dest_node, walk_state *ws, struct options o, int rank);
+void read_plan_range(path_item range, const char *base_path, path_item dest_node, struct options o, int rank);
+void worker_query(path_item work_node, int start, struct options o);
 int stat_item(path_item *work_node, struct options o);
-void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *base_path, path_item dest_node, struct options o, int rank);
+int stat_item_at(path_item *work_node, dir_handle *dh, struct options o);
+int stat_item_walk(path_item *work_node, dir_handle *dh, struct options o);
+void stat_paths(path_item *items, int *rcs, int count, int num_threads, int walk, struct options o);
+void stat_name_buffer(path_item *workbuffer, int *buffer_count, struct options o);
+void filter_items(path_item *workbuffer, int *buffer_count, snapshot *snap, struct options o);
+void process_stat_buffer(path_item *path_buffer, int *stat_count, const char *base_path, path_item dest_node, walk_state *ws, struct options o, int rank);
+void send_copy_buffer(path_item *buffer, int *buffer_count, walk_state *ws);
 void worker_taperecall(int rank, int sending_rank, path_item dest_node, struct options o);
-void worker_copylist(int rank, int sending_rank, const char *base_path, path_item dest_node, struct options o);
+void worker_copylist(int rank, int sending_rank, const char *base_path, path_item dest_node, blocksize_policy *bp, struct options o);
 void worker_comparelist(int rank, int sending_rank, const char *base_path, path_item dest_node, struct options o);
 
 
@@ -11,18 +11,27 @@
 *DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE					// for O_DIRECT
+#endif
 #include "config.h"
 #include <fcntl.h>
 #include <errno.h>
 
 #include "pfutils.h"
+#include "catalog.h"
+#include "spill.h"
+#include "rate.h"
 #include "debug.h"
 
 #include <syslog.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 
 #ifdef THREADS_ONLY
-#include <pthread.h>
 #include "mpii.h"
 #define MPI_Abort MPY_Abort
 #define MPI_Pack MPY_Pack
@@ -47,11 +56,37 @@ void usage () {
     printf (" [-p]                                      : path to start parallel tree walk (required argument)\n");
     printf (" [-c]                                      : destination path for data movement\n");
     printf (" [-j]                                      : unique jobid for the pftool job\n");
-    printf (" [-w]                                      : work type: copy, list, or compare\n");
-    printf (" [-i]                                      : process paths in a file list instead of walking the file system\n");
+    printf (" [-w]                                      : work type: copy, list, compare, query (a catalog written with -O), or du (see -m)\n");
+    printf (" [-i]                                      : process paths in a file list, or the rows of a catalog (-O), instead of walking the file system\n");
     printf (" [-s]                                      : block size for copy and compare\n");
     printf (" [-C]                                      : file size to start chunking (n to 1)\n");
     printf (" [-S]                                      : chunk size for copy\n");
+    printf (" [-D]                                      : target seconds per chunk. Plans chunk sizes up to -S per file\n");
+    printf (" [-k]                                      : hand the tail of a chunk to an idle worker when at least this much is left\n");
+    printf (" [-y]                                      : bytes in a copy batch\n");
+    printf (" [-Y]                                      : most files/chunks in a copy batch\n");
+    printf (" [-o]                                      : fixed batch sizes. Do not tune them at runtime\n");
+    printf (" [-L]                                      : look destinations up in listings of their directories, read once\n");
+    printf (" [-I]                                      : tree snapshot directory. Unchanged directories are not read again, and with -n unchanged files are skipped\n");
+    printf (" [-O]                                      : write a metadata catalog of the walk to this directory (one shard per rank)\n");
+    printf (" [-e]                                      : only process entries that match, e.g. size>1G,mtime>730d,uid=1000,type=f,name=*.h5. Directories are always walked\n");
+    printf (" [-m]                                      : report bytes, files, dirs and blocks per directory down to this depth, and per uid/gid (-w 4: 1)\n");
+    printf (" [-H]                                      : log2 histograms of file size, blocks and mtime/atime age, as a CSV file (- -> print them)\n");
+    printf (" [-g]                                      : plan only: walk and write the copy work (files and chunks) to this plan directory. No data is moved\n");
+    printf (" [-G]                                      : run the copy work of this plan directory (-g), with the same -p and -c. No tree walk\n");
+    printf (" [-q]                                      : memory for work queued in the manager. Past it, queued work spills to files in $TMPDIR\n");
+    printf (" [-Q]                                      : watermarks of the copy backlog, HIGH[,LOW[,HIGH_ITEMS[,LOW_ITEMS]]]. The walk slows down past LOW and stops past HIGH\n");
+    printf (" [-R]                                      : most bytes and files per second the job copies, BYTES[,FILES]. 0 -> no limit\n");
+    printf (" [-U]                                      : file to change the rates in while the job runs (BYTES[,FILES]). Read when it changes, or on SIGUSR1\n");
+    printf (" [-K]                                      : ranks copying at the start, more or fewer as copies speed up or slow down (AIMD). 0 -> all workers\n");
+    printf (" [-J]                                      : most copy batches in flight per destination directory, and per source device, DIRS[,DEVS]. 0 -> no limit\n");
+    printf (" [-N]                                      : hand copy work to ranks on the node that found it. A free rank waits this many milliseconds for such work before it takes any\n");
+    printf (" [-u]                                      : entries of a directory stat'ed by the rank reading it. The rest go to other ranks. 0 -> all\n");
+    printf (" [-b]                                      : minimum block size for copy. Turns on adaptive block sizes\n");
+    printf (" [-B]                                      : maximum block size for copy\n");
+    printf (" [-T]                                      : number of concurrent small-file copies per worker\n");
+    printf (" [-E]                                      : number of concurrent stats per worker while walking the tree\n");
+    printf (" [-F]                                      : pftool config file with [profile:<fstype>] overrides\n");
 #ifdef FUSE_CHUNKER
     printf (" [-f]                                      : path to FUSE directory\n");
     printf (" [-d]                                      : number of directories used for FUSE backend\n");
@@ -106,9 +141,13 @@ char *cmd2str(enum cmd_opcode cmdidx) {
 			,"CHUNKBUSYCMD"
 			,"COPYSTATSCMD"
 			,"EXAMINEDSTATSCMD"
+			,"PLANINFOCMD"
+			,"SPLITCMD"
+			,"BATCHSIZECMD"
+			,"RATECMD"
 				};
 
-	return((cmdidx > EXAMINEDSTATSCMD)?"Invalid Command":CMDSTR[cmdidx]);
+	return((cmdidx > RATECMD)?"Invalid Command":CMDSTR[cmdidx]);
 }
 
 char *printmode (mode_t aflag, char *buf) {
@@ -532,10 +571,47 @@ int one_byte_read(const char *path) {
     return 0;
 }
 
+/**
+* Gets the byte range a work item covers: its chunk, or the
+* piece of its chunk that was split off with tail splitting.
+*
+* @param src_file	the work item
+* @param offset		gets the offset of the range in the file
+* @param length		gets the length of the range
+*/
+void get_chunk_range(path_item src_file, off_t *offset, off_t *length) {
+    *offset = src_file.chkidx*src_file.chksz;
+    *length = ((*offset+src_file.chksz)>src_file.st.st_size)?(src_file.st.st_size-*offset):src_file.chksz;
+    if (src_file.chklen > 0) {								// a split piece of the chunk
+        *offset += src_file.chkoff;
+        *length = src_file.chklen;
+    }
+}
+
+/**
+* Copies a file, or a chunk of a file. When tail is given, the
+* copy checks between blocks for a SPLITCMD from the manager.
+* On one, the back half of what is left (at a block boundary)
+* is handed to the manager as a new work item, and this copy
+* stops at the split point. A paced copy also takes a new share
+* of the rates (RATECMD) between blocks.
+*
+* @param src_file	the source file or chunk
+* @param dest_file	the destination file
+* @param blocksize	the size of the reads and writes
+* @param profile	the tuning profile of the destination
+* @param split_at	the smallest tail that is handed off
+* @param tail		gets the piece that was handed off. Its
+* 			chklen is 0 if nothing was. NULL -> the
+* 			copy is never split
+* @param rank		the rank doing the copy
+*
+* @return 0 on success, -1 on failure
+*/
 #ifdef GEN_SYNDATA
-int copy_file(path_item src_file, path_item dest_file, size_t blocksize, syndata_buffer *synbuf, int rank) {
+int copy_file(path_item src_file, path_item dest_file, size_t blocksize, syndata_buffer *synbuf, fs_profile *profile, size_t split_at, path_item *tail, int rank) {
 #else
-int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int rank) {
+int copy_file(path_item src_file, path_item dest_file, size_t blocksize, fs_profile *profile, size_t split_at, path_item *tail, int rank) {
 #endif
     //take a src, dest, offset and length. Copy the file and return 0 on success, -1 on failure
     //MPI_Status status;
@@ -545,10 +621,13 @@ int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int ran
     char errormsg[MESSAGESIZE];
     //FILE *src_fd, *dest_fd;
     int flags;
+    int direct = 0;							// flag to indicate that the destination is written with O_DIRECT
     //MPI_File src_fd, dest_fd;
     int src_fd, dest_fd = -1;
-    off_t offset = (src_file.chkidx * src_file.chksz);	
-    off_t length = ((offset+src_file.chksz)>src_file.st.st_size)?(src_file.st.st_size-offset):src_file.chksz;
+    off_t offset, length;
+    size_t bufsize;							// block size the buffer was allocated with
+    int split_ready, split_cmd, splittable;
+    MPI_Status split_status;
 #ifdef PLFS
     int pid = getpid();
     Plfs_fd  *plfs_src_fd = NULL, *plfs_dest_fd = NULL;
@@ -558,6 +637,10 @@ int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int ran
     char link_path[PATHSIZE_PLUS];
     int numchars;
 
+    get_chunk_range(src_file, &offset, &length);
+    if (tail) {
+        tail->chklen = 0;
+    }
     //can't be const for MPI_IO
     if (S_ISLNK(src_file.st.st_mode)) {
         numchars = readlink(src_file.path, link_path, PATHSIZE_PLUS);
@@ -580,10 +663,20 @@ int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int ran
     if (length < blocksize) {										// a file < blocksize in size
         blocksize = length;
     }
+#ifdef O_DIRECT
+    if (profile->direct_io_at && length >= profile->direct_io_at && src_file.desttype == REGULARFILE &&
+        blocksize % DIRECTIO_ALIGN == 0 && offset % DIRECTIO_ALIGN == 0) {				// large, aligned transfer -> bypass the page cache
+       direct = 1;
+    }
+#endif
     if (blocksize) {											// if a non-zero length file -> allocate buf - cds 8/2015
-       buf = malloc(blocksize * sizeof(char));
+       if (!direct || posix_memalign((void **)&buf, DIRECTIO_ALIGN, blocksize) != 0) {
+          direct = 0;
+          buf = malloc(blocksize * sizeof(char));
+       }
        memset(buf, '\0', blocksize);
     }
+    bufsize = blocksize;
     //MPI_File_read(src_fd, buf, 2, MPI_BYTE, &status);
     //open the source file for reading in binary mode
     //rc = MPI_File_open(MPI_COMM_SELF, source_file, MPI_MODE_RDONLY, MPI_INFO_NULL, &src_fd);
@@ -612,7 +705,7 @@ int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int ran
 
     //first create a file and open it for appending (file doesn't exist)
     //rc = MPI_File_open(MPI_COMM_SELF, destination_file, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &dest_fd);
-    if ((src_file.st.st_size == length && offset == 0) || strncmp(dest_file.fstype,"panfs",5)) {	// no chunking or not writing to PANFS - cds 6/2014
+    if ((src_file.st.st_size == length && offset == 0) || !profile->concurrent_write) {	// no chunking or file system does not need it - cds 6/2014
        flags = O_WRONLY | O_CREAT;
        PRINT_IO_DEBUG("rank %d: copy_file() fstype = %s. Setting open flags to O_WRONLY | O_CREAT\n", rank, dest_file.fstype);
     }
@@ -625,6 +718,15 @@ int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int ran
         dest_fd = plfs_open(&plfs_dest_fd, dest_file.path, flags, pid+rank, src_file.st.st_mode, NULL);
     }
     else{
+#endif
+#ifdef O_DIRECT
+        if (direct) {
+            dest_fd = open(dest_file.path, flags | O_DIRECT, 0600);
+            if (dest_fd < 0 && errno == EINVAL) {						// file system refuses O_DIRECT -> use the page cache
+                direct = 0;
+            }
+        }
+        if (!direct)
 #endif
        	dest_fd = open(dest_file.path, flags, 0600);
 #ifdef PLFS
@@ -637,9 +739,41 @@ int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int ran
     }
 
     while (completed != length) {
+        splittable = (tail && split_at && tail->chklen == 0 && bufsize && (length - completed) >= 2*split_at);	// big enough to hand off half of what is left
+        if (splittable || pace_active()) {				// a split, or a new share of the rates, may come
+            MPI_Iprobe(MANAGER_PROC, rank, MPI_COMM_WORLD, &split_ready, &split_status);
+            if (split_ready) {
+                if (MPI_Recv(&split_cmd, 1, MPI_INT, MANAGER_PROC, rank, MPI_COMM_WORLD, &split_status) != MPI_SUCCESS) {
+                    errsend(FATAL, "Failed to receive split command\n");
+                }
+                if (split_cmd == RATECMD) {
+                    receive_pace(MANAGER_PROC);
+                }
+                else if (split_cmd == SPLITCMD && splittable) {
+                    off_t split = offset + completed + (length - completed)/2;
+                    int tail_count = 1;
+
+                    split -= split % bufsize;							// split at a block boundary
+                    if (split > offset + (off_t)completed) {
+                        *tail = src_file;
+                        tail->chkoff = split - (src_file.chkidx * src_file.chksz);
+                        tail->chklen = offset + length - split;
+                        PRINT_IO_DEBUG("rank %d: copy_file() Handing off %s offs %ld len %ld\n", rank, src_file.path, split, tail->chklen);
+                        send_manager_regs_buffer(tail, &tail_count);
+                        length = split - offset;
+                    }
+                }
+            }
+        }
         //1 MB is too big
         if ((length - completed) < blocksize) {
             blocksize = (length - completed);
+#ifdef O_DIRECT
+            if (direct && blocksize % DIRECTIO_ALIGN) {					// unaligned tail -> finish through the page cache
+                fcntl(dest_fd, F_SETFL, fcntl(dest_fd, F_GETFL) & ~O_DIRECT);
+                direct = 0;
+            }
+#endif
         }
         //rc = MPI_File_read_at(src_fd, completed, buf, blocksize, MPI_BYTE, &status);
         memset(buf, '\0', blocksize);
@@ -691,6 +825,7 @@ int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int ran
             return -1;
         }
         completed += blocksize;
+        pace(blocksize, 0);								// keep to this rank's share of the job's rate (-R)
     }
     PRINT_IO_DEBUG("rank %d: copy_file() Copy of %d bytes complete for file %s\n", rank, bytes_processed, dest_file.path);
 #ifdef GEN_SYNDATA
@@ -919,539 +1054,2726 @@ int update_stats(path_item src_file, path_item dest_file) {
     return 0;
 }
 
-//local functions only
-int request_response(int type_cmd) {
-    MPI_Status status;
-    int response;
-    send_command(MANAGER_PROC, type_cmd);
-    if (MPI_Recv(&response, 1, MPI_INT, MANAGER_PROC, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
-        errsend(FATAL, "Failed to receive response\n");
-    }
-    return response;
-}
-
-int request_input_queuesize() {
-    return request_response(QUEUESIZECMD);
-}
-
-void send_command(int target_rank, int type_cmd) {
-    //Tell a rank it's time to begin processing
-//    PRINT_MPI_DEBUG("target rank %d: Sending command %s to target rank %d\n", target_rank, cmd2str(type_cmd), target_rank);
-    if (MPI_Send(&type_cmd, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send command %d to rank %d\n", type_cmd, target_rank);
-        MPI_Abort(MPI_COMM_WORLD, -1);
-    }
+/**
+* Initializes a directory handle, so that it
+* holds no open directory.
+*
+* @param dh		the directory handle to initialize
+*/
+void init_dir_handle(dir_handle *dh) {
+    dh->path[0] = '\0';
+    dh->fd = -1;
 }
 
+/**
+* Returns a file descriptor for the parent directory of
+* the given path, along with the name of the entry in that
+* directory. The directory is kept open in the handle, so
+* that consecutive files in the same directory do not pay
+* for a full path lookup on every open.
+*
+* @param dh		the directory handle to use
+* @param path		the full path of a file
+* @param name		set to point to the last component
+* 			of path
+*
+* @return a directory file descriptor, or -1 if the
+* 	directory could not be opened
+*/
+int get_dir_handle(dir_handle *dh, const char *path, const char **name) {
+    char parent[PATHSIZE_PLUS];
+    const char *slash = strrchr(path, '/');
+    size_t len;
 
-void send_path_list(int target_rank, int command, int num_send, path_list **list_head, path_list **list_tail, int *list_count) {
-    int path_count = 0, position = 0;
-    int worksize, workcount;
-    if (num_send <= *list_count) {
-        workcount = num_send;
+    if (slash == NULL) {								// a relative path with no directory
+        strcpy(parent, ".");
+        *name = path;
     }
     else {
-        workcount = *list_count;
-    }
-    worksize = workcount * sizeof(path_item);
-    char *workbuf = (char *) malloc(worksize * sizeof(char));
-    while(path_count < workcount) {
-        path_count++;
-        MPI_Pack(&(*list_head)->data, sizeof(path_item), MPI_CHAR, workbuf, worksize, &position, MPI_COMM_WORLD);
-        dequeue_node(list_head, list_tail, list_count);
+        len = (slash == path)?1:(size_t)(slash - path);				// keep "/" for files in the root
+        if (len >= PATHSIZE_PLUS) {
+            return -1;
+        }
+        strncpy(parent, path, len);
+        parent[len] = '\0';
+        *name = slash + 1;
     }
-    //send the command to get started
-    send_command(target_rank, command);
-    //send the # of paths
-    if (MPI_Send(&workcount, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send workcount %d to rank %d\n", workcount, target_rank);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    if (dh->fd >= 0 && !strcmp(dh->path, parent)) {
+        return dh->fd;
     }
-    if (MPI_Send(workbuf, worksize, MPI_PACKED, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send workbuf to rank %d\n",  target_rank);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    close_dir_handle(dh);
+    if ((dh->fd = open(parent, O_RDONLY | O_DIRECTORY)) >= 0) {
+        strcpy(dh->path, parent);
     }
-    free(workbuf);
+    return dh->fd;
 }
 
-void send_path_buffer(int target_rank, int command, path_item *buffer, int *buffer_count) {
-    int i;
-    int position = 0;
-    int worksize;
-    char *workbuf;
-    path_item work_node;
-    worksize = *buffer_count * sizeof(path_item);
-    workbuf = (char *) malloc(worksize * sizeof(char));
-    for (i = 0; i < *buffer_count; i++) {
-        work_node = buffer[i];
-        MPI_Pack(&work_node, sizeof(path_item), MPI_CHAR, workbuf, worksize, &position, MPI_COMM_WORLD);
+/**
+* Closes the directory held by a directory handle, if any.
+*
+* @param dh		the directory handle to close
+*/
+void close_dir_handle(dir_handle *dh) {
+    if (dh->fd >= 0) {
+        close(dh->fd);
     }
-    send_command(target_rank, command);
-    if (MPI_Send(buffer_count, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send buffer_count %d to rank %d\n", *buffer_count, target_rank);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    init_dir_handle(dh);
+}
+
+// An entry as returned by getdents64()
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+* Opens a directory to be read in large batches of
+* entries with getdents64(), which costs far fewer
+* system calls than readdir() on huge directories.
+*
+* @param ds		the directory stream to open
+* @param path		the directory to open
+*
+* @return 0 on success, -1 on failure (errno is set)
+*/
+int open_dir_stream(dir_stream *ds, const char *path) {
+    ds->len = ds->pos = 0;
+    ds->buf = NULL;
+    if ((ds->fd = open(path, O_RDONLY | O_DIRECTORY)) < 0) {
+        return -1;
     }
-    if (MPI_Send(workbuf, worksize, MPI_PACKED, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send workbuf to rank %d\n", target_rank);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    if ((ds->buf = malloc(READDIR_BUFSIZE)) == NULL) {
+        close(ds->fd);
+        ds->fd = -1;
+        errno = ENOMEM;
+        return -1;
     }
-    *buffer_count = 0;
-    free(workbuf);
+    return 0;
 }
 
-void send_buffer_list(int target_rank, int command, work_buf_list **workbuflist, int *workbufsize) {
-    int size = (*workbuflist)->size;
-    int worksize = sizeof(path_item) * size;
-    send_command(target_rank, command);
-    if (MPI_Send(&size, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send workbuflist size %d to rank %d\n", size, target_rank);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+/**
+* Returns the name of the next entry of a directory
+* stream. "." and ".." are returned like any other entry.
+*
+* @param ds		the directory stream to read
+* @param d_type		returns the type of the entry (DT_UNKNOWN
+* 			if the file system does not report it)
+* @param d_ino		returns the inode number of the entry
+*
+* @return the name, valid until the next call, or NULL at the
+* 	end of the directory or on an error (errno is set)
+*/
+char *read_dir_stream(dir_stream *ds, unsigned char *d_type, ino_t *d_ino) {
+    struct linux_dirent64 *ent;
+    long n;
+
+    if (ds->pos >= ds->len) {
+        n = syscall(SYS_getdents64, ds->fd, ds->buf, READDIR_BUFSIZE);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = 0;
+            }
+            return NULL;
+        }
+        ds->len = n;
+        ds->pos = 0;
+    }
+    ent = (struct linux_dirent64 *)(ds->buf + ds->pos);
+    ds->pos += ent->d_reclen;
+    *d_type = ent->d_type;
+    *d_ino = ent->d_ino;
+    return ent->d_name;
+}
+
+/**
+* Stats a path found while walking the tree, asking the file
+* system only for the fields the run needs. A listing without
+* -v only needs the type and size. It also does not force the
+* file system to sync (AT_STATX_DONT_SYNC), which spares clustered
+* file systems from revoking tokens or leases of files being
+* written. Copies and compares ask for all the basic fields,
+* kept in sync. The fields not asked for are zero. Falls back to
+* fstatat() where statx() is not available.
+*
+* @param dirfd		the directory to look the name up in
+* @param name		the name of the path in dirfd
+* @param st		gets the stat of the path
+* @param o		the PFTOOL global options structure
+*
+* @return 0 on success, -1 on failure (errno is set)
+*/
+int walk_stat_at(int dirfd, const char *name, struct stat *st, struct options o) {
+#ifdef STATX_TYPE
+    struct statx stx;
+    unsigned int mask = STATX_BASIC_STATS;
+    int flags = AT_SYMLINK_NOFOLLOW;
+
+    if (o.work_type == LSWORK) {
+        flags |= AT_STATX_DONT_SYNC;
+        if (!o.verbose && !o.catalog[0] && o.du_depth < 0 && !o.histogram[0]) {
+            mask = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE;
+            if (o.snapshot[0]) {					// snapshots compare times
+                mask |= STATX_MTIME | STATX_CTIME;
+            }
+            if (filter_has_field(&o.filter, FILTER_BLOCKS)) {	// and filters what they test
+                mask |= STATX_BLOCKS;
+            }
+            if (filter_has_field(&o.filter, FILTER_MTIME)) {
+                mask |= STATX_MTIME;
+            }
+            if (filter_has_field(&o.filter, FILTER_ATIME)) {
+                mask |= STATX_ATIME;
+            }
+            if (filter_has_field(&o.filter, FILTER_UID)) {
+                mask |= STATX_UID;
+            }
+            if (filter_has_field(&o.filter, FILTER_GID)) {
+                mask |= STATX_GID;
+            }
+        }
     }
-    if (MPI_Send((*workbuflist)->buf, worksize, MPI_PACKED, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send workbuflist buf to rank %d\n", target_rank);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    if (statx(dirfd, name, flags, mask, &stx) == -1) {
+        return -1;
     }
-    dequeue_buf_list(workbuflist, workbufsize);
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_ino = stx.stx_ino;
+    st->st_mode = stx.stx_mode;
+    st->st_nlink = stx.stx_nlink;
+    st->st_uid = stx.stx_uid;
+    st->st_gid = stx.stx_gid;
+    st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    st->st_size = stx.stx_size;
+    st->st_blksize = stx.stx_blksize;
+    st->st_blocks = stx.stx_blocks;
+    st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+    return 0;
+#else
+    return fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+#endif
 }
 
-//manager
-void send_manager_nonfatal_inc() {
-    send_command(MANAGER_PROC, NONFATALINCCMD);
-}
+/**
+* Closes a directory stream.
+*
+* @param ds		the directory stream to close
+*
+* @return 0 on success, -1 on failure (errno is set)
+*/
+int close_dir_stream(dir_stream *ds) {
+    int rc = close(ds->fd);
 
-void send_manager_chunk_busy() {
-    send_command(MANAGER_PROC, CHUNKBUSYCMD);
+    free(ds->buf);
+    ds->buf = NULL;
+    ds->fd = -1;
+    return rc;
 }
 
-void send_manager_copy_stats(int num_copied_files, size_t num_copied_bytes) {
-    send_command(MANAGER_PROC, COPYSTATSCMD);
-    //send the # of paths
-    if (MPI_Send(&num_copied_files, 1, MPI_INT, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send num_copied_files %d to rank %d\n", num_copied_files, MANAGER_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
-    }
-    //send the # of paths
-    if (MPI_Send(&num_copied_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send num_copied_byes %zd to rank %d\n", num_copied_bytes, MANAGER_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+/**
+* Hashes a name (64 bit FNV-1a).
+*
+* @param name		the name to hash
+*
+* @return the hash of the name
+*/
+size_t name_hash(const char *name) {
+    size_t hash = 14695981039346656037UL;
+
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 1099511628211UL;
     }
+    return hash;
 }
 
-void send_manager_examined_stats(int num_examined_files, size_t num_examined_bytes, int num_examined_dirs) {
-    send_command(MANAGER_PROC, EXAMINEDSTATSCMD);
-    //send the # of paths
-    if (MPI_Send(&num_examined_files, 1, MPI_INT, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send num_examined_files %d to rank %d\n", num_examined_files, MANAGER_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+/**
+* Initializes an empty name set.
+*
+* @param ns		the name set to initialize
+*/
+void init_name_set(name_set *ns) {
+    ns->slots = NULL;
+    ns->size = 0;
+    ns->count = 0;
+}
+
+/**
+* Adds a name to a set. The set grows to keep it at most
+* half full.
+*
+* @param ns		the name set
+* @param name		the name to add
+*
+* @return 0 on success, -1 if out of memory
+*/
+int name_set_add(name_set *ns, const char *name) {
+    char **old_slots = ns->slots;
+    size_t old_size = ns->size;
+    size_t i, j;
+
+    if (2*(ns->count + 1) > ns->size) {
+        ns->size = (ns->size)?2*ns->size:1024;
+        if ((ns->slots = (char **) calloc(ns->size, sizeof(char *))) == NULL) {
+            ns->slots = old_slots;
+            ns->size = old_size;
+            return -1;
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old_slots[i] != NULL) {
+                for (j = name_hash(old_slots[i]) & (ns->size - 1); ns->slots[j] != NULL; j = (j + 1) & (ns->size - 1));
+                ns->slots[j] = old_slots[i];
+            }
+        }
+        free(old_slots);
     }
-    if (MPI_Send(&num_examined_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send num_examined_bytes %zd to rank %d\n", num_examined_bytes, MANAGER_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    for (j = name_hash(name) & (ns->size - 1); ns->slots[j] != NULL; j = (j + 1) & (ns->size - 1)) {
+        if (!strcmp(ns->slots[j], name)) {
+            return 0;
+        }
     }
-    if (MPI_Send(&num_examined_dirs, 1, MPI_INT, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send num_examined_dirs %d to rank %d\n", num_examined_dirs, MANAGER_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    if ((ns->slots[j] = strdup(name)) == NULL) {
+        return -1;
     }
+    ns->count++;
+    return 0;
 }
 
-#ifdef TAPE
-void send_manager_tape_stats(int num_examined_tapes, size_t num_examined_tape_bytes) {
-    send_command(MANAGER_PROC, TAPESTATCMD);
-    //send the # of paths
-    if (MPI_Send(&num_examined_tapes, 1, MPI_INT, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send num_examined_tapes %d to rank %d\n", num_examined_tapes, MANAGER_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+/**
+* Tests if a name is in a set.
+*
+* @param ns		the name set
+* @param name		the name to look for
+*
+* @return 1 if the name is in the set, 0 otherwise
+*/
+int name_set_has(name_set *ns, const char *name) {
+    size_t j;
+
+    if (ns->size == 0) {
+        return 0;
     }
-    if (MPI_Send(&num_examined_tape_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to send num_examined_tape_bytes %zd to rank %d\n", num_examined_tape_bytes, MANAGER_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    for (j = name_hash(name) & (ns->size - 1); ns->slots[j] != NULL; j = (j + 1) & (ns->size - 1)) {
+        if (!strcmp(ns->slots[j], name)) {
+            return 1;
+        }
     }
+    return 0;
 }
-#endif
 
+/**
+* Removes all names from a set, and frees its memory.
+*
+* @param ns		the name set to clear
+*/
+void clear_name_set(name_set *ns) {
+    size_t i;
 
-void send_manager_regs_buffer(path_item *buffer, int *buffer_count) {
-    //sends a chunk of regular files to the manager
-    send_path_buffer(MANAGER_PROC, PROCESSCMD, buffer, buffer_count);
-}
-
-void send_manager_dirs_buffer(path_item *buffer, int *buffer_count) {
-    //sends a chunk of regular files to the manager
-    send_path_buffer(MANAGER_PROC, DIRCMD, buffer, buffer_count);
+    for (i = 0; i < ns->size; i++) {
+        free(ns->slots[i]);
+    }
+    free(ns->slots);
+    init_name_set(ns);
 }
 
-#ifdef TAPE
-void send_manager_tape_buffer(path_item *buffer, int *buffer_count) {
-    //sends a chunk of regular files to the manager
-    send_path_buffer(MANAGER_PROC, TAPECMD, buffer, buffer_count);
+/**
+* Initializes the destination cache of a worker.
+*
+* @param dc		the destination cache to initialize
+* @param listing	1 -> read whole destination directories,
+* 			and answer lookups from their listings
+*/
+void init_dest_cache(dest_cache *dc, int listing) {
+    dc->listing = listing;
+    init_name_set(&dc->fresh);
+    dc->dir[0] = '\0';
+    init_name_set(&dc->names);
+    dc->listed = 0;
 }
-#endif
 
-void send_manager_new_buffer(path_item *buffer, int *buffer_count) {
-    //send manager new inputs
-    send_path_buffer(MANAGER_PROC, INPUTCMD, buffer, buffer_count);
-}
+/**
+* Records that this rank created a destination directory.
+* Until the names in it are looked up, nothing else puts
+* files there, so the destinations in it do not exist. The
+* set is cleared when it holds DEST_FRESH_MAX directories: the
+* names of directories it forgets are just looked up.
+*
+* @param dc		the destination cache
+* @param path		the directory created
+*/
+void dest_cache_created(dest_cache *dc, const char *path) {
+    char dir[PATHSIZE_PLUS];
+    size_t len;
 
-void send_manager_work_done() {
-    //the worker is finished processing, notify the manager
-    send_command(MANAGER_PROC, WORKDONECMD);
+    strncpy(dir, path, PATHSIZE_PLUS);
+    dir[PATHSIZE_PLUS-1] = '\0';
+    for (len = strlen(dir); len > 1 && dir[len-1] == '/'; len--) {
+        dir[len-1] = '\0';
+    }
+    if (dc->fresh.count >= DEST_FRESH_MAX) {
+        clear_name_set(&dc->fresh);
+    }
+    name_set_add(&dc->fresh, dir);
 }
 
-//worker
-void update_chunk(path_item *buffer, int *buffer_count) {
-    send_path_buffer(ACCUM_PROC, UPDCHUNKCMD, buffer, buffer_count);
-}
+/**
+* Tests if a destination path may exist, without a lookup
+* when possible. Paths in directories this rank created
+* do not exist. With a listing cache, the directory of the
+* path is read once (and again only when a path in another
+* directory is asked for), and the answer comes from the
+* listing. Otherwise the path has to be stat'ed to know.
+*
+* @param dc		the destination cache
+* @param path		the destination path
+*
+* @return 0 if the path does not exist, 1 if it may exist
+*/
+int dest_may_exist(dest_cache *dc, const char *path) {
+    char dir[PATHSIZE_PLUS];
+    char *name;
+    dir_stream ds;
+    char *entry;
+    unsigned char d_type;
+    ino_t d_ino;
+
+    strncpy(dir, path, PATHSIZE_PLUS);
+    dir[PATHSIZE_PLUS-1] = '\0';
+    if ((name = strrchr(dir, '/')) == NULL || name == dir) {
+        return 1;
+    }
+    *name++ = '\0';
+    if (dc->fresh.count > 0 && name_set_has(&dc->fresh, dir)) {
+        return 0;
+    }
+    if (!dc->listing) {
+        return 1;
+    }
+    if (strcmp(dir, dc->dir)) {
+        clear_name_set(&dc->names);
+        strncpy(dc->dir, dir, PATHSIZE_PLUS);
+        dc->listed = 1;
+        if (open_dir_stream(&ds, dir) == 0) {
+            while ((entry = read_dir_stream(&ds, &d_type, &d_ino)) != NULL) {
+                if (name_set_add(&dc->names, entry) != 0) {
+                    break;
+                }
+            }
+            dc->listed = (entry == NULL && errno == 0);			// could not list it all -> look paths up
+            close_dir_stream(&ds);
+        }
+        else if (errno != ENOENT) {					// a missing directory lists as empty
+            dc->listed = 0;
+        }
+    }
+    if (!dc->listed) {
+        return 1;
+    }
+    return name_set_has(&dc->names, name);
+}
+
+/**
+* Frees the memory of a destination cache.
+*
+* @param dc		the destination cache to free
+*/
+void free_dest_cache(dest_cache *dc) {
+    clear_name_set(&dc->fresh);
+    clear_name_set(&dc->names);
+}
+
+/**
+* Tests if a work item can be handled by copy_small_file():
+* a whole, unchunked, plain regular file no bigger than
+* SMALLFILE_SIZE.
+*
+* @param src_file	the source file to test
+*
+* @return 1 (TRUE) if the small-file path can be used.
+* 	0 (FALSE) otherwise.
+*/
+int is_small_file(path_item src_file) {
+    return (S_ISREG(src_file.st.st_mode) &&
+            src_file.ftype == REGULARFILE &&
+            src_file.desttype == REGULARFILE &&
+            src_file.st.st_size <= SMALLFILE_SIZE &&
+            src_file.chkidx == 0 &&
+            src_file.chksz == src_file.st.st_size);
+}
+
+/**
+* Copies a small file in one read and one write. Both files
+* are opened relative to directory handles that stay open
+* across calls, and the ownership, mode and times of the
+* destination are set on the open file descriptor rather
+* than by path. The caller supplies a buffer of at least
+* SMALLFILE_SIZE bytes, so nothing is allocated per file.
+*
+* This function does not report errors itself. The
+* text of any error is placed in errormsg, so that it can
+* be called from threads other than the one talking to MPI.
+*
+* @param src_file	the file to copy
+* @param dest_file	the destination of the copy
+* @param src_dir	directory handle for source directories
+* @param dest_dir	directory handle for destination directories
+* @param buf		the data buffer to use
+* @param errormsg	a MESSAGESIZE buffer for an error message
+*
+* @return 0 on success, -1 if the copy failed, and otherwise
+* 	the SMALL_CHOWN, SMALL_CHMOD and SMALL_UTIME bits of the
+* 	metadata that could not be set on the copied data. These
+* 	are reported with send_small_file_errors()
+*/
+int copy_small_file(path_item src_file, path_item dest_file, dir_handle *src_dir, dir_handle *dest_dir, char *buf, char *errormsg) {
+    int src_fd, dest_fd;
+    int src_dirfd, dest_dirfd;
+    const char *src_name, *dest_name;
+    size_t length = src_file.st.st_size;
+    ssize_t bytes_processed;
+    struct timespec times[2];
+    int rc = 0;
+
+    if ((src_dirfd = get_dir_handle(src_dir, src_file.path, &src_name)) < 0) {
+        snprintf(errormsg, MESSAGESIZE, "Failed to open directory of %s (errno = %d)", src_file.path, errno);
+        return -1;
+    }
+    if ((dest_dirfd = get_dir_handle(dest_dir, dest_file.path, &dest_name)) < 0) {
+        snprintf(errormsg, MESSAGESIZE, "Failed to open directory of %s (errno = %d)", dest_file.path, errno);
+        return -1;
+    }
+    if ((src_fd = openat(src_dirfd, src_name, O_RDONLY)) < 0) {
+        snprintf(errormsg, MESSAGESIZE, "Failed to open file %s for read", src_file.path);
+        return -1;
+    }
+    if ((dest_fd = openat(dest_dirfd, dest_name, O_WRONLY | O_CREAT, 0600)) < 0) {
+        snprintf(errormsg, MESSAGESIZE, "Failed to open file %s for write (errno = %d)", dest_file.path, errno);
+        close(src_fd);
+        return -1;
+    }
+    if (length) {
+        bytes_processed = pread(src_fd, buf, length, 0);
+        if (bytes_processed != length) {
+            snprintf(errormsg, MESSAGESIZE, "%s: Read %zd bytes instead of %zd", src_file.path, bytes_processed, length);
+            close(src_fd);
+            close(dest_fd);
+            return -1;
+        }
+        bytes_processed = pwrite(dest_fd, buf, length, 0);
+        if (bytes_processed != length) {
+            snprintf(errormsg, MESSAGESIZE, "%s: write %zd bytes instead of %zd", dest_file.path, bytes_processed, length);
+            close(src_fd);
+            close(dest_fd);
+            return -1;
+        }
+    }
+    close(src_fd);
+
+    // metadata is set through the open descriptor - no more path lookups
+    if (fchown(dest_fd, src_file.st.st_uid, src_file.st.st_gid) != 0) {
+        rc |= SMALL_CHOWN;
+    }
+    if (fchmod(dest_fd, src_file.st.st_mode & 07777) != 0) {
+        rc |= SMALL_CHMOD;
+    }
+    times[0] = src_file.st.st_atim;
+    times[1] = src_file.st.st_mtim;
+    if (futimens(dest_fd, times) != 0) {
+        rc |= SMALL_UTIME;
+    }
+    if (close(dest_fd) < 0) {
+        snprintf(errormsg, MESSAGESIZE, "Failed to close file: %s (errno = %d)", dest_file.path, errno);
+        return -1;
+    }
+    return rc;
+}
+
+// The work shared by the threads of copy_small_files()
+struct small_copy_batch {
+    path_item *src_files;
+    path_item *dest_files;
+    int *rcs;
+    char *errormsgs;
+    int count;
+    int next;						// index of the next file to be claimed
+    pthread_mutex_t lock;
+};
+
+/**
+* Thread body for copy_small_files(). Each thread has its own
+* directory handles and data buffer, and claims files from the
+* batch until none are left.
+*
+* @param arg		the struct small_copy_batch to work on
+*
+* @return NULL
+*/
+static void *copy_small_files_thread(void *arg) {
+    struct small_copy_batch *batch = (struct small_copy_batch *)arg;
+    dir_handle src_dir, dest_dir;
+    char *buf = (char *) malloc(SMALLFILE_SIZE * sizeof(char));
+    int i;
+
+    init_dir_handle(&src_dir);
+    init_dir_handle(&dest_dir);
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) {
+            break;
+        }
+        if (buf == NULL) {
+            snprintf(batch->errormsgs + i*MESSAGESIZE, MESSAGESIZE, "Failed to allocate buffer to copy %s", batch->src_files[i].path);
+            batch->rcs[i] = -1;
+            continue;
+        }
+        batch->rcs[i] = copy_small_file(batch->src_files[i], batch->dest_files[i], &src_dir, &dest_dir, buf, batch->errormsgs + i*MESSAGESIZE);
+    }
+    close_dir_handle(&src_dir);
+    close_dir_handle(&dest_dir);
+    if (buf) free(buf);
+    return NULL;
+}
+
+/**
+* Copies a list of small files with up to num_threads
+* copies in flight at once, so that a worker is not idle
+* while each open or close round trips to a slow file system.
+* The threads only do file I/O. Results are returned per file
+* so that the caller can report them (and talk to MPI) in the
+* original order.
+*
+* @param src_files	the files to copy
+* @param dest_files	the destinations of the copies
+* @param count		the number of files in the lists
+* @param rcs		gets the copy_small_file() return code
+* 			of each file
+* @param errormsgs	count MESSAGESIZE buffers, which get the
+* 			error text of files with a negative rcs
+* @param num_threads	the maximum number of concurrent copies
+*/
+void copy_small_files(path_item *src_files, path_item *dest_files, int count, int *rcs, char *errormsgs, int num_threads) {
+    struct small_copy_batch batch;
+    pthread_t *threads;
+    int started = 0;
+    int i;
+
+    batch.src_files = src_files;
+    batch.dest_files = dest_files;
+    batch.rcs = rcs;
+    batch.errormsgs = errormsgs;
+    batch.count = count;
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    if (num_threads > count) {
+        num_threads = count;
+    }
+    threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[started], NULL, copy_small_files_thread, &batch) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {								// no threads -> do the work here
+        copy_small_files_thread(&batch);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&batch.lock);
+}
+
+/**
+* Sends one nonfatal error for each piece of metadata that
+* copy_small_file() could not set, so that every failure is
+* reported and counted as update_stats() does.
+*
+* @param failed		the SMALL_* bits returned by copy_small_file()
+* @param src_file	the file that was copied
+* @param dest_file	the copy
+*/
+void send_small_file_errors(int failed, path_item src_file, path_item dest_file) {
+    char errormsg[MESSAGESIZE];
+
+    if (failed & SMALL_CHOWN) {
+        snprintf(errormsg, MESSAGESIZE, "Failed to change ownership of file: %s to %d:%d", dest_file.path, src_file.st.st_uid, src_file.st.st_gid);
+        errsend(NONFATAL, errormsg);
+    }
+    if (failed & SMALL_CHMOD) {
+        snprintf(errormsg, MESSAGESIZE, "Failed to chmod file: %s to %o", dest_file.path, src_file.st.st_mode & 07777);
+        errsend(NONFATAL, errormsg);
+    }
+    if (failed & SMALL_UTIME) {
+        snprintf(errormsg, MESSAGESIZE, "Failed to set atime and mtime for file: %s", dest_file.path);
+        errsend(NONFATAL, errormsg);
+    }
+}
+
+// Built-in file system profiles. The last entry is the default, used for any other file system
+static fs_profile fs_profiles[NUM_FS_PROFILES] = {
+    // name     magic         blocksize   chunk_at        chunksize       concurrent direct_io_at io_threads stat_threads ctm
+    {"lustre",  LUSTRE_FILE,  4194304,    107374182400,   107374182400,   0,         0,           4,         8,           "auto"},
+    {"gpfs",    GPFS_FILE,    4194304,    107374182400,   107374182400,   0,         0,           1,         16,          "auto"},
+    {"panfs",   PANFS_FILE,   1048576,    107374182400,   107374182400,   1,         0,           1,         8,           "auto"},
+    {"nfs",     NFS_FILE,     1048576,    107374182400,   107374182400,   0,         0,           8,         16,          "auto"},
+    {"xfs",     XFS_FILE,     1048576,    107374182400,   107374182400,   0,         0,           1,         1,           "auto"},
+    {"ext4",    EXT4_FILE,    1048576,    107374182400,   107374182400,   0,         0,           1,         1,           "auto"},
+    {"tmpfs",   TMPFS_FILE,   1048576,    107374182400,   107374182400,   0,         0,           1,         1,           "auto"},
+    {"Unknown", 0,            1048576,    107374182400,   107374182400,   0,         0,           1,         1,           "auto"}
+};
+static int num_fs_profiles = 8;
+
+/**
+* Reads profile overrides from a pftool config file. A section
+* named [profile:<fstype>] changes the profile of that file
+* system type, or adds one. Recognized keys are magic (new
+* profiles only), blocksize, chunk_at, chunksize,
+* concurrent_write, direct_io_at, io_threads, stat_threads and ctm.
+* [profile:default] changes the default profile.
+*
+* @param cfgfile	the path to the config file
+*
+* @return the number of profiles changed, or -1 if the file
+* 	could not be read
+*/
+int load_fs_profiles(const char *cfgfile) {
+    FILE *fp;
+    char line[PATHSIZE_PLUS], key[128], value[128];
+    char *p;
+    fs_profile *profile = NULL;
+    int changed = 0;
+    int i;
+
+    if ((fp = fopen(cfgfile, "r")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, PATHSIZE_PLUS, fp) != NULL) {
+        if ((p = strpbrk(line, "#;\r\n")) != NULL) {				// strip comments and line ends
+            *p = '\0';
+        }
+        if (line[0] == '[') {							// new section
+            profile = NULL;
+            if (strncmp(line, "[profile:", 9) || (p = strchr(line, ']')) == NULL) {
+                continue;
+            }
+            *p = '\0';
+            p = line + 9;
+            if (!strcmp(p, "default")) {
+                profile = &fs_profiles[num_fs_profiles-1];
+            }
+            for (i = 0; profile == NULL && i < num_fs_profiles - 1; i++) {
+                if (!strcmp(p, fs_profiles[i].name)) {
+                    profile = &fs_profiles[i];
+                }
+            }
+            if (profile == NULL && num_fs_profiles < NUM_FS_PROFILES) {	// a new type -> insert it ahead of the default
+                fs_profiles[num_fs_profiles] = fs_profiles[num_fs_profiles-1];
+                profile = &fs_profiles[num_fs_profiles-1];
+                num_fs_profiles++;
+                strncpy(profile->name, p, sizeof(profile->name)-1);
+                profile->name[sizeof(profile->name)-1] = '\0';
+            }
+            if (profile != NULL) {
+                changed++;
+            }
+            continue;
+        }
+        if (profile == NULL || sscanf(line, " %127[^:= ] %*[:=] %127s", key, value) != 2) {
+            continue;
+        }
+        if (!strcmp(key, "magic") && profile->magic == 0 && profile != &fs_profiles[num_fs_profiles-1]) {
+            profile->magic = strtol(value, NULL, 0);
+        }
+        else if (!strcmp(key, "blocksize")) {
+            profile->blocksize = str2Size(value);
+        }
+        else if (!strcmp(key, "chunk_at")) {
+            profile->chunk_at = str2Size(value);
+        }
+        else if (!strcmp(key, "chunksize")) {
+            profile->chunksize = str2Size(value);
+        }
+        else if (!strcmp(key, "concurrent_write")) {
+            profile->concurrent_write = (!strcasecmp(value, "true") || atoi(value) > 0);
+        }
+        else if (!strcmp(key, "direct_io_at")) {
+            profile->direct_io_at = str2Size(value);
+        }
+        else if (!strcmp(key, "io_threads")) {
+            profile->io_threads = atoi(value);
+        }
+        else if (!strcmp(key, "stat_threads")) {
+            profile->stat_threads = atoi(value);
+        }
+        else if (!strcmp(key, "ctm")) {
+            strncpy(profile->ctm, value, sizeof(profile->ctm)-1);
+            profile->ctm[sizeof(profile->ctm)-1] = '\0';
+        }
+    }
+    fclose(fp);
+    return changed;
+}
+
+/**
+* Finds the tuning profile for a path. If a file system type
+* name is given and a profile has that name, that profile is
+* used. Otherwise the profile is picked by the statfs magic of
+* the path (or of its parent, if the path does not exist yet).
+*
+* @param path		the path to look up
+* @param name		a file system type name (i.e. from -t),
+* 			or NULL
+*
+* @return the matching profile, or the default profile
+*/
+fs_profile *find_fs_profile(const char *path, const char *name) {
+    fs_profile *profile = &fs_profiles[num_fs_profiles-1];
+    int i;
+#ifdef HAVE_SYS_VFS_H
+    struct statfs stfs;
+    char *parent;
+    int rc;
+#endif
+
+    if (name != NULL) {
+        for (i = 0; i < num_fs_profiles - 1; i++) {
+            if (!strncmp(name, fs_profiles[i].name, strlen(fs_profiles[i].name))) {
+                return &fs_profiles[i];
+            }
+        }
+    }
+#ifdef HAVE_SYS_VFS_H
+    if ((rc = statfs(path, &stfs)) < 0) {
+        parent = strdup(path);
+        rc = statfs(dirname(parent), &stfs);
+        free(parent);
+    }
+    if (rc == 0) {
+        for (i = 0; i < num_fs_profiles - 1; i++) {
+            if (fs_profiles[i].magic && fs_profiles[i].magic == (long)stfs.f_type) {
+                profile = &fs_profiles[i];
+                break;
+            }
+        }
+    }
+#endif
+    return profile;
+}
+
+/**
+* Rounds a block size up to a multiple of the destination's
+* st_blksize, without going past the limit.
+*
+* @param bp		the block size policy
+* @param blocksize	the block size
+*
+* @return the rounded block size
+*/
+static size_t round_blocksize(blocksize_policy *bp, size_t blocksize) {
+    if (bp->preferred > 0 && blocksize % bp->preferred) {
+        blocksize += bp->preferred - (blocksize % bp->preferred);
+    }
+    return (blocksize > bp->max)?bp->max:blocksize;
+}
+
+/**
+* Sets up a block size policy. With adaptive block sizes off
+* (no -b/-B), the policy always returns o.blocksize. Otherwise
+* it starts from o.blocksize (-s, else the file system profile),
+* and moves between the limits as the throughput of large
+* transfers is measured.
+*
+* @param bp		the policy to initialize
+* @param preferred	the st_blksize of the destination, or 0
+* @param o		the PFTOOL global options structure
+*/
+void init_blocksize_policy(blocksize_policy *bp, size_t preferred, struct options o) {
+    size_t start;
+
+    memset(bp, 0, sizeof(blocksize_policy));
+    bp->direction = 1;
+    if (!o.min_blocksize) {							// fixed block size
+        bp->min = bp->max = bp->current = o.blocksize;
+        return;
+    }
+    bp->min = o.min_blocksize;
+    bp->max = (o.max_blocksize >= o.min_blocksize)?o.max_blocksize:o.min_blocksize;
+    bp->preferred = preferred;
+    start = o.blocksize;
+    if (start < preferred) {
+        start = preferred;
+    }
+    bp->current = round_blocksize(bp, (start < bp->min)?bp->min:start);
+}
+
+/**
+* Picks the block size for one transfer. A transfer that fits
+* in a block no bigger than the limit is done in a single I/O.
+* Otherwise the current (throughput tuned) size is used. Sizes
+* are rounded to a multiple of the destination's st_blksize.
+*
+* @param bp		the block size policy
+* @param length		the number of bytes to transfer
+*
+* @return the block size to use
+*/
+size_t pick_blocksize(blocksize_policy *bp, off_t length) {
+    size_t blocksize = bp->current;
+
+    if (bp->min == bp->max) {
+        return blocksize;
+    }
+    if (length > blocksize && length <= bp->max) {				// one I/O covers it
+        blocksize = length;
+    }
+    return round_blocksize(bp, blocksize);
+}
+
+/**
+* Plans the chunk size for an N-to-1 transfer of a file. The
+* file gets enough chunks that each takes about target_secs
+* to copy at the measured per-worker rate, and at least one
+* chunk per free worker, so that a big file is spread over the
+* ranks that can take it. Chunks are never smaller than
+* CHUNK_MIN or bigger than max_chunksize, and are a multiple
+* of align (the destination stripe or block size), so that
+* no two ranks write into the same stripe.
+*
+* @param file_size	the size of the file
+* @param max_chunksize	the largest chunk allowed (-S)
+* @param align		the destination stripe/block size
+* @param free_workers	the number of idle workers
+* @param worker_rate	bytes/sec copied per worker. 0 if unknown
+* @param target_secs	the target time to copy one chunk
+*
+* @return the chunk size to use
+*/
+size_t plan_chunk_size(size_t file_size, size_t max_chunksize, size_t align, int free_workers, double worker_rate, int target_secs) {
+    double rate = (worker_rate > 0.0)?worker_rate:CHUNK_RATE_GUESS;
+    size_t by_time = (size_t)(rate * target_secs);
+    size_t num_chunks, chunk_size;
+
+    if (align == 0) {
+        align = 1;
+    }
+    num_chunks = (by_time > 0)?(file_size + by_time - 1)/by_time:1;
+    if (free_workers > 0 && num_chunks < (size_t)free_workers) {
+        num_chunks = free_workers;
+    }
+    chunk_size = (file_size + num_chunks - 1)/num_chunks;
+    if (chunk_size < CHUNK_MIN) {
+        chunk_size = CHUNK_MIN;
+    }
+    if (chunk_size % align) {							// round up to a whole stripe
+        chunk_size += align - (chunk_size % align);
+    }
+    if (chunk_size > max_chunksize) {
+        chunk_size = max_chunksize - (max_chunksize % align);		// round down to stay under the limit
+        if (chunk_size == 0) {
+            chunk_size = max_chunksize;
+        }
+    }
+    return chunk_size;
+}
+
+/**
+* Records the throughput of a transfer. Once BLOCKSIZE_SAMPLE
+* bytes have been moved at the current block size, its rate is
+* compared with the previous size. The block size keeps moving
+* (doubling or halving) in the same direction while throughput
+* improves, and turns around when it does not. Sizes stay
+* multiples of the destination's st_blksize (see
+* round_blocksize()), so that pick_blocksize() keeps using the
+* current size and its transfers keep counting.
+*
+* @param bp		the block size policy
+* @param blocksize	the block size the transfer used
+* @param bytes		the number of bytes transferred
+* @param secs		the time the transfer took
+*/
+void record_blocksize_rate(blocksize_policy *bp, size_t blocksize, size_t bytes, double secs) {
+    double rate;
+    size_t next;
+
+    if (bp->min == bp->max || blocksize != bp->current || bytes < blocksize) {	// only full blocks at the current size count
+        return;
+    }
+    bp->sample_bytes += bytes;
+    bp->sample_secs += secs;
+    if (bp->sample_bytes < BLOCKSIZE_SAMPLE || bp->sample_secs <= 0.0) {
+        return;
+    }
+    rate = bp->sample_bytes / bp->sample_secs;
+    if (bp->prev && rate < bp->prev_rate) {					// got worse -> turn around
+        bp->direction = -bp->direction;
+    }
+    next = round_blocksize(bp, (bp->direction > 0)?bp->current*2:bp->current/2);
+    if (next == bp->current || next > bp->max || next < bp->min) {		// hit a limit -> go the other way next time
+        bp->direction = -bp->direction;
+        next = round_blocksize(bp, (bp->direction > 0)?bp->current*2:bp->current/2);
+        if (next > bp->max || next < bp->min) {
+            next = bp->current;
+        }
+    }
+    bp->prev = bp->current;
+    bp->prev_rate = rate;
+    bp->current = next;
+    bp->sample_bytes = 0;
+    bp->sample_secs = 0.0;
+}
+
+//local functions only
+int request_response(int type_cmd) {
+    MPI_Status status;
+    int response;
+    send_command(MANAGER_PROC, type_cmd);
+    if (MPI_Recv(&response, 1, MPI_INT, MANAGER_PROC, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive response\n");
+    }
+    return response;
+}
+
+int request_input_queuesize() {
+    return request_response(QUEUESIZECMD);
+}
+
+/**
+* Asks the manager for what the chunk planner needs to know:
+* how many workers are free right now, and the copy rate
+* seen per worker so far.
+*
+* @param free_workers	gets the number of idle worker ranks
+* @param worker_rate	gets the bytes/sec copied per worker.
+* 			0 if nothing has been measured yet
+*/
+void request_chunk_plan_info(int *free_workers, double *worker_rate) {
+    MPI_Status status;
+    *free_workers = request_response(PLANINFOCMD);
+    if (MPI_Recv(worker_rate, 1, MPI_DOUBLE, MANAGER_PROC, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive worker_rate\n");
+    }
+}
+
+void send_command(int target_rank, int type_cmd) {
+    //Tell a rank it's time to begin processing
+//    PRINT_MPI_DEBUG("target rank %d: Sending command %s to target rank %d\n", target_rank, cmd2str(type_cmd), target_rank);
+    if (MPI_Send(&type_cmd, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send command %d to rank %d\n", type_cmd, target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+
+void send_path_list(int target_rank, int command, int num_send, path_list **list_head, path_list **list_tail, int *list_count) {
+    int path_count = 0, position = 0;
+    int worksize, workcount;
+    if (num_send <= *list_count) {
+        workcount = num_send;
+    }
+    else {
+        workcount = *list_count;
+    }
+    worksize = workcount * sizeof(path_item);
+    char *workbuf = (char *) malloc(worksize * sizeof(char));
+    while(path_count < workcount) {
+        path_count++;
+        MPI_Pack(&(*list_head)->data, sizeof(path_item), MPI_CHAR, workbuf, worksize, &position, MPI_COMM_WORLD);
+        dequeue_node(list_head, list_tail, list_count);
+    }
+    //send the command to get started
+    send_command(target_rank, command);
+    //send the # of paths
+    if (MPI_Send(&workcount, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send workcount %d to rank %d\n", workcount, target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(workbuf, worksize, MPI_PACKED, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send workbuf to rank %d\n",  target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    free(workbuf);
+}
+
+void send_path_buffer(int target_rank, int command, path_item *buffer, int *buffer_count) {
+    int i;
+    int position = 0;
+    int worksize;
+    char *workbuf;
+    path_item work_node;
+    worksize = *buffer_count * sizeof(path_item);
+    workbuf = (char *) malloc(worksize * sizeof(char));
+    for (i = 0; i < *buffer_count; i++) {
+        work_node = buffer[i];
+        MPI_Pack(&work_node, sizeof(path_item), MPI_CHAR, workbuf, worksize, &position, MPI_COMM_WORLD);
+    }
+    send_command(target_rank, command);
+    if (MPI_Send(buffer_count, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send buffer_count %d to rank %d\n", *buffer_count, target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(workbuf, worksize, MPI_PACKED, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send workbuf to rank %d\n", target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    *buffer_count = 0;
+    free(workbuf);
+}
+
+void send_buffer_list(int target_rank, int command, work_buf_list **workbuflist, int *workbufsize) {
+    int size = (*workbuflist)->size;
+    int worksize = sizeof(path_item) * size;
+    if (load_buf(*workbuflist) == NULL) {			// a spilled buffer is mapped back in
+        fprintf(stderr, "Failed to read spilled queue buffer for rank %d\n", target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    send_command(target_rank, command);
+    if (MPI_Send(&size, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send workbuflist size %d to rank %d\n", size, target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send((*workbuflist)->buf, worksize, MPI_PACKED, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send workbuflist buf to rank %d\n", target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    dequeue_buf_list(workbuflist, workbufsize);
+}
+
+//manager
+void send_manager_nonfatal_inc() {
+    send_command(MANAGER_PROC, NONFATALINCCMD);
+}
+
+void send_manager_chunk_busy() {
+    send_command(MANAGER_PROC, CHUNKBUSYCMD);
+}
+
+void send_manager_copy_stats(int num_copied_files, size_t num_copied_bytes, size_t min_blocksize, size_t max_blocksize, size_t blocked_bytes, double blocksize_bytes) {
+    send_command(MANAGER_PROC, COPYSTATSCMD);
+    //send the # of paths
+    if (MPI_Send(&num_copied_files, 1, MPI_INT, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send num_copied_files %d to rank %d\n", num_copied_files, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    //send the # of paths
+    if (MPI_Send(&num_copied_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send num_copied_byes %zd to rank %d\n", num_copied_bytes, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    //send the range of block sizes used, the bytes copied with a block size, and the sum of block size * bytes
+    if (MPI_Send(&min_blocksize, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send min_blocksize %zd to rank %d\n", min_blocksize, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(&max_blocksize, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send max_blocksize %zd to rank %d\n", max_blocksize, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(&blocked_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send blocked_bytes %zd to rank %d\n", blocked_bytes, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(&blocksize_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send blocksize_bytes %g to rank %d\n", blocksize_bytes, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+void send_manager_examined_stats(int num_examined_files, size_t num_examined_bytes, int num_examined_dirs) {
+    send_command(MANAGER_PROC, EXAMINEDSTATSCMD);
+    //send the # of paths
+    if (MPI_Send(&num_examined_files, 1, MPI_INT, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send num_examined_files %d to rank %d\n", num_examined_files, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(&num_examined_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send num_examined_bytes %zd to rank %d\n", num_examined_bytes, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(&num_examined_dirs, 1, MPI_INT, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send num_examined_dirs %d to rank %d\n", num_examined_dirs, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+#ifdef TAPE
+void send_manager_tape_stats(int num_examined_tapes, size_t num_examined_tape_bytes) {
+    send_command(MANAGER_PROC, TAPESTATCMD);
+    //send the # of paths
+    if (MPI_Send(&num_examined_tapes, 1, MPI_INT, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send num_examined_tapes %d to rank %d\n", num_examined_tapes, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(&num_examined_tape_bytes, 1, MPI_DOUBLE, MANAGER_PROC, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send num_examined_tape_bytes %zd to rank %d\n", num_examined_tape_bytes, MANAGER_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+#endif
+
+
+void send_manager_regs_buffer(path_item *buffer, int *buffer_count) {
+    //sends a chunk of regular files to the manager, marked with this rank for locality (-N)
+    static int rank = -1;
+    int i;
+    if (rank < 0) {
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    }
+    for (i = 0; i < *buffer_count; i++) {
+        buffer[i].origin = rank;
+    }
+    send_path_buffer(MANAGER_PROC, PROCESSCMD, buffer, buffer_count);
+}
+
+void send_manager_dirs_buffer(path_item *buffer, int *buffer_count) {
+    //sends a chunk of regular files to the manager
+    send_path_buffer(MANAGER_PROC, DIRCMD, buffer, buffer_count);
+}
+
+#ifdef TAPE
+void send_manager_tape_buffer(path_item *buffer, int *buffer_count) {
+    //sends a chunk of regular files to the manager
+    send_path_buffer(MANAGER_PROC, TAPECMD, buffer, buffer_count);
+}
+#endif
+
+void send_manager_new_buffer(path_item *buffer, int *buffer_count) {
+    //send manager new inputs
+    send_path_buffer(MANAGER_PROC, INPUTCMD, buffer, buffer_count);
+}
+
+void send_manager_work_done() {
+    //the worker is finished processing, notify the manager
+    send_command(MANAGER_PROC, WORKDONECMD);
+}
+
+//worker
+void update_chunk(path_item *buffer, int *buffer_count) {
+    send_path_buffer(ACCUM_PROC, UPDCHUNKCMD, buffer, buffer_count);
+}
+
+void write_output(char *message, int log) {
+    //write a single line using the outputproc
+    //set the command type
+    if (log == 0) {
+        send_command(OUTPUT_PROC, OUTCMD);
+    }
+    else if (log == 1) {
+        send_command(OUTPUT_PROC, LOGCMD);
+    }
+    //send the message
+    if (MPI_Send(message, MESSAGESIZE, MPI_CHAR, OUTPUT_PROC, OUTPUT_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to message to rank %d\n", OUTPUT_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+
+void write_buffer_output(char *buffer, int buffer_size, int buffer_count) {
+    //write a buffer to the output proc
+    //set the command type
+    send_command(OUTPUT_PROC, BUFFEROUTCMD);
+    //send the size of the buffer
+    if (MPI_Send(&buffer_count, 1, MPI_INT, OUTPUT_PROC, OUTPUT_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to buffer_count %d to rank %d\n", buffer_count, OUTPUT_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(buffer, buffer_size, MPI_PACKED, OUTPUT_PROC, OUTPUT_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to message to rank %d\n", OUTPUT_PROC);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+void send_worker_queue_count(int target_rank, int queue_count) {
+    if (MPI_Send(&queue_count, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to queue_count %d to rank %d\n", queue_count, target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+void send_worker_plan_info(int target_rank, int free_workers, double worker_rate) {
+    if (MPI_Send(&free_workers, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send free_workers %d to rank %d\n", free_workers, target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(&worker_rate, 1, MPI_DOUBLE, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send worker_rate %g to rank %d\n", worker_rate, target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+void send_worker_split(int target_rank) {
+    //ask a copying worker to hand off the tail of its chunk
+    send_command(target_rank, SPLITCMD);
+}
+
+void send_worker_batch_sizes(int target_rank, batch_sizes *sizes) {
+    //tell a worker the batch sizes to use
+    send_command(target_rank, BATCHSIZECMD);
+    if (MPI_Send(sizes, sizeof(batch_sizes)/sizeof(int), MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send batch sizes to rank %d\n", target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+}
+
+void send_worker_readdir(int target_rank, work_buf_list  **workbuflist, int *workbufsize) {
+    //send a worker a buffer list of paths to stat
+    send_buffer_list(target_rank, DIRCMD, workbuflist, workbufsize);
+}
+
+void send_worker_stat_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize) {
+    //send a worker a buffer list of names read from a large directory, to stat
+    send_buffer_list(target_rank, STATCMD, workbuflist, workbufsize);
+}
+
+#ifdef TAPE
+void send_worker_tape_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize) {
+    //send a worker a buffer list of paths to stat
+    send_buffer_list(target_rank, TAPECMD, workbuflist, workbufsize);
+}
+#endif
+
+int send_worker_copy_path(int target_rank, size_queue *queue, size_t batch_bytes, int batch_count, locality *loc, int local_only, target_limits *tl) {
+    //send a worker a batch of paths to copy. 0 -> nothing could be sent
+    return send_size_queue(target_rank, COPYCMD, queue, batch_bytes, batch_count, loc, local_only, tl);
+}
+
+int send_worker_compare_path(int target_rank, size_queue *queue, size_t batch_bytes, int batch_count, locality *loc, int local_only, target_limits *tl) {
+    //send a worker a batch of paths to compare. 0 -> nothing could be sent
+    return send_size_queue(target_rank, COMPARECMD, queue, batch_bytes, batch_count, loc, local_only, tl);
+}
+
+void send_worker_exit(int target_rank) {
+    //order a rank to exit
+    send_command(target_rank, EXITCMD);
+}
+
+
+//functions that use workers
+void errsend(int fatal, char *error_text) {
+    //send an error message to the outputproc. Die if fatal.
+    char errormsg[MESSAGESIZE];
+    if (fatal) {
+        snprintf(errormsg, MESSAGESIZE, "ERROR FATAL: %s\n",error_text);
+    }
+    else {
+        snprintf(errormsg, MESSAGESIZE, "ERROR NONFATAL: %s\n",error_text);
+    }
+    write_output(errormsg, 1);
+    if (fatal) {
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    else {
+        send_manager_nonfatal_inc();
+    }
+}
+
+#ifdef FUSE_CHUNKER
+int is_fuse_chunk(const char *path, struct options o) {
+  if (path && strstr(path, o.fuse_path)){
+    return 1;
+  } 
+  else{
+    return 0;
+  }
+}
+
+void set_fuse_chunk_data(path_item *work_node) {
+    int i;
+    int numchars;
+    char linkname[PATHSIZE_PLUS], baselinkname[PATHSIZE_PLUS];
+    const char delimiters[] =  ".";
+    char *current;
+    char errormsg[MESSAGESIZE];
+    size_t length;
+    memset(linkname,'\0', sizeof(PATHSIZE_PLUS));
+    numchars = readlink(work_node->path, linkname, PATHSIZE_PLUS);
+    if (numchars < 0) {
+        sprintf(errormsg, "Failed to read link %s", work_node->path);
+        errsend(NONFATAL, errormsg);
+        return;
+    }
+    linkname[numchars] = '\0';
+    strncpy(baselinkname, basename(linkname), PATHSIZE_PLUS);
+    current = strdup(baselinkname);
+    strtok(current, delimiters);
+    for (i = 0; i < 2; i++) {
+        strtok(NULL, delimiters);
+    }
+    length = atoll(strtok(NULL, delimiters));
+    work_node->chkidx = 0;
+    work_node->chksz = length;
+}
+
+int get_fuse_chunk_attr(const char *path, off_t offset, size_t length, struct utimbuf *ut, uid_t *userid, gid_t *groupid) {
+    char value[10000];
+    int valueLen = 0;
+    char chunk_name[50];
+    int chunk_num = 0;
+    if (length == 0) {
+        return -1;
+    }
+    chunk_num = offset/length;
+    snprintf(chunk_name, 50, "user.chunk_%d", chunk_num);
+#ifdef __APPLE__
+    valueLen = getxattr(path, chunk_name, value, 10000, 0, 0);
+#else
+    valueLen = getxattr(path, chunk_name, value, 10000);
+#endif
+    if (valueLen != -1) {
+        sscanf(value, "%10lld %10lld %8d %8d", (long long int *) &(ut->actime), (long long int *) &(ut->modtime), userid, groupid);
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+int set_fuse_chunk_attr(const char *path, off_t offset, size_t length, struct utimbuf ut, uid_t userid, gid_t groupid) {
+    char value[10000];
+    int valueLen = 0;
+    char chunk_name[50];
+    int chunk_num = 0;
+    chunk_num = offset/length;
+    snprintf(chunk_name, 50, "user.chunk_%d", chunk_num);
+    sprintf(value, "%lld %lld %d %d", (long long int) ut.actime, (long long int ) ut.modtime, userid, groupid);
+#ifdef __APPLE__
+    valueLen = setxattr(path, chunk_name, value, 10000, 0, XATTR_CREATE);
+#else
+    valueLen = setxattr(path, chunk_name, value, 10000, XATTR_CREATE);
+#endif
+    if (valueLen != -1) {
+        return 0;
+    }
+    else {
+        return -1;
+    }
+}
+#endif
+
+
+void get_stat_fs_info(const char *path, int *fs) {
+#ifdef HAVE_SYS_VFS_H
+    struct stat st;
+    struct statfs stfs;
+    char errortext[MESSAGESIZE];
+    int rc;
+    char use_path[PATHSIZE_PLUS];
+    strncpy(use_path, path, PATHSIZE_PLUS);
+    rc = lstat(use_path, &st);
+    if (rc < 0) {
+        strcpy(use_path, dirname(strdup(path)));
+        rc = lstat(use_path, &st);
+        if (rc < 0) {
+            fprintf(stderr, "Failed to stat path %s\n", path);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+    }
+    if (!S_ISLNK(st.st_mode)) {
+        if (statfs(use_path, &stfs) < 0) {
+            snprintf(errortext, MESSAGESIZE, "Failed to statfs path %s", path);
+            errsend(FATAL, errortext);
+        }
+        if (stfs.f_type == GPFS_FILE) {
+            *fs = GPFSFS;
+        }
+        else if (stfs.f_type == PANFS_FILE) {
+            *fs = PANASASFS;
+        }
+#ifdef FUSE_CHUNKER
+        else if (stfs.f_type == FUSE_SUPER_MAGIC) {
+            //fuse file
+            *fs = GPFSFS;
+        }
+#endif
+        else {
+            *fs = ANYFS;
+        }
+    }
+    else {
+        //symlink
+        *fs = GPFSFS;
+    }
+#else
+    *fs = ANYFS;
+#endif
+}
+
+int get_free_rank(int *proc_status, int start_range, int end_range) {
+    //given an inclusive range, return the first encountered free rank
+    int i;
+    for (i = start_range; i <= end_range; i++) {
+        if (proc_status[i] == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int processing_complete(int *proc_status, int nproc) {
+    //are all the ranks free?
+    int i;
+    int count = 0;
+    for (i = 0; i < nproc; i++) {
+        if (proc_status[i] == 1) {
+            count++;
+        }
+    }
+    return count;
+}
+
+//Queue Function Definitions
+void enqueue_path(path_list **head, path_list **tail, char *path, int *count) {
+    //stick a path on the end of the queue
+    path_list *new_node = malloc(sizeof(path_list));
+    strncpy(new_node->data.path, path, PATHSIZE_PLUS);
+    new_node->next = NULL;
+    if (*head == NULL) {
+        *head = new_node;
+        *tail = *head;
+    }
+    else {
+        (*tail)->next = new_node;
+        *tail = (*tail)->next;
+    }
+    /*
+      while (temp_node->next != NULL){
+        temp_node = temp_node->next;
+      }
+      temp_node->next = new_node;
+    }*/
+    *count += 1;
+}
+
+
+void print_queue_path(path_list *head) {
+    //print the entire queue
+    while(head != NULL) {
+        printf("%s\n", head->data.path);
+        head = head->next;
+    }
+}
+
+void delete_queue_path(path_list **head, int *count) {
+    //delete the entire queue;
+    path_list *temp = *head;
+    while(temp) {
+        *head = (*head)->next;
+        free(temp);
+        temp = *head;
+    }
+    *count = 0;
+}
+
+void enqueue_node(path_list **head, path_list **tail, path_list *new_node, int *count) {
+    //enqueue a node using an existing node (does a new allocate, but allows us to pass nodes instead of paths)
+    path_list *temp_node = malloc(sizeof(path_list));
+    temp_node->data = new_node->data;
+    temp_node->next = NULL;
+    if (*head == NULL) {
+        *head = temp_node;
+        *tail = *head;
+    }
+    else {
+        (*tail)->next = temp_node;
+        *tail = (*tail)->next;
+    }
+    *count += 1;
+}
+
+
+void dequeue_node(path_list **head, path_list **tail, int *count) {
+    //remove a path from the front of the queue
+    path_list *temp_node = *head;
+    if (temp_node == NULL) {
+        return;
+    }
+    *head = temp_node->next;
+    free(temp_node);
+    *count -= 1;
+}
+
+
+void enqueue_buf_list(work_buf_list **workbuflist, int *workbufsize, char *buffer, int buffer_size) {
+    work_buf_list *current_pos = *workbuflist;
+    work_buf_list *new_buf_item = malloc(sizeof(work_buf_list));
+    if (*workbufsize < 0) {
+        *workbufsize = 0;
+    }
+    new_buf_item->buf = buffer;
+    new_buf_item->size = buffer_size;
+    new_buf_item->next = NULL;
+    spill_buf(new_buf_item);				// past the memory budget -> written to a segment file
+    if (current_pos == NULL) {
+        *workbuflist = new_buf_item;
+        (*workbufsize)++;
+        return;
+    }
+    while (current_pos->next != NULL) {
+        current_pos = current_pos->next;
+    }
+    current_pos->next = new_buf_item;
+    (*workbufsize)++;
+}
+
+void dequeue_buf_list(work_buf_list **workbuflist, int *workbufsize) {
+    work_buf_list *current_pos;
+    if (*workbuflist == NULL) {
+        return;
+    }
+    current_pos = (*workbuflist)->next;
+    release_buf(*workbuflist);
+    free(*workbuflist);
+    *workbuflist = current_pos;
+    (*workbufsize)--;
+}
+
+void delete_buf_list(work_buf_list **workbuflist, int *workbufsize) {
+    while (*workbuflist) {
+        dequeue_buf_list(workbuflist, workbufsize);
+    }
+    *workbufsize = 0;
+}
+
+void init_size_queue(size_queue *queue) {
+    memset(queue, 0, sizeof(size_queue));
+}
+
+/**
+* Counts an item that enters or leaves a size queue against the
+* node it was found on (-N).
+*
+* @param queue		the queue
+* @param item		the item
+* @param n		1 -> it enters, -1 -> it leaves
+*/
+static void count_origin(size_queue *queue, path_item *item, int n) {
+    locality *loc = queue->loc;
+
+    if (loc == NULL || loc->queued == NULL) {
+        return;
+    }
+    if (item->origin < START_PROC || item->origin >= loc->ranks) {
+        loc->queued_any += n;
+    }
+    else {
+        loc->queued[loc->node[item->origin]] += n;
+    }
+}
+
+/**
+* Puts the packed path_items of a buffer in the buckets of a
+* size queue. Each item goes in the bucket for the number of
+* bytes it moves.
+*
+* @param queue		the queue
+* @param buffer		the packed path_items
+* @param buffer_size	the number of items in buffer
+* @param count		1 -> the items are new to the queue, and are
+* 			counted against their nodes. 0 -> they were
+* 			counted when they were spilled
+*
+* @return the number of bytes the items move
+*/
+static size_t sort_size_queue(size_queue *queue, char *buffer, int buffer_size, int count) {
+    path_list node;
+    off_t offset, length;
+    size_t bytes = 0;
+    int position = 0;
+    int worksize = buffer_size * sizeof(path_item);
+    int i, bucket;
+
+    for (i = 0; i < buffer_size; i++) {
+        MPI_Unpack(buffer, worksize, &position, &node.data, sizeof(path_item), MPI_CHAR, MPI_COMM_WORLD);
+        get_chunk_range(node.data, &offset, &length);
+        for (bucket = 0; bucket < SIZE_BUCKETS-1 && (length >> bucket) > 0; bucket++);	// bucket = number of bits in length
+        enqueue_node(&queue->head[bucket], &queue->tail[bucket], &node, &queue->bucket_count[bucket]);
+        if (count) {
+            count_origin(queue, &node.data, 1);
+        }
+        bytes += length;
+    }
+    queue_memory(buffer_size * sizeof(path_list));
+    return bytes;
+}
+
+/**
+* Adds a buffer of packed path_items to a size queue. The
+* items go in the buckets, unless the queues are at their
+* memory budget (-q): then the buffer waits, packed, in the
+* spill list of the queue (see spill.h), behind any buffers
+* already there. The buffer is freed or kept.
+*
+* @param queue		the queue to add to
+* @param buffer		the packed path_items
+* @param buffer_size	the number of items in buffer
+*/
+void enqueue_size_queue(size_queue *queue, char *buffer, int buffer_size) {
+    path_item item;
+    off_t offset, length;
+    int position = 0;
+    int worksize = buffer_size * sizeof(path_item);
+    int i;
+
+    queue->size += buffer_size;
+    if (queue->spill == NULL && !queue_memory_full(buffer_size * sizeof(path_list))) {
+        queue->bytes += sort_size_queue(queue, buffer, buffer_size, 1);
+        free(buffer);
+        return;
+    }
+    for (i = 0; i < buffer_size; i++) {
+        MPI_Unpack(buffer, worksize, &position, &item, sizeof(path_item), MPI_CHAR, MPI_COMM_WORLD);
+        get_chunk_range(item, &offset, &length);
+        queue->bytes += length;
+        count_origin(queue, &item, 1);
+    }
+    queue->spilled += buffer_size;
+    enqueue_buf_list(&queue->spill, &queue->spill_count, buffer, buffer_size);
+}
 
-void write_output(char *message, int log) {
-    //write a single line using the outputproc
-    //set the command type
-    if (log == 0) {
-        send_command(OUTPUT_PROC, OUTCMD);
+/**
+* Tells if an item was found on the node of a rank. Items with
+* no known origin are local to every rank.
+*
+* @param loc		the nodes of the ranks
+* @param item		the queued item
+* @param rank		the rank
+*
+* @return 1 if the item is local to the rank
+*/
+static int is_local(locality *loc, path_item *item, int rank) {
+    if (item->origin < START_PROC || item->origin >= loc->ranks) {
+        return 1;
     }
-    else if (log == 1) {
-        send_command(OUTPUT_PROC, LOGCMD);
+    return (loc->node[item->origin] == loc->node[rank]);
+}
+
+/**
+* Sends a batch from a size queue to a rank. The batch is
+* filled biggest item first, and is cut when it holds
+* batch_bytes bytes or batch_count items. So a big chunk
+* goes out on its own, and small files go out together.
+*
+* With locality (-N), the batch can be limited to work found
+* on the node of the rank. With target limits (-J), work on
+* directories and devices that are at their limits is left
+* in the queue. Up to QUEUE_SCAN items of each bucket are
+* passed over for either. If nothing is left to take, no
+* batch is sent.
+*
+* @param target_rank	the rank to send the batch to
+* @param command	the command for the batch (COPYCMD or COMPARECMD)
+* @param queue		the queue to take the batch from
+* @param batch_bytes	the byte target of a batch
+* @param batch_count	the most items in a batch
+* @param loc		the nodes of the ranks. NULL -> no locality
+* @param local_only	1 -> only take work found on the node of target_rank
+* @param tl		the target limits. NULL -> none
+*
+* @return the number of items sent
+*/
+int send_size_queue(int target_rank, int command, size_queue *queue, size_t batch_bytes, int batch_count, locality *loc, int local_only, target_limits *tl) {
+    char *workbuf;
+    int worksize, position = 0;
+    int size = 0;
+    size_t bytes = 0;
+    off_t offset, length;
+    int bucket, skipped;
+    path_list *prev, *iter;
+
+    //move spilled buffers to the buckets while the batch would come up short, or there is room for them
+    while (queue->spill != NULL &&
+           (queue->size - queue->spilled < batch_count || !queue_memory_full(queue->spill->size * sizeof(path_list)))) {
+        if (load_buf(queue->spill) == NULL) {
+            fprintf(stderr, "Failed to read spilled queue buffer for rank %d\n", target_rank);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        sort_size_queue(queue, queue->spill->buf, queue->spill->size, 0);
+        queue->spilled -= queue->spill->size;
+        dequeue_buf_list(&queue->spill, &queue->spill_count);
     }
-    //send the message
-    if (MPI_Send(message, MESSAGESIZE, MPI_CHAR, OUTPUT_PROC, OUTPUT_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to message to rank %d\n", OUTPUT_PROC);
+    worksize = sizeof(path_item) * ((queue->size < batch_count)?queue->size:batch_count);
+    workbuf = (char *) malloc(worksize * sizeof(char));
+    if (loc == NULL || loc->wait < 0) {
+        local_only = 0;
+    }
+    for (bucket = SIZE_BUCKETS-1; bucket >= 0 && (size == 0 || (size < batch_count && bytes < batch_bytes)); bucket--) {
+        prev = NULL;
+        iter = queue->head[bucket];
+        skipped = 0;
+        while (iter != NULL && (size == 0 || (size < batch_count && bytes < batch_bytes))) {
+            if ((local_only && !is_local(loc, &iter->data, target_rank)) ||
+                (tl != NULL && !target_may_take(tl, target_rank, &iter->data))) {
+                if (++skipped >= QUEUE_SCAN) {
+                    break;
+                }
+                prev = iter;
+                iter = iter->next;
+                continue;
+            }
+            if (loc != NULL && loc->wait >= 0) {
+                if (is_local(loc, &iter->data, target_rank)) {
+                    loc->local++;
+                }
+                else {
+                    loc->remote++;
+                }
+            }
+            if (tl != NULL) {
+                target_take(tl, target_rank, &iter->data);
+            }
+            count_origin(queue, &iter->data, -1);
+            get_chunk_range(iter->data, &offset, &length);
+            MPI_Pack(&iter->data, sizeof(path_item), MPI_CHAR, workbuf, worksize, &position, MPI_COMM_WORLD);
+            if (prev == NULL) {
+                dequeue_node(&queue->head[bucket], &queue->tail[bucket], &queue->bucket_count[bucket]);
+                iter = queue->head[bucket];
+            }
+            else {
+                prev->next = iter->next;
+                if (queue->tail[bucket] == iter) {
+                    queue->tail[bucket] = prev;
+                }
+                free(iter);
+                queue->bucket_count[bucket]--;
+                iter = prev->next;
+            }
+            queue_memory(-(long) sizeof(path_list));
+            queue->size--;
+            queue->bytes -= length;
+            bytes += length;
+            size++;
+        }
+    }
+    if (size == 0 && queue->size > 0) {
+        if (tl != NULL && !local_only) {				// a local_only miss is retried with any work
+            tl->held_back++;
+        }
+        free(workbuf);
+        return 0;
+    }
+    send_command(target_rank, command);
+    if (MPI_Send(&size, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send batch size %d to rank %d\n", size, target_rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (MPI_Send(workbuf, position, MPI_PACKED, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send batch buf to rank %d\n", target_rank);
         MPI_Abort(MPI_COMM_WORLD, -1);
     }
+    free(workbuf);
+    return size;
 }
 
+void delete_size_queue(size_queue *queue) {
+    locality *loc = queue->loc;
+    int bucket;
 
-void write_buffer_output(char *buffer, int buffer_size, int buffer_count) {
-    //write a buffer to the output proc
-    //set the command type
-    send_command(OUTPUT_PROC, BUFFEROUTCMD);
-    //send the size of the buffer
-    if (MPI_Send(&buffer_count, 1, MPI_INT, OUTPUT_PROC, OUTPUT_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to buffer_count %d to rank %d\n", buffer_count, OUTPUT_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    for (bucket = 0; bucket < SIZE_BUCKETS; bucket++) {
+        while (queue->head[bucket] != NULL) {
+            dequeue_node(&queue->head[bucket], &queue->tail[bucket], &queue->bucket_count[bucket]);
+            queue_memory(-(long) sizeof(path_list));
+        }
     }
-    if (MPI_Send(buffer, buffer_size, MPI_PACKED, OUTPUT_PROC, OUTPUT_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to message to rank %d\n", OUTPUT_PROC);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+    delete_buf_list(&queue->spill, &queue->spill_count);
+    init_size_queue(queue);
+    queue->loc = loc;
+    if (loc != NULL && loc->queued != NULL) {
+        memset(loc->queued, 0, loc->nodes * sizeof(int));
+        loc->queued_any = 0;
     }
 }
 
-void send_worker_queue_count(int target_rank, int queue_count) {
-    if (MPI_Send(&queue_count, 1, MPI_INT, target_rank, target_rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
-        fprintf(stderr, "Failed to queue_count %d to rank %d\n", queue_count, target_rank);
-        MPI_Abort(MPI_COMM_WORLD, -1);
+static double batch_now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static int batch_clamp(int size, int low, int high) {
+    if (size < low) return low;
+    if (size > high) return high;
+    return size;
+}
+
+/**
+* Sets up the manager's batch size controller.
+*
+* @param bc		the controller to set up
+* @param nproc		the number of ranks
+* @param sizes		the starting batch sizes. All ranks
+* 			start with these
+*/
+void init_batch_control(batch_control *bc, int nproc, batch_sizes *sizes) {
+    memset(bc, 0, sizeof(batch_control));
+    bc->sizes = *sizes;
+    bc->low = *sizes;
+    bc->high = *sizes;
+    bc->sent = (int *) calloc(nproc, sizeof(int));
+    bc->start = (double *) calloc(nproc, sizeof(double));
+    bc->items = (int *) calloc(nproc, sizeof(int));
+    bc->kind = (int *) calloc(nproc, sizeof(int));
+    bc->last_tune = batch_now();
+}
+
+void free_batch_control(batch_control *bc) {
+    free(bc->sent);
+    free(bc->start);
+    free(bc->items);
+    free(bc->kind);
+}
+
+/**
+* Sends the current batch sizes to a rank, if it does not
+* have them yet. Call before handing the rank work.
+*
+* @param bc		the batch size controller
+* @param rank		the rank about to get work
+*/
+void batch_sync(batch_control *bc, int rank) {
+    if (bc->sent[rank] != bc->version) {
+        send_worker_batch_sizes(rank, &bc->sizes);
+        bc->sent[rank] = bc->version;
     }
 }
 
-void send_worker_readdir(int target_rank, work_buf_list  **workbuflist, int *workbufsize) {
-    //send a worker a buffer list of paths to stat
-    send_buffer_list(target_rank, DIRCMD, workbuflist, workbufsize);
+/**
+* Records that a rank was handed a batch, so that its
+* service time can be measured when it is done.
+*
+* @param bc		the batch size controller
+* @param rank		the rank that got the batch
+* @param kind		DIRCMD, COPYCMD or COMPARECMD
+* @param items		the number of items in the batch
+*/
+void batch_started(batch_control *bc, int rank, int kind, int items) {
+    bc->start[rank] = batch_now();
+    bc->items[rank] = items;
+    bc->kind[rank] = kind;
 }
 
-#ifdef TAPE
-void send_worker_tape_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize) {
-    //send a worker a buffer list of paths to stat
-    send_buffer_list(target_rank, TAPECMD, workbuflist, workbufsize);
+/**
+* Records that a rank finished its batch. The time per
+* item is folded into a moving average for the kind of
+* work.
+*
+* @param bc		the batch size controller
+* @param rank		the rank that is done
+*/
+void batch_done(batch_control *bc, int rank) {
+    double secs;
+    double *avg;
+
+    if (bc->kind[rank] == 0 || bc->items[rank] <= 0) {
+        return;
+    }
+    secs = (batch_now() - bc->start[rank])/bc->items[rank];
+    avg = (bc->kind[rank] == DIRCMD)?&bc->dir_secs:&bc->copy_secs;
+    *avg = (*avg > 0.0)?(0.75*(*avg) + 0.25*secs):secs;
+    bc->kind[rank] = 0;
 }
-#endif
 
-void send_worker_copy_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize) {
-    //send a worker a list buffers with paths to copy
-    send_buffer_list(target_rank, COPYCMD, workbuflist, workbufsize);
+/**
+* Tunes the batch sizes from the state of the manager's
+* queues, the number of idle ranks and the measured time per
+* item. At most once every BATCH_INTERVAL seconds:
+*   - with idle ranks and little queued work, batches shrink,
+*     so that the work is spread and reaches the manager sooner
+*   - with no idle ranks and a deep queue, batches grow, so
+*     that there are fewer, bigger messages
+*   - a copy batch is about BATCH_SECS of work, and no more
+*     than an even share of the queue for each idle rank
+* The sizes stay within these bounds:
+*   - dir: 1 to DIRBUFFER*BATCH_GROWTH
+*   - stat: STATBUFFER/BATCH_GROWTH to STATBUFFER*BATCH_GROWTH
+*   - copy: 1 to copy_count*BATCH_GROWTH, so that the last big
+*     chunks can go out one per rank
+*   - message: MESSAGEBUFFER/BATCH_GROWTH to MESSAGEBUFFER, the
+*     size of the output buffers
+*
+* @param bc		the batch size controller
+* @param dir_depth	directories queued at the manager
+* @param copy_depth	files/chunks queued at the manager
+* @param idle_ranks	the number of idle workers
+* @param num_workers	the number of workers
+* @param copy_count	the default copy batch size (-Y)
+*/
+void tune_batch_sizes(batch_control *bc, int dir_depth, int copy_depth, int idle_ranks, int num_workers, int copy_count) {
+    batch_sizes new = bc->sizes;
+    double now = batch_now();
+
+    if (now - bc->last_tune < BATCH_INTERVAL) {
+        return;
+    }
+    bc->last_tune = now;
+    //directories
+    if (idle_ranks > 0 && dir_depth < idle_ranks) {
+        new.dir /= 2;
+    }
+    else if (idle_ranks == 0 && dir_depth > num_workers) {
+        new.dir *= 2;
+    }
+    if (bc->dir_secs > 0.0 && new.dir * bc->dir_secs > BATCH_SECS) {
+        new.dir = BATCH_SECS/bc->dir_secs;
+    }
+    new.dir = batch_clamp(new.dir, 1, DIRBUFFER*BATCH_GROWTH);
+    //stat entries
+    if (idle_ranks > 0 && dir_depth + copy_depth < idle_ranks) {
+        new.stat /= 2;
+    }
+    else if (idle_ranks == 0 && dir_depth + copy_depth > num_workers) {
+        new.stat *= 2;
+    }
+    new.stat = batch_clamp(new.stat, STATBUFFER/BATCH_GROWTH, STATBUFFER*BATCH_GROWTH);
+    //copies
+    if (bc->copy_secs > 0.0) {
+        new.copy = (BATCH_SECS/bc->copy_secs < copy_count*BATCH_GROWTH)?(int)(BATCH_SECS/bc->copy_secs):copy_count*BATCH_GROWTH;
+    }
+    if (idle_ranks > 0 && copy_depth > 0 && new.copy > (copy_depth + idle_ranks - 1)/idle_ranks) {
+        new.copy = (copy_depth + idle_ranks - 1)/idle_ranks;
+    }
+    new.copy = batch_clamp(new.copy, 1, copy_count*BATCH_GROWTH);
+    //output follows the stat rate
+    new.message = batch_clamp(new.stat*MESSAGEBUFFER/STATBUFFER, MESSAGEBUFFER/BATCH_GROWTH, MESSAGEBUFFER);
+
+    if (memcmp(&new, &bc->sizes, sizeof(batch_sizes)) != 0) {
+        PRINT_MPI_DEBUG("tune_batch_sizes() dir %d stat %d copy %d message %d\n", new.dir, new.stat, new.copy, new.message);
+        bc->sizes = new;
+        bc->version++;
+        if (new.dir < bc->low.dir) bc->low.dir = new.dir;
+        if (new.dir > bc->high.dir) bc->high.dir = new.dir;
+        if (new.stat < bc->low.stat) bc->low.stat = new.stat;
+        if (new.stat > bc->high.stat) bc->high.stat = new.stat;
+        if (new.copy < bc->low.copy) bc->low.copy = new.copy;
+        if (new.copy > bc->high.copy) bc->high.copy = new.copy;
+        if (new.message < bc->low.message) bc->low.message = new.message;
+        if (new.message > bc->high.message) bc->high.message = new.message;
+    }
 }
 
-void send_worker_compare_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize) {
-    //send a worker a list buffers with paths to compare
-    send_buffer_list(target_rank, COMPARECMD, workbuflist, workbufsize);
+/**
+* Parses the watermarks of the copy backlog (-Q): high
+* bytes, low bytes, high items and low items, separated by
+* commas. Sizes take units (e.g. 100GB). A low watermark
+* that is not given is half of the high one.
+*
+* @param spec		the watermarks, e.g. 500GB,100GB,1000000
+* @param o		gets the watermarks
+*
+* @return 0 on success, -1 if they make no sense
+*/
+int parse_backlog_marks(const char *spec, struct options *o) {
+    char buf[256];
+    char *field, *save;
+    size_t marks[4] = {0, 0, 0, 0};
+    int n = 0;
+
+    strncpy(buf, spec, sizeof(buf));
+    buf[sizeof(buf)-1] = '\0';
+    for (field = strtok_r(buf, ",", &save); field != NULL && n < 4; field = strtok_r(NULL, ",", &save)) {
+        marks[n++] = str2Size(field);
+    }
+    if (n == 0 || marks[0] == 0) {
+        return -1;
+    }
+    o->backlog_high = marks[0];
+    o->backlog_low = (n > 1)?marks[1]:marks[0]/2;
+    o->backlog_high_items = marks[2];
+    o->backlog_low_items = (n > 3)?marks[3]:marks[2]/2;
+    if (o->backlog_low > o->backlog_high || o->backlog_low_items > o->backlog_high_items) {
+        return -1;
+    }
+    return 0;
 }
 
-void send_worker_exit(int target_rank) {
-    //order a rank to exit
-    send_command(target_rank, EXITCMD);
+/**
+* Sets up the manager's flow control of the walk.
+*
+* @param fc		the flow control to set up
+* @param nproc		the number of ranks
+* @param o		the options of the run (the watermarks)
+*/
+void init_flow_control(flow_control *fc, int nproc, struct options o) {
+    memset(fc, 0, sizeof(flow_control));
+    fc->high_bytes = o.backlog_high;
+    fc->low_bytes = o.backlog_low;
+    fc->high_items = o.backlog_high_items;
+    fc->low_items = o.backlog_low_items;
+    fc->num_workers = nproc - START_PROC;
+    fc->walking = (int *) calloc(nproc, sizeof(int));
+    fc->started = batch_now();
+    fc->last_report = fc->started;
 }
 
+void free_flow_control(flow_control *fc) {
+    if (fc->throttled) {
+        fc->throttled_secs += batch_now() - fc->throttled_at;
+    }
+    free(fc->walking);
+}
 
-//functions that use workers
-void errsend(int fatal, char *error_text) {
-    //send an error message to the outputproc. Die if fatal.
-    char errormsg[MESSAGESIZE];
-    if (fatal) {
-        snprintf(errormsg, MESSAGESIZE, "ERROR FATAL: %s\n",error_text);
+/**
+* Gets how full the backlog is, between the watermarks: 0 at
+* or under the low ones, 1 at or over a high one. The fuller
+* of bytes and items counts.
+*/
+static double backlog_level(flow_control *fc, size_t backlog_bytes, int backlog_items) {
+    double level = 0.0, items;
+
+    if (backlog_bytes >= fc->high_bytes) {
+        level = 1.0;
     }
-    else {
-        snprintf(errormsg, MESSAGESIZE, "ERROR NONFATAL: %s\n",error_text);
+    else if (backlog_bytes > fc->low_bytes) {
+        level = (double)(backlog_bytes - fc->low_bytes)/(fc->high_bytes - fc->low_bytes);
     }
-    write_output(errormsg, 1);
-    if (fatal) {
+    if (fc->high_items > 0) {
+        if (backlog_items >= fc->high_items) {
+            items = 1.0;
+        }
+        else if (backlog_items > fc->low_items) {
+            items = (double)(backlog_items - fc->low_items)/(fc->high_items - fc->low_items);
+        }
+        else {
+            items = 0.0;
+        }
+        if (items > level) {
+            level = items;
+        }
+    }
+    return level;
+}
+
+/**
+* Tells if one more rank may be handed walk work (DIRCMD or
+* STATCMD), so that the copy backlog stays between the
+* watermarks:
+*   - under the low watermarks, all ranks may walk
+*   - between them, the share of ranks that may walk falls
+*     as the backlog grows, and the rest copy
+*   - over a high watermark nothing more is walked, until the
+*     backlog is under the low watermarks again
+* At least one rank may always walk while the backlog is
+* not throttled, so the walk keeps going.
+*
+* @param fc		the flow control
+* @param backlog_bytes	bytes of copy work queued
+* @param backlog_items	files/chunks of copy work queued
+*
+* @return 1 if a rank may be handed walk work
+*/
+int flow_may_walk(flow_control *fc, size_t backlog_bytes, int backlog_items) {
+    double level;
+    int walkers;
+
+    if (fc->high_bytes == 0) {
+        return 1;
+    }
+    level = backlog_level(fc, backlog_bytes, backlog_items);
+    if (!fc->throttled && level >= 1.0) {
+        fc->throttled = 1;
+        fc->throttles++;
+        fc->throttled_at = batch_now();
+        PRINT_MPI_DEBUG("flow_may_walk() backlog %zd bytes %d items: walk stopped\n", backlog_bytes, backlog_items);
+    }
+    else if (fc->throttled && level <= 0.0) {
+        fc->throttled = 0;
+        fc->throttled_secs += batch_now() - fc->throttled_at;
+        PRINT_MPI_DEBUG("flow_may_walk() backlog %zd bytes %d items: walk resumed\n", backlog_bytes, backlog_items);
+    }
+    if (fc->throttled) {
+        return 0;
+    }
+    walkers = (int)(fc->num_workers * (1.0 - level) + 0.5);
+    if (walkers < 1) {
+        walkers = 1;
+    }
+    return (fc->walkers < walkers);
+}
+
+/**
+* Records that a rank was handed work.
+*
+* @param fc		the flow control
+* @param rank		the rank
+* @param kind		the command of the work
+*/
+void flow_started(flow_control *fc, int rank, int kind) {
+    if ((kind == DIRCMD || kind == STATCMD) && !fc->walking[rank]) {
+        fc->walking[rank] = 1;
+        fc->walkers++;
+    }
+}
+
+/**
+* Records that a rank finished its work.
+*
+* @param fc		the flow control
+* @param rank		the rank
+*/
+void flow_done(flow_control *fc, int rank) {
+    if (fc->walking[rank]) {
+        fc->walking[rank] = 0;
+        fc->walkers--;
+    }
+}
+
+/**
+* Reports the depths of the manager's queues, and what the
+* ranks are doing, every FLOW_INTERVAL seconds. Only with
+* watermarks (-Q), which these reports help to tune.
+*
+* @param fc		the flow control
+* @param dir_depth	directory buffers queued
+* @param stat_depth	stat buffers queued
+* @param backlog_bytes	bytes of copy work queued
+* @param backlog_items	files/chunks of copy work queued
+* @param busy_ranks	the number of workers that have work
+*/
+void flow_report(flow_control *fc, int dir_depth, int stat_depth, size_t backlog_bytes, int backlog_items, int busy_ranks) {
+    char message[MESSAGESIZE];
+    double now;
+
+    if (fc->high_bytes == 0) {
+        return;
+    }
+    now = batch_now();
+    if (now - fc->last_report < FLOW_INTERVAL) {
+        return;
+    }
+    fc->last_report = now;
+    sprintf(message, "INFO  QUEUE    %6.0fs  dirs %d  stats %d  copy %d items %zd bytes  walking %d  copying %d%s\n",
+            now - fc->started, dir_depth, stat_depth, backlog_items, backlog_bytes,
+            fc->walkers, busy_ranks - fc->walkers, (fc->throttled)?"  (walk stopped)":"");
+    write_output(message, 1);
+}
+
+/**
+* Finds out the node of each rank, for handing copy work to
+* ranks on the node that found it (-N). Collective: every rank
+* calls it, but only the manager keeps the nodes.
+*
+* @param loc		gets the nodes of the ranks
+* @param rank		this rank
+* @param nproc		the number of ranks
+* @param wait		seconds a free rank waits for work found
+* 			on its node. < 0 -> no locality
+*/
+void init_locality(locality *loc, int rank, int nproc, double wait) {
+    char name[MPI_MAX_PROCESSOR_NAME];
+    char *names = NULL;
+    int len, i, j;
+
+    memset(loc, 0, sizeof(locality));
+    loc->wait = wait;
+    if (wait < 0) {
+        return;
+    }
+    memset(name, 0, sizeof(name));
+    MPI_Get_processor_name(name, &len);
+    if (rank == MANAGER_PROC) {
+        names = (char *) malloc(nproc * MPI_MAX_PROCESSOR_NAME);
+    }
+    if (MPI_Gather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, names, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, MANAGER_PROC, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to gather the node names\n");
         MPI_Abort(MPI_COMM_WORLD, -1);
     }
-    else {
-        send_manager_nonfatal_inc();
+    if (rank != MANAGER_PROC) {
+        return;
+    }
+    loc->ranks = nproc;
+    loc->node = (int *) malloc(nproc * sizeof(int));
+    loc->idle_since = (double *) calloc(nproc, sizeof(double));
+    for (i = 0; i < nproc; i++) {
+        for (j = 0; j < i && strcmp(names + i*MPI_MAX_PROCESSOR_NAME, names + j*MPI_MAX_PROCESSOR_NAME) != 0; j++);
+        loc->node[i] = (j < i)?loc->node[j]:loc->nodes++;
     }
+    free(names);
+    loc->queued = (int *) calloc(loc->nodes, sizeof(int));
 }
 
-#ifdef FUSE_CHUNKER
-int is_fuse_chunk(const char *path, struct options o) {
-  if (path && strstr(path, o.fuse_path)){
-    return 1;
-  } 
-  else{
-    return 0;
-  }
+void free_locality(locality *loc) {
+    free(loc->node);
+    free(loc->idle_since);
+    free(loc->queued);
 }
 
-void set_fuse_chunk_data(path_item *work_node) {
+/**
+* Picks a free rank to hand copy work to (see get_free_rank()),
+* with locality (-N): a rank gets work found on its node if the
+* queue has some, which is known from the count of queued items
+* per node. A rank that has been free for loc->wait seconds
+* takes any work. A rank that finds no work of its node in reach
+* (past QUEUE_SCAN, or held back by the target limits, -J) is
+* offered any work by the manager at once, so free ranks are
+* never kept waiting on work they cannot take.
+*
+* @param proc_status	1 for the ranks that have work
+* @param loc		the nodes of the ranks
+* @param start_range	the first rank to look at
+* @param end_range	the last rank to look at
+* @param local_only	gets 1 if the rank is to take only
+* 			work found on its node
+*
+* @return the rank, or -1 if none is free or all are waiting
+*/
+int get_local_rank(int *proc_status, locality *loc, int start_range, int end_range, int *local_only) {
+    double now;
     int i;
-    int numchars;
-    char linkname[PATHSIZE_PLUS], baselinkname[PATHSIZE_PLUS];
-    const char delimiters[] =  ".";
-    char *current;
-    char errormsg[MESSAGESIZE];
-    size_t length;
-    memset(linkname,'\0', sizeof(PATHSIZE_PLUS));
-    numchars = readlink(work_node->path, linkname, PATHSIZE_PLUS);
-    if (numchars < 0) {
-        sprintf(errormsg, "Failed to read link %s", work_node->path);
-        errsend(NONFATAL, errormsg);
-        return;
+
+    *local_only = 0;
+    if (loc->wait < 0) {
+        return get_free_rank(proc_status, start_range, end_range);
     }
-    linkname[numchars] = '\0';
-    strncpy(baselinkname, basename(linkname), PATHSIZE_PLUS);
-    current = strdup(baselinkname);
-    strtok(current, delimiters);
-    for (i = 0; i < 2; i++) {
-        strtok(NULL, delimiters);
+    now = batch_now();
+    for (i = start_range; i <= end_range; i++) {
+        if (proc_status[i] != 0) {
+            loc->idle_since[i] = 0;
+            continue;
+        }
+        if (loc->idle_since[i] == 0) {
+            loc->idle_since[i] = now;
+        }
+        if (now - loc->idle_since[i] <= loc->wait && (loc->queued_any > 0 || loc->queued[loc->node[i]] > 0)) {
+            *local_only = 1;
+            return i;
+        }
+        if (now - loc->idle_since[i] >= loc->wait) {
+            return i;
+        }
     }
-    length = atoll(strtok(NULL, delimiters));
-    work_node->chkidx = 0;
-    work_node->chksz = length;
+    return -1;
 }
 
-int get_fuse_chunk_attr(const char *path, off_t offset, size_t length, struct utimbuf *ut, uid_t *userid, gid_t *groupid) {
-    char value[10000];
-    int valueLen = 0;
-    char chunk_name[50];
-    int chunk_num = 0;
-    if (length == 0) {
+/**
+* Parses the target limits (-J): the most copy batches in
+* flight per destination directory, and per source device,
+* separated by a comma.
+*
+* @param spec		the limits, e.g. 4,16
+* @param o		gets the limits
+*
+* @return 0 on success, -1 if they make no sense
+*/
+int parse_target_limits(const char *spec, struct options *o) {
+    const char *comma = strchr(spec, ',');
+
+    o->dir_limit = atoi(spec);
+    o->dev_limit = (comma != NULL)?atoi(comma + 1):0;
+    if (o->dir_limit < 0 || o->dev_limit < 0 || (o->dir_limit == 0 && o->dev_limit == 0)) {
         return -1;
     }
-    chunk_num = offset/length;
-    snprintf(chunk_name, 50, "user.chunk_%d", chunk_num);
-#ifdef __APPLE__
-    valueLen = getxattr(path, chunk_name, value, 10000, 0, 0);
-#else
-    valueLen = getxattr(path, chunk_name, value, 10000);
-#endif
-    if (valueLen != -1) {
-        sscanf(value, "%10lld %10lld %8d %8d", (long long int *) &(ut->actime), (long long int *) &(ut->modtime), userid, groupid);
+    return 0;
+}
+
+/**
+* Sets up the manager's counts of copy batches in flight.
+*
+* @param tl		the target limits to set up
+* @param nproc		the number of ranks
+* @param o		the options of the run (the limits)
+*/
+void init_target_limits(target_limits *tl, int nproc, struct options o) {
+    memset(tl, 0, sizeof(target_limits));
+    tl->dir_limit = o.dir_limit;
+    tl->dev_limit = o.dev_limit;
+    if (tl->dir_limit == 0 && tl->dev_limit == 0) {
+        return;
     }
-    else {
-        return -1;
+    tl->size = 1024;
+    tl->keys = (size_t *) calloc(tl->size, sizeof(size_t));
+    tl->counts = (int *) calloc(tl->size, sizeof(int));
+    tl->held = (size_t **) calloc(nproc, sizeof(size_t *));
+    tl->nheld = (int *) calloc(nproc, sizeof(int));
+    tl->held_size = (int *) calloc(nproc, sizeof(int));
+    tl->nproc = nproc;
+}
+
+void free_target_limits(target_limits *tl) {
+    int i;
+
+    for (i = 0; i < tl->nproc; i++) {
+        free(tl->held[i]);
     }
-    return 0;
+    free(tl->held);
+    free(tl->nheld);
+    free(tl->held_size);
+    free(tl->keys);
+    free(tl->counts);
 }
 
-int set_fuse_chunk_attr(const char *path, off_t offset, size_t length, struct utimbuf ut, uid_t userid, gid_t groupid) {
-    char value[10000];
-    int valueLen = 0;
-    char chunk_name[50];
-    int chunk_num = 0;
-    chunk_num = offset/length;
-    snprintf(chunk_name, 50, "user.chunk_%d", chunk_num);
-    sprintf(value, "%lld %lld %d %d", (long long int) ut.actime, (long long int ) ut.modtime, userid, groupid);
-#ifdef __APPLE__
-    valueLen = setxattr(path, chunk_name, value, 10000, 0, XATTR_CREATE);
-#else
-    valueLen = setxattr(path, chunk_name, value, 10000, XATTR_CREATE);
-#endif
-    if (valueLen != -1) {
-        return 0;
+/**
+* Gets the keys of the targets of an item. Keys of directories
+* are even and keys of devices are odd, so they do not mix. A
+* copy keeps the tree, so the destination directory of an item
+* is known by the directory of its source path. Only items that
+* create an entry count against their directory: whole files and
+* the first chunk of a chunked file. Later chunks and split off
+* pieces only write data, so many ranks may copy them at once.
+*
+* @param item		the item
+* @param dir		gets the key of its directory. 0 -> none
+* @param dev		gets the key of its device
+*/
+static void target_keys(path_item *item, size_t *dir, size_t *dev) {
+    const char *name = strrchr(item->path, '/');
+    size_t hash = 14695981039346656037UL;
+    const char *c;
+
+    *dev = ((size_t) item->st.st_dev << 1) | 1;
+    if (item->chkidx > 0 || item->chklen > 0) {			// a later chunk, or a piece split off a chunk
+        *dir = 0;
+        return;
     }
-    else {
-        return -1;
+    for (c = item->path; name != NULL && c < name; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211UL;
     }
+    *dir = (hash << 1) | 2;
 }
-#endif
 
+/**
+* Finds the slot of a target in the table.
+*
+* @param tl		the target limits
+* @param key		the key of the target
+*
+* @return the slot: the target's, or the empty one it would go in
+*/
+static size_t target_slot(target_limits *tl, size_t key) {
+    size_t j;
 
-void get_stat_fs_info(const char *path, int *fs) {
-#ifdef HAVE_SYS_VFS_H
-    struct stat st;
-    struct statfs stfs;
-    char errortext[MESSAGESIZE];
-    int rc;
-    char use_path[PATHSIZE_PLUS];
-    strncpy(use_path, path, PATHSIZE_PLUS);
-    rc = lstat(use_path, &st);
-    if (rc < 0) {
-        strcpy(use_path, dirname(strdup(path)));
-        rc = lstat(use_path, &st);
-        if (rc < 0) {
-            fprintf(stderr, "Failed to stat path %s\n", path);
-            MPI_Abort(MPI_COMM_WORLD, -1);
-        }
-    }
-    if (!S_ISLNK(st.st_mode)) {
-        if (statfs(use_path, &stfs) < 0) {
-            snprintf(errortext, MESSAGESIZE, "Failed to statfs path %s", path);
-            errsend(FATAL, errortext);
-        }
-        if (stfs.f_type == GPFS_FILE) {
-            *fs = GPFSFS;
-        }
-        else if (stfs.f_type == PANFS_FILE) {
-            *fs = PANASASFS;
+    for (j = (key * 11400714819323198485UL >> 20) & (tl->size - 1); tl->keys[j] != 0 && tl->keys[j] != key; j = (j + 1) & (tl->size - 1));
+    return j;
+}
+
+/**
+* Adds a batch to the count of a target. When the table gets
+* half full it is rebuilt, without the targets that have no
+* batches left, and grows if it needs to.
+*
+* @param tl		the target limits
+* @param key		the key of the target
+*/
+static void target_add(target_limits *tl, size_t key) {
+    size_t *old_keys = tl->keys;
+    int *old_counts = tl->counts;
+    size_t old_size = tl->size;
+    size_t i, j;
+
+    if (2*(tl->used + 1) > tl->size) {
+        for (i = 0, tl->used = 0; i < old_size; i++) {
+            if (old_keys[i] != 0 && old_counts[i] > 0) {
+                tl->used++;
+            }
         }
-#ifdef FUSE_CHUNKER
-        else if (stfs.f_type == FUSE_SUPER_MAGIC) {
-            //fuse file
-            *fs = GPFSFS;
+        if (4*(tl->used + 1) > tl->size) {
+            tl->size *= 2;
         }
-#endif
-        else {
-            *fs = ANYFS;
+        tl->keys = (size_t *) calloc(tl->size, sizeof(size_t));
+        tl->counts = (int *) calloc(tl->size, sizeof(int));
+        for (i = 0; i < old_size; i++) {
+            if (old_keys[i] != 0 && old_counts[i] > 0) {
+                j = target_slot(tl, old_keys[i]);
+                tl->keys[j] = old_keys[i];
+                tl->counts[j] = old_counts[i];
+            }
         }
+        free(old_keys);
+        free(old_counts);
     }
-    else {
-        //symlink
-        *fs = GPFSFS;
+    j = target_slot(tl, key);
+    if (tl->keys[j] == 0) {
+        tl->keys[j] = key;
+        tl->used++;
     }
-#else
-    *fs = ANYFS;
-#endif
+    tl->counts[j]++;
 }
 
-int get_free_rank(int *proc_status, int start_range, int end_range) {
-    //given an inclusive range, return the first encountered free rank
+/**
+* Tells if a target is held by the batch being built for a rank.
+*/
+static int target_held(target_limits *tl, int rank, size_t key) {
     int i;
-    for (i = start_range; i <= end_range; i++) {
-        if (proc_status[i] == 0) {
-            return i;
-        }
-    }
-    return -1;
-}
 
-int processing_complete(int *proc_status, int nproc) {
-    //are all the ranks free?
-    int i;
-    int count = 0;
-    for (i = 0; i < nproc; i++) {
-        if (proc_status[i] == 1) {
-            count++;
+    for (i = 0; i < tl->nheld[rank]; i++) {
+        if (tl->held[rank][i] == key) {
+            return 1;
         }
     }
-    return count;
+    return 0;
 }
 
-//Queue Function Definitions
-void enqueue_path(path_list **head, path_list **tail, char *path, int *count) {
-    //stick a path on the end of the queue
-    path_list *new_node = malloc(sizeof(path_list));
-    strncpy(new_node->data.path, path, PATHSIZE_PLUS);
-    new_node->next = NULL;
-    if (*head == NULL) {
-        *head = new_node;
-        *tail = *head;
+/**
+* Tells if an item can go in the batch of a rank: its
+* destination directory and its source device are below their
+* limits, or the batch already has work on them.
+*
+* @param tl		the target limits
+* @param rank		the rank the batch is for
+* @param item		the item
+*
+* @return 1 if it can
+*/
+int target_may_take(target_limits *tl, int rank, path_item *item) {
+    size_t dir, dev;
+
+    if (tl->size == 0) {
+        return 1;
     }
-    else {
-        (*tail)->next = new_node;
-        *tail = (*tail)->next;
+    target_keys(item, &dir, &dev);
+    if (tl->dir_limit > 0 && dir != 0 && !target_held(tl, rank, dir) && tl->counts[target_slot(tl, dir)] >= tl->dir_limit) {
+        return 0;
     }
-    /*
-      while (temp_node->next != NULL){
-        temp_node = temp_node->next;
-      }
-      temp_node->next = new_node;
-    }*/
-    *count += 1;
+    if (tl->dev_limit > 0 && !target_held(tl, rank, dev) && tl->counts[target_slot(tl, dev)] >= tl->dev_limit) {
+        return 0;
+    }
+    return 1;
 }
 
+/**
+* Records that an item went in the batch of a rank.
+*
+* @param tl		the target limits
+* @param rank		the rank the batch is for
+* @param item		the item
+*/
+void target_take(target_limits *tl, int rank, path_item *item) {
+    size_t keys[2];
+    int i;
 
-void print_queue_path(path_list *head) {
-    //print the entire queue
-    while(head != NULL) {
-        printf("%s\n", head->data.path);
-        head = head->next;
+    if (tl->size == 0) {
+        return;
     }
-}
-
-void delete_queue_path(path_list **head, int *count) {
-    //delete the entire queue;
-    path_list *temp = *head;
-    while(temp) {
-        *head = (*head)->next;
-        free(temp);
-        temp = *head;
+    target_keys(item, &keys[0], &keys[1]);
+    for (i = 0; i < 2; i++) {
+        if (keys[i] == 0 || target_held(tl, rank, keys[i])) {
+            continue;
+        }
+        if (tl->nheld[rank] == tl->held_size[rank]) {
+            tl->held_size[rank] = (tl->held_size[rank])?2*tl->held_size[rank]:16;
+            tl->held[rank] = (size_t *) realloc(tl->held[rank], tl->held_size[rank] * sizeof(size_t));
+        }
+        tl->held[rank][tl->nheld[rank]++] = keys[i];
+        target_add(tl, keys[i]);
     }
-    *count = 0;
 }
 
-void enqueue_node(path_list **head, path_list **tail, path_list *new_node, int *count) {
-    //enqueue a node using an existing node (does a new allocate, but allows us to pass nodes instead of paths)
-    path_list *temp_node = malloc(sizeof(path_list));
-    temp_node->data = new_node->data;
-    temp_node->next = NULL;
-    if (*head == NULL) {
-        *head = temp_node;
-        *tail = *head;
+/**
+* Records that a rank finished its batch, so its targets have
+* one batch less in flight.
+*
+* @param tl		the target limits
+* @param rank		the rank
+*/
+void target_done(target_limits *tl, int rank) {
+    int i;
+
+    if (tl->size == 0) {
+        return;
     }
-    else {
-        (*tail)->next = temp_node;
-        *tail = (*tail)->next;
+    for (i = 0; i < tl->nheld[rank]; i++) {
+        tl->counts[target_slot(tl, tl->held[rank][i])]--;
     }
-    *count += 1;
+    tl->nheld[rank] = 0;
 }
 
-
-void dequeue_node(path_list **head, path_list **tail, int *count) {
-    //remove a path from the front of the queue
-    path_list *temp_node = *head;
-    if (temp_node == NULL) {
+/**
+* Sets up the manager's control of the number of ranks copying.
+*
+* @param cw		the copy window to set up
+* @param nproc		the number of ranks
+* @param o		the options of the run (the starting window)
+*/
+void init_copy_window(copy_window *cw, int nproc, struct options o) {
+    memset(cw, 0, sizeof(copy_window));
+    cw->num_workers = nproc - START_PROC;
+    if (o.copy_window < 0) {
         return;
     }
-    *head = temp_node->next;
-    free(temp_node);
-    *count -= 1;
+    cw->window = (o.copy_window > 0 && o.copy_window < cw->num_workers)?o.copy_window:cw->num_workers;
+    cw->low = cw->window;
+    cw->high = cw->window;
+    cw->copying = (int *) calloc(nproc, sizeof(int));
+    cw->start = (double *) calloc(nproc, sizeof(double));
+    cw->bytes = (size_t *) calloc(nproc, sizeof(size_t));
+    cw->items = (int *) calloc(nproc, sizeof(int));
+    cw->started = batch_now();
+    cw->last_tune = cw->started;
 }
 
+void free_copy_window(copy_window *cw) {
+    free(cw->copying);
+    free(cw->start);
+    free(cw->bytes);
+    free(cw->items);
+}
 
-void enqueue_buf_list(work_buf_list **workbuflist, int *workbufsize, char *buffer, int buffer_size) {
-    work_buf_list *current_pos = *workbuflist;
-    work_buf_list *new_buf_item = malloc(sizeof(work_buf_list));
-    if (*workbufsize < 0) {
-        *workbufsize = 0;
+/**
+* Gets the number of ranks that may still be handed copy work.
+*
+* @param cw		the copy window
+*
+* @return the number of ranks
+*/
+int copy_room(copy_window *cw) {
+    if (cw->window == 0) {
+        return cw->num_workers + 1;
     }
-    new_buf_item->buf = buffer;
-    new_buf_item->size = buffer_size;
-    new_buf_item->next = NULL;
-    if (current_pos == NULL) {
-        *workbuflist = new_buf_item;
-        (*workbufsize)++;
+    return (cw->copiers < cw->window)?cw->window - cw->copiers:0;
+}
+
+/**
+* Records that a rank was handed copy work.
+*
+* @param cw		the copy window
+* @param rank		the rank
+* @param bytes		the bytes in its batch
+* @param items		the files/chunks in its batch
+*/
+void copy_started(copy_window *cw, int rank, size_t bytes, int items) {
+    if (cw->window == 0) {
         return;
     }
-    while (current_pos->next != NULL) {
-        current_pos = current_pos->next;
+    if (!cw->copying[rank]) {
+        cw->copying[rank] = 1;
+        cw->copiers++;
+    }
+    cw->start[rank] = batch_now();
+    cw->bytes[rank] = bytes;
+    cw->items[rank] = items;
+    if (cw->copiers >= cw->window) {
+        cw->full = 1;
     }
-    current_pos->next = new_buf_item;
-    (*workbufsize)++;
 }
 
-void dequeue_buf_list(work_buf_list **workbuflist, int *workbufsize) {
-    work_buf_list *current_pos;
-    if (*workbuflist == NULL) {
+/**
+* Records that a copier handed the tail of its chunk back to
+* the queue. The bytes of the tail are counted by the rank that
+* copies it, not by this one.
+*
+* @param cw		the copy window
+* @param rank		the copier
+* @param bytes		bytes of the tail
+*/
+void copy_returned(copy_window *cw, int rank, size_t bytes) {
+    if (cw->window == 0 || !cw->copying[rank]) {
         return;
     }
-    current_pos = (*workbuflist)->next;
-    free((*workbuflist)->buf);
-    free(*workbuflist);
-    *workbuflist = current_pos;
-    (*workbufsize)--;
+    cw->bytes[rank] -= (bytes < cw->bytes[rank])?bytes:cw->bytes[rank];
 }
 
-void delete_buf_list(work_buf_list **workbuflist, int *workbufsize) {
-    while (*workbuflist) {
-        dequeue_buf_list(workbuflist, workbufsize);
+/**
+* Records that a rank finished its work. If it was copying, the
+* bytes and time of its batch are counted.
+*
+* @param cw		the copy window
+* @param rank		the rank
+*/
+void copy_done(copy_window *cw, int rank) {
+    if (cw->window == 0 || !cw->copying[rank]) {
+        return;
     }
-    *workbufsize = 0;
+    cw->copying[rank] = 0;
+    cw->copiers--;
+    cw->done_bytes += cw->bytes[rank];
+    cw->done_items += cw->items[rank];
+    cw->busy_secs += batch_now() - cw->start[rank];
+    cw->done_batches++;
+}
+
+/**
+* Adjusts the number of ranks copying at once, every
+* AIMD_INTERVAL seconds, from the batches done in that time:
+*   - the rate of one rank is the bytes of the batches over
+*     the time they took, and its latency the time they took
+*     per file/chunk. The best of each is kept, and fades
+*   - the best values only compare like batches: when the mean
+*     bytes per file/chunk moves by AIMD_MIX (e.g. from big
+*     chunks to small files) they start over from this interval
+*   - if the rate of a rank fell under AIMD_SLOWDOWN of the best
+*     and its latency grew past the best over AIMD_SLOWDOWN, and
+*     neither total rate (bytes or files) grew by AIMD_GAIN, more
+*     ranks only made each copy slower: the window is cut to
+*     AIMD_DECREASE of its size
+*   - otherwise, if the window was full, it grows by one
+* Ranks outside the window stay idle, or walk.
+*
+* @param cw		the copy window
+* @param verbose	1 -> every change is written to the output
+*/
+void tune_copy_window(copy_window *cw, int verbose) {
+    char message[MESSAGESIZE];
+    double now = batch_now();
+    double rate, item_rate, rank_rate, latency, mix;
+    int old = cw->window;
+    int like;
+
+    if (cw->window == 0 || now - cw->last_tune < AIMD_INTERVAL) {
+        return;
+    }
+    if (cw->done_batches == 0 || cw->busy_secs <= 0.0 || cw->done_items <= 0.0) {
+        cw->last_tune = now;
+        return;
+    }
+    rate = cw->done_bytes/(now - cw->last_tune);
+    item_rate = cw->done_items/(now - cw->last_tune);
+    rank_rate = cw->done_bytes/cw->busy_secs;
+    latency = cw->busy_secs/cw->done_items;
+    mix = cw->done_bytes/cw->done_items;
+    like = (cw->prev_mix > 0.0 && mix < AIMD_MIX*cw->prev_mix && mix*AIMD_MIX > cw->prev_mix);
+    if (like) {
+        cw->best_rate *= AIMD_DECAY;
+        cw->best_latency /= AIMD_DECAY;
+        if (rank_rate > cw->best_rate) {
+            cw->best_rate = rank_rate;
+        }
+        if (latency < cw->best_latency) {
+            cw->best_latency = latency;
+        }
+    }
+    else {								// the first interval, or other work than before
+        if (cw->prev_mix > 0.0) {
+            cw->mix_changes++;
+        }
+        cw->best_rate = rank_rate;
+        cw->best_latency = latency;
+    }
+    if (like && rank_rate < AIMD_SLOWDOWN*cw->best_rate && latency*AIMD_SLOWDOWN > cw->best_latency &&
+        rate < (1.0 + AIMD_GAIN)*cw->prev_rate && item_rate < (1.0 + AIMD_GAIN)*cw->prev_item_rate && cw->window > 1) {
+        cw->window = (int)(cw->window * AIMD_DECREASE);
+        if (cw->window < 1) {
+            cw->window = 1;
+        }
+        cw->decreases++;
+    }
+    else if (cw->full && cw->window < cw->num_workers) {
+        cw->window++;
+        cw->increases++;
+    }
+    if (cw->window < cw->low) cw->low = cw->window;
+    if (cw->window > cw->high) cw->high = cw->window;
+    if (verbose && cw->window != old) {
+        sprintf(message, "INFO  AIMD     %6.0fs  copy window %d -> %d  (total %.1f MB/s %.0f files/s, per rank %.1f MB/s %.1f ms/file, best %.1f MB/s %.1f ms/file)\n",
+                now - cw->started, old, cw->window, rate/1048576, item_rate, rank_rate/1048576, latency*1000, cw->best_rate/1048576, cw->best_latency*1000);
+        write_output(message, 1);
+    }
+    cw->prev_rate = rate;
+    cw->prev_item_rate = item_rate;
+    cw->prev_mix = mix;
+    cw->done_bytes = 0.0;
+    cw->done_items = 0.0;
+    cw->busy_secs = 0.0;
+    cw->done_batches = 0;
+    cw->full = (cw->copiers >= cw->window);
+    cw->last_tune = now;
 }
 
 void pack_list(path_list *head, int count, work_buf_list **workbuflist, int *workbufsize) {
@@ -1476,6 +3798,58 @@ void pack_list(path_list *head, int count, work_buf_list **workbuflist, int *wor
     enqueue_buf_list(workbuflist, workbufsize, buffer, buffer_size);
 }
 
+/**
+* Splits a -i file list into ranges, one per DIRCMD buffer,
+* for the workers to read in parallel. A text list (a path per
+* line) is split into FILELIST_RANGE byte ranges; the reader
+* of a range aligns it to lines (see read_list_range()). A
+* catalog directory (see -O) is split into ranges of the rows
+* of its shards, which already hold the stats of the paths.
+*
+* @param file_list	the list file, or catalog directory
+* @param workbuflist	gets the buffers
+* @param workbufsize	the number of buffers
+*
+* @return 0 on success, -1 if the list could not be read
+*/
+int pack_file_list(const char *file_list, work_buf_list **workbuflist, int *workbufsize) {
+    path_list range;
+    struct stat st;
+    int *ranks;
+    uint64_t *rows;
+    int nshards, i;
+    off_t off;
+
+    if (stat(file_list, &st) != 0) {
+        return -1;
+    }
+    memset(&range, 0, sizeof(path_list));
+    strncpy(range.data.path, file_list, PATHSIZE_PLUS);
+    if (!S_ISDIR(st.st_mode)) {
+        range.data.chkidx = FILELIST_TEXT;
+        for (off = 0; off == 0 || off < st.st_size; off += FILELIST_RANGE) {
+            range.data.chkoff = off;
+            range.data.chklen = (st.st_size - off < FILELIST_RANGE)?(st.st_size - off):FILELIST_RANGE;
+            pack_list(&range, 1, workbuflist, workbufsize);
+        }
+        return 0;
+    }
+    if ((nshards = read_catalog_manifest(file_list, &ranks, &rows)) < 0) {
+        return -1;
+    }
+    for (i = 0; i < nshards; i++) {
+        for (off = 0; off < rows[i]; off += CATALOG_RANGE) {
+            range.data.chkidx = ranks[i];
+            range.data.chkoff = off;
+            range.data.chklen = (rows[i] - off < CATALOG_RANGE)?(rows[i] - off):CATALOG_RANGE;
+            pack_list(&range, 1, workbuflist, workbufsize);
+        }
+    }
+    free(ranks);
+    free(rows);
+    return 0;
+}
+
 
 #ifdef THREADS_ONLY
 //custom MPI calls
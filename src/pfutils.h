@@ -39,6 +39,7 @@
 #include <utime.h>
 
 #include "str.h"
+#include "filter.h"
 
 //mpi
 #include "mpi.h"
@@ -83,10 +84,37 @@
 
 #define DIRBUFFER 5
 #define STATBUFFER 50
-#define COPYBUFFER 15
-#define CHUNKBUFFER COPYBUFFER
+#define NAMEBUFFER 500				// names per batch handed off from a large directory
+#define SPLITDIR_AT 100000			// default number of entries of a directory stat'ed by the rank reading it (-u)
+#define READDIR_BUFSIZE 1048576			// buffer for getdents64() (1 MB)
+#define FILELIST_RANGE 8388608			// bytes of a -i list file read by one rank at a time (8 MB)
+#define FILELIST_TEXT -1			// chkidx of a range of a -i list file. Ranges of a catalog have its shard
+#define BATCH_SECS 1.0				// adaptive batches aim at this much work per batch (seconds)
+#define BATCH_GROWTH 4				// adaptive batch sizes grow to at most default*BATCH_GROWTH (see tune_batch_sizes())
+#define BATCH_INTERVAL 1.0			// seconds between batch size adjustments
+#define FLOW_INTERVAL 10.0			// seconds between reports of the queue depths (-Q)
+#define AIMD_INTERVAL 2.0			// seconds between adjustments of the number of ranks copying (-K)
+#define AIMD_DECREASE 0.7			// the number of ranks copying is cut to this share when copies slow down
+#define AIMD_SLOWDOWN 0.5			// copies slowed down: the rate of a rank fell under this share of the best seen ...
+#define AIMD_GAIN 0.05				// ... and the total rate did not grow by this share
+#define AIMD_DECAY 0.98				// the best rate and latency of a rank seen fade by this much per adjustment
+#define AIMD_MIX 4.0				// the batch mix changed: the mean bytes per file/chunk moved by this factor
+#define QUEUE_SCAN 64				// items of a bucket of the copy queue passed over for work a rank may not take (-N, -J)
+#define COPYBUFFER 15				// default most items in a copy batch (-Y)
+#define COPYBYTES 524288000			// default bytes in a copy batch (-y). 500 MB
+#define SIZE_BUCKETS 64				// buckets of the copy queue. Bucket n holds items of 2^(n-1) to 2^n-1 bytes
 #define TAPEBUFFER 5
 
+#define SMALLFILE_SIZE 65536			// files at or below this size are copied with the small-file path
+#define SMALL_CHOWN 1				// copy_small_file() failed to set the owner of the copy
+#define SMALL_CHMOD 2				// copy_small_file() failed to set the mode of the copy
+#define SMALL_UTIME 4				// copy_small_file() failed to set the times of the copy
+
+#define BLOCKSIZE_SAMPLE 268435456		// bytes to copy at one block size before comparing throughput (256 MB)
+
+#define CHUNK_RATE_GUESS 104857600		// assumed copy rate of a worker (bytes/sec) until one has been measured
+#define CHUNK_MIN 67108864			// smallest chunk the chunk planner will make (64 MB)
+
 #define ANYFS     0
 #define PANASASFS 1
 #define GPFSFS    2
@@ -103,9 +131,15 @@
 #define EXT3_FILE        0xEF53
 #define EXT4_FILE        0xEF53
 #define PNFS_FILE        0X00000000
+#define LUSTRE_FILE      0x0BD00BD0
+#define NFS_FILE         0x6969
+#define XFS_FILE         0x58465342
+#define TMPFS_FILE       0x01021994
 #define ANY_FILE         0X00000000
 
 #define O_CONCURRENT_WRITE          020000000000
+#define DIRECTIO_ALIGN 4096			// buffer, offset and size alignment for O_DIRECT transfers
+#define NUM_FS_PROFILES 16			// room for built-in and configured file system profiles
 
 #define DevMinor(x) ((x)&0xFFFF)
 #define DevMajor(x) ((unsigned)(x)>>16)
@@ -132,7 +166,11 @@ enum cmd_opcode {
     NONFATALINCCMD,
     CHUNKBUSYCMD,
     COPYSTATSCMD,
-    EXAMINEDSTATSCMD
+    EXAMINEDSTATSCMD,
+    PLANINFOCMD,
+    SPLITCMD,
+    BATCHSIZECMD,
+    RATECMD
 };
 
 
@@ -149,7 +187,9 @@ enum cmd_opcode {
 enum wrk_type {
     COPYWORK,
     LSWORK,
-    COMPAREWORK
+    COMPAREWORK,
+    QUERYWORK,
+    DUWORK
 };
 
 enum filetype {
@@ -163,6 +203,30 @@ enum filetype {
 };
 
 //Structs and typedefs
+// I/O tuning for a type of file system. Selected by statfs magic, or by name with -t
+struct fs_profile {
+    char name[32];					// file system type, as reported by "df -T"
+    long magic;						// statfs f_type. 0 -> the default profile
+    size_t blocksize;					// block size for copy and compare
+    size_t chunk_at;					// file size to start chunking
+    size_t chunksize;					// chunk size for copy
+    int concurrent_write;				// 1 -> chunks are written with O_CONCURRENT_WRITE
+    size_t direct_io_at;				// transfers of at least this size are written with O_DIRECT. 0 -> never
+    int io_threads;					// concurrent small-file copies per worker
+    int stat_threads;					// concurrent stats per worker while walking the tree (from the source's profile)
+    char ctm[8];					// where CTM is kept: "xattr", "file" or "auto"
+};
+typedef struct fs_profile fs_profile;
+
+// Sizes of the batches work is shipped in. Tuned by the manager at runtime
+struct batch_sizes {
+    int dir;						// directories per DIRCMD (was DIRBUFFER)
+    int stat;						// directory entries stat'ed before they are processed (was STATBUFFER)
+    int copy;						// most files/chunks per COPYCMD or COMPARECMD
+    int message;					// output lines per message (was MESSAGEBUFFER)
+};
+typedef struct batch_sizes batch_sizes;
+
 //options{
 struct options {
     int verbose;
@@ -174,8 +238,38 @@ struct options {
     int work_type;
     int meta_data_only;
     size_t blocksize;
+    size_t min_blocksize;				// lower limit for adaptive block sizes. 0 -> adaptive block sizes are off
+    size_t max_blocksize;				// upper limit for adaptive block sizes
     size_t chunk_at;
     size_t chunksize;
+    int chunk_secs;					// target time to copy one chunk. 0 -> fixed chunksize
+    size_t split_at;					// smallest tail of a chunk that is handed off to an idle worker. 0 -> no splitting
+    size_t batch_bytes;					// a copy batch is cut at this many bytes ...
+    int batch_count;					// ... or at this many items
+    int fixed_batches;					// 1 -> do not tune batch sizes at runtime
+    int split_dir;					// entries of a directory past this many are handed to other ranks to stat. 0 -> never
+    int dest_listing;					// 1 -> look destinations up in listings of their directories (-L)
+    char snapshot[PATHSIZE_PLUS];			// tree snapshot directory (-I). "" -> none
+    int snapshot_filter;				// 1 -> files unchanged since the last snapshot are not processed
+    char catalog[PATHSIZE_PLUS];			// metadata catalog directory (-O). "" -> none
+    filter filter;					// entries a query selects (-e)
+    int du_depth;					// usage totals of directories down to this depth (-m). < 0 -> none
+    char histogram[PATHSIZE_PLUS];			// where histograms go (-H): a CSV file, or "-" to print them. "" -> none
+    char plan[PATHSIZE_PLUS];				// plan directory the copy work is written to, instead of copying (-g). "" -> none
+    char run_plan[PATHSIZE_PLUS];			// plan directory whose copy work is done, instead of walking (-G). "" -> none
+    size_t queue_memory;				// bytes of queued work the manager keeps in memory. Past it, queues spill to files (-q). 0 -> no limit
+    size_t backlog_high;				// copy backlog (bytes) at which the walk stops (-Q). 0 -> no limit
+    size_t backlog_low;					// ... and below which it goes at full speed again
+    int backlog_high_items;				// the same, in files/chunks. 0 -> no limit
+    int backlog_low_items;
+    double locality_wait;				// seconds a free rank waits for copy work found on its node (-N). < 0 -> no locality
+    int dir_limit;					// most copy batches in flight per destination directory (-J). 0 -> no limit
+    int dev_limit;					// most copy batches in flight per source device (-J). 0 -> no limit
+    int copy_window;					// ranks copying at the start, tuned by AIMD (-K). 0 -> all workers. < 0 -> no limit
+    double rate_bytes;					// bytes/second the job may copy (-R). 0 -> no limit
+    double rate_ops;					// files/chunks per second the job may copy (-R). 0 -> no limit
+    char rate_control[PATHSIZE_PLUS];			// file the rates are changed in at runtime (-U). "" -> none
+    batch_sizes batch;					// current batch sizes
     char file_list[PATHSIZE_PLUS];
     int use_file_list;
     char jid[128];
@@ -196,6 +290,10 @@ struct options {
     //fs info
     int sourcefs;
     int destfs;
+
+    int io_threads;					// number of concurrent small-file operations in a copy worker
+    int stat_threads;					// number of concurrent stats in a worker walking the tree
+    fs_profile dest_profile;				// tuning profile of the destination file system
 };
 
 
@@ -205,9 +303,12 @@ struct path_link {
     struct stat st;					// stat info of file/directory
     int chkidx;						// the chunk index or number of the chunk being processed
     off_t chksz;					// the tranfer chunk size of the file. For non-chunked file, this is the tranfer length or file length
+    off_t chkoff;					// offset of a split piece from the start of its chunk
+    off_t chklen;					// length of a split piece of the chunk. 0 -> the whole chunk
     enum filetype ftype;				// the "type" of the source file. Type is influenced by where/what the source is stored
     enum filetype desttype;				// the "type" of the destination file
     char fstype[128];					// the file system type of the source file
+    int origin;						// the rank that sent the item to the manager, as copy work
 };
 typedef struct path_link path_item;
 
@@ -219,12 +320,170 @@ struct path_queue {
 typedef struct path_queue path_list;
 
 struct work_buffer_list {
-    char *buf;
+    char *buf;						// NULL while spilled
     int size;
+    int seg;						// segment file the buffer was spilled to. -1 -> in memory (see spill.h)
+    off_t off;						// its offset in the segment
     struct work_buffer_list *next;
 };
 typedef struct work_buffer_list work_buf_list;
 
+// The manager's queue of copy (or compare) work. Items are kept in buckets by the number of
+// bytes they move, so that batches can be handed out biggest first.
+struct size_queue {
+    path_list *head[SIZE_BUCKETS];
+    path_list *tail[SIZE_BUCKETS];
+    int bucket_count[SIZE_BUCKETS];
+    int size;						// number of items in the queue
+    size_t bytes;					// number of bytes the items move
+    work_buf_list *spill;				// buffers queued past the memory budget, not yet in buckets
+    int spill_count;					// number of those buffers
+    int spilled;					// number of items in them
+    struct locality *loc;				// counts the items found on each node (-N). NULL -> not counted
+};
+typedef struct size_queue size_queue;
+
+// The manager's state for tuning batch sizes
+struct batch_control {
+    batch_sizes sizes;					// current batch sizes
+    batch_sizes low, high;				// range of sizes used, for the statistics
+    int version;					// bumped on every change of sizes
+    int *sent;						// version of the sizes each rank has
+    double *start;					// when each rank got its current batch
+    int *items;						// number of items in that batch
+    int *kind;						// DIRCMD, COPYCMD or COMPARECMD. 0 -> not measured
+    double dir_secs;					// measured seconds per directory
+    double copy_secs;					// measured seconds per file/chunk copied or compared
+    double last_tune;					// time of the last adjustment
+};
+typedef struct batch_control batch_control;
+
+// The manager's state for keeping the copy backlog between watermarks (-Q)
+struct flow_control {
+    size_t high_bytes, low_bytes;			// watermarks of the backlog. high 0 -> none
+    int high_items, low_items;
+    int num_workers;
+    int *walking;					// 1 -> the rank is reading directories or stat'ing
+    int walkers;					// number of ranks walking
+    int throttled;					// 1 -> the backlog went over a high watermark, and is not under the low ones yet
+    int throttles;					// times the walk was stopped
+    double throttled_at;				// when it was stopped last
+    double throttled_secs;				// seconds the walk was stopped
+    double started;
+    double last_report;
+};
+typedef struct flow_control flow_control;
+
+// The manager's state for handing copy work to ranks on the node that found it (-N)
+struct locality {
+    double wait;					// seconds a free rank waits for work found on its node. < 0 -> off
+    int ranks;
+    int *node;						// node of each rank
+    int nodes;						// number of nodes
+    double *idle_since;					// when each free rank started to wait. 0 -> not waiting
+    int *queued;					// items in the copy queue found on each node
+    int queued_any;					// items in the copy queue with no known origin
+    size_t local;					// items sent to a rank on the node that found them
+    size_t remote;					// items sent elsewhere
+};
+typedef struct locality locality;
+
+// The manager's count of copy batches in flight per target: destination
+// directory or source device (-J)
+struct target_limits {
+    int dir_limit;					// most batches per directory. 0 -> no limit
+    int dev_limit;					// most batches per device. 0 -> no limit
+    size_t *keys;					// targets in flight, hashed with open addressing. 0 -> empty slot
+    int *counts;					// batches in flight on each
+    size_t size;					// number of slots, a power of 2
+    size_t used;					// number of slots in use, also by targets with no batches left
+    size_t **held;					// targets of the batch of each rank
+    int *nheld;
+    int *held_size;
+    int nproc;
+    size_t held_back;					// times a free rank got no work because of the limits
+};
+typedef struct target_limits target_limits;
+
+// The manager's control of the number of ranks copying at once, with
+// additive increase and multiplicative decrease (-K)
+struct copy_window {
+    int window;						// most ranks copying at once. 0 -> no limit
+    int low, high;					// range of the window, for the footer
+    int num_workers;
+    int *copying;					// 1 -> the rank has copy or compare work
+    int copiers;					// number of ranks copying
+    double *start;					// when each copier got its batch
+    size_t *bytes;					// bytes in that batch
+    int *items;						// files/chunks in that batch
+    double done_bytes;					// bytes of the batches done since the last adjustment
+    double done_items;					// files/chunks of those batches
+    double busy_secs;					// time those batches took
+    int done_batches;
+    int full;						// 1 -> the window was full since the last adjustment
+    double prev_rate;					// total rate of the last interval (bytes/second)
+    double prev_item_rate;				// total rate of the last interval (files/chunks per second)
+    double prev_mix;					// mean bytes per file/chunk of the last interval
+    double best_rate;					// best rate of one rank seen (bytes/second)
+    double best_latency;				// best time of one rank per file/chunk seen (seconds)
+    int mix_changes;					// times the best values were reset because the batch mix changed
+    double started;
+    double last_tune;
+    int increases, decreases;
+};
+typedef struct copy_window copy_window;
+
+// An open directory, kept so that files in it can be opened and stat'ed relative to it
+struct dir_handle {
+    char path[PATHSIZE_PLUS];				// path of the open directory
+    int fd;						// directory file descriptor. -1 if nothing is open
+};
+typedef struct dir_handle dir_handle;
+
+// A directory read in large batches with getdents64()
+struct dir_stream {
+    int fd;						// the open directory
+    char *buf;						// raw entries, as returned by getdents64()
+    int len;						// bytes of entries in buf
+    int pos;						// offset of the next entry in buf
+};
+typedef struct dir_stream dir_stream;
+
+// A set of names, hashed with open addressing
+struct name_set {
+    char **slots;					// NULL -> empty slot
+    size_t size;					// number of slots, a power of 2
+    size_t count;					// number of names in the set
+};
+typedef struct name_set name_set;
+
+#define DEST_FRESH_MAX 4096				// most directories kept in dest_cache.fresh. Past it the set starts over
+
+// Per worker cache of destination directories, so that the existence
+// of destinations is decided from memory instead of a lookup per file
+struct dest_cache {
+    int listing;					// 1 -> read destination directories into names (-L)
+    name_set fresh;					// directories this rank created in this run. They were empty
+    char dir[PATHSIZE_PLUS];				// the directory held in names. "" -> none
+    name_set names;					// the names in dir
+    int listed;						// 1 -> names holds all of dir. 0 -> it could not be read
+};
+typedef struct dest_cache dest_cache;
+
+// Per worker state for picking the block size of copies
+struct blocksize_policy {
+    size_t min;						// limits for the block size
+    size_t max;
+    size_t preferred;					// preferred I/O size of the destination (st_blksize). 0 if unknown
+    size_t current;					// block size currently used for large transfers
+    size_t prev;					// last block size measured, and its throughput
+    double prev_rate;
+    int direction;					// 1 -> growing the block size, -1 -> shrinking it
+    size_t sample_bytes;				// bytes and time measured at the current block size
+    double sample_secs;
+};
+typedef struct blocksize_policy blocksize_policy;
+
 //Function Declarations
 void usage();
 char *printmode (mode_t aflag, char *buf);
@@ -235,12 +494,37 @@ int one_byte_read(const char *path);
 ssize_t write_field(int fd, void *start, size_t len);
 int mkpath(char *thePath, mode_t perms);
 #ifdef GEN_SYNDATA
-int copy_file(path_item src_file, path_item dest_file, size_t blocksize, syndata_buffer *synbuf, int rank);
+int copy_file(path_item src_file, path_item dest_file, size_t blocksize, syndata_buffer *synbuf, fs_profile *profile, size_t split_at, path_item *tail, int rank);
 #else
-int copy_file(path_item src_file, path_item dest_file, size_t blocksize, int rank);
+int copy_file(path_item src_file, path_item dest_file, size_t blocksize, fs_profile *profile, size_t split_at, path_item *tail, int rank);
 #endif
 int compare_file(path_item src_file, path_item dest_file, size_t blocksize, int meta_data_only);
 int update_stats(path_item src_file, path_item dest_file);
+void init_dir_handle(dir_handle *dh);
+int open_dir_stream(dir_stream *ds, const char *path);
+char *read_dir_stream(dir_stream *ds, unsigned char *d_type, ino_t *d_ino);
+int walk_stat_at(int dirfd, const char *name, struct stat *st, struct options o);
+int close_dir_stream(dir_stream *ds);
+size_t name_hash(const char *name);
+void init_name_set(name_set *ns);
+int name_set_add(name_set *ns, const char *name);
+int name_set_has(name_set *ns, const char *name);
+void clear_name_set(name_set *ns);
+void init_dest_cache(dest_cache *dc, int listing);
+void dest_cache_created(dest_cache *dc, const char *path);
+int dest_may_exist(dest_cache *dc, const char *path);
+void free_dest_cache(dest_cache *dc);
+int get_dir_handle(dir_handle *dh, const char *path, const char **name);
+void close_dir_handle(dir_handle *dh);
+int is_small_file(path_item src_file);
+void get_chunk_range(path_item src_file, off_t *offset, off_t *length);
+int copy_small_file(path_item src_file, path_item dest_file, dir_handle *src_dir, dir_handle *dest_dir, char *buf, char *errormsg);
+void copy_small_files(path_item *src_files, path_item *dest_files, int count, int *rcs, char *errormsgs, int num_threads);
+void send_small_file_errors(int failed, path_item src_file, path_item dest_file);
+void init_blocksize_policy(blocksize_policy *bp, size_t preferred, struct options o);
+size_t pick_blocksize(blocksize_policy *bp, off_t length);
+size_t plan_chunk_size(size_t file_size, size_t max_chunksize, size_t align, int free_workers, double worker_rate, int target_secs);
+void record_blocksize_rate(blocksize_policy *bp, size_t blocksize, size_t bytes, double secs);
 
 //dmapi/gpfs specfic
 #ifdef TAPE
@@ -252,6 +536,7 @@ int dmapi_lookup (char *mypath, int *dmarray, char *dmouthexbuf);
 //local functions
 int request_response(int type_cmd);
 int request_input_queuesize();
+void request_chunk_plan_info(int *free_workers, double *worker_rate);
 char *cmd2str(enum cmd_opcode cmdidx);
 void send_command(int target_rank, int type_cmd);
 void send_path_list(int target_rank, int command, int num_send, path_list **list_head, path_list **list_tail, int *list_count);
@@ -268,6 +553,8 @@ int set_fuse_chunk_attr(const char *path, off_t offset, size_t length, struct ut
 #endif
 //void get_stat_fs_info(path_item *work_node, int *sourcefs, char *sourcefsc);
 void get_stat_fs_info(const char *path, int *fs);
+int load_fs_profiles(const char *cfgfile);
+fs_profile *find_fs_profile(const char *path, const char *name);
 int get_free_rank(int *proc_status, int start_range, int end_range);
 int processing_complete(int *proc_status, int nproc);
 
@@ -280,7 +567,7 @@ void send_manager_tape_buffer(path_item *buffer, int *buffer_count);
 void send_manager_new_buffer(path_item *buffer, int *buffer_count);
 void send_manager_nonfatal_inc();
 void send_manager_chunk_busy();
-void send_manager_copy_stats(int num_copied_files, size_t num_copied_bytes);
+void send_manager_copy_stats(int num_copied_files, size_t num_copied_bytes, size_t min_blocksize, size_t max_blocksize, size_t blocked_bytes, double blocksize_bytes);
 void send_manager_examined_stats(int num_examined_files, size_t num_examined_bytes, int num_examined_dirs);
 void send_manager_tape_stats(int num_examined_tapes, size_t num_examined_tape_bytes);
 void send_manager_work_done();
@@ -290,12 +577,45 @@ void update_chunk(path_item *buffer, int *buffer_count);
 void write_output(char *message, int log);
 void write_buffer_output(char *buffer, int buffer_size, int buffer_count);
 void send_worker_queue_count(int target_rank, int queue_count);
+void send_worker_plan_info(int target_rank, int free_workers, double worker_rate);
+void send_worker_split(int target_rank);
+void send_worker_batch_sizes(int target_rank, batch_sizes *sizes);
+void init_batch_control(batch_control *bc, int nproc, batch_sizes *sizes);
+void free_batch_control(batch_control *bc);
+void batch_sync(batch_control *bc, int rank);
+void batch_started(batch_control *bc, int rank, int kind, int items);
+void batch_done(batch_control *bc, int rank);
+void tune_batch_sizes(batch_control *bc, int dir_depth, int copy_depth, int idle_ranks, int num_workers, int copy_count);
+int parse_backlog_marks(const char *spec, struct options *o);
+void init_flow_control(flow_control *fc, int nproc, struct options o);
+void free_flow_control(flow_control *fc);
+int flow_may_walk(flow_control *fc, size_t backlog_bytes, int backlog_items);
+void flow_started(flow_control *fc, int rank, int kind);
+void flow_done(flow_control *fc, int rank);
+void flow_report(flow_control *fc, int dir_depth, int stat_depth, size_t backlog_bytes, int backlog_items, int busy_ranks);
+void init_locality(locality *loc, int rank, int nproc, double wait);
+void free_locality(locality *loc);
+int get_local_rank(int *proc_status, locality *loc, int start_range, int end_range, int *local_only);
+int parse_target_limits(const char *spec, struct options *o);
+void init_target_limits(target_limits *tl, int nproc, struct options o);
+void free_target_limits(target_limits *tl);
+int target_may_take(target_limits *tl, int rank, path_item *item);
+void target_take(target_limits *tl, int rank, path_item *item);
+void target_done(target_limits *tl, int rank);
+void init_copy_window(copy_window *cw, int nproc, struct options o);
+void free_copy_window(copy_window *cw);
+int copy_room(copy_window *cw);
+void copy_started(copy_window *cw, int rank, size_t bytes, int items);
+void copy_returned(copy_window *cw, int rank, size_t bytes);
+void copy_done(copy_window *cw, int rank);
+void tune_copy_window(copy_window *cw, int verbose);
 void send_worker_readdir(int target_rank, work_buf_list  **workbuflist, int *workbufsize);
+void send_worker_stat_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize);
 #ifdef TAPE
 void send_worker_tape_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize);
 #endif
-void send_worker_copy_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize);
-void send_worker_compare_path(int target_rank, work_buf_list  **workbuflist, int *workbufsize);
+int send_worker_copy_path(int target_rank, size_queue *queue, size_t batch_bytes, int batch_count, locality *loc, int local_only, target_limits *tl);
+int send_worker_compare_path(int target_rank, size_queue *queue, size_t batch_bytes, int batch_count, locality *loc, int local_only, target_limits *tl);
 void send_worker_exit(int target_rank);
 
 //function definitions for queues
@@ -305,12 +625,17 @@ void delete_queue_path(path_list **head, int *count);
 void enqueue_node(path_list **head, path_list **tail, path_list *new_node, int *count);
 void dequeue_node(path_list **head, path_list **tail, int *count);
 void pack_list(path_list *head, int count, work_buf_list **workbuflist, int *workbufsize);
+int pack_file_list(const char *file_list, work_buf_list **workbuflist, int *workbufsize);
 
 
 //function definitions for workbuf_list;
 void enqueue_buf_list(work_buf_list **workbuflist, int *workbufsize, char *buffer, int buffer_size);
 void dequeue_buf_list(work_buf_list **workbuflist, int *workbufsize);
 void delete_buf_list(work_buf_list **workbuflist, int *workbufsize);
+void init_size_queue(size_queue *queue);
+void enqueue_size_queue(size_queue *queue, char *buffer, int buffer_size);
+int send_size_queue(int target_rank, int command, size_queue *queue, size_t batch_bytes, int batch_count, locality *loc, int local_only, target_limits *tl);
+void delete_size_queue(size_queue *queue);
 
 //fake mpi
 int MPY_Pack(void *inbuf, int incount, MPI_Datatype datatype, void *outbuf, int outcount, int *position, MPI_Comm comm);
@@ -0,0 +1,374 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+/**
+* Implements copy plans (see plan.h)
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "plan.h"
+
+#define PLAN_WRITE_BUFFER 1048576			// stdio buffer of each file being written
+
+/**
+* Sets up a plan directory for a plan-only run: creates it
+* if needed, and removes the manifest of the last plan
+* written there, so that it is not run with new shards.
+* Called by the manager before the walk.
+*
+* @param dir		the plan directory
+*
+* @return 0 on success, -1 on failure
+*/
+int prepare_plan(const char *dir) {
+    char file[PATHSIZE_PLUS];
+
+    if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(file, PATHSIZE_PLUS, "%s/%s", dir, PLAN_MANIFEST);
+    if (unlink(file) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Initializes this rank's shard of a plan. Nothing is
+* written until the first record.
+*
+* @param p		the shard to initialize
+* @param dir		the plan directory. "" -> no plan
+* @param rank		the rank of the worker
+*/
+void init_plan(work_plan *p, const char *dir, int rank) {
+    memset(p, 0, sizeof(work_plan));
+    strncpy(p->dir, dir, PATHSIZE_PLUS);
+    p->dir[PATHSIZE_PLUS-1] = '\0';
+    p->rank = rank;
+}
+
+/**
+* Adds the copy of a file, or of a chunk of one, to this
+* rank's shard of a plan.
+*
+* @param p		the shard
+* @param item		the work item, as it would be sent to
+* 			the manager
+*/
+void plan_add(work_plan *p, path_item *item) {
+    char file[PATHSIZE_PLUS];
+    plan_record r;
+    size_t pathlen = strlen(item->path) + 1;
+    int n = 0;
+
+    if (!p->dir[0] || p->failed) {
+        return;
+    }
+    if (p->items == NULL) {
+        snprintf(file, PATHSIZE_PLUS, "%s/shard.%d.item", p->dir, p->rank);
+        p->items = fopen(file, "w");
+        snprintf(file, PATHSIZE_PLUS, "%s/shard.%d.path", p->dir, p->rank);
+        p->paths = fopen(file, "w");
+        if (p->items == NULL || p->paths == NULL) {
+            errsend(NONFATAL, "Failed to open plan shard");
+            p->failed = 1;
+            return;
+        }
+        setvbuf(p->items, NULL, _IOFBF, PLAN_WRITE_BUFFER);
+        setvbuf(p->paths, NULL, _IOFBF, PLAN_WRITE_BUFFER);
+    }
+    memset(&r, 0, sizeof(plan_record));
+    r.ino = item->st.st_ino;
+    r.size = item->st.st_size;
+    r.blocks = item->st.st_blocks;
+    r.mtime = item->st.st_mtim.tv_sec;
+    r.mtime_nsec = item->st.st_mtim.tv_nsec;
+    r.atime = item->st.st_atim.tv_sec;
+    r.atime_nsec = item->st.st_atim.tv_nsec;
+    r.uid = item->st.st_uid;
+    r.gid = item->st.st_gid;
+    r.mode = item->st.st_mode;
+    r.chkidx = item->chkidx;
+    r.chksz = item->chksz;
+    r.ftype = item->ftype;
+    r.desttype = item->desttype;
+    if (p->count == 0 || strncmp(p->last, item->path, PATHSIZE_PLUS)) {	// chunks of a file only need their path once
+        r.flags |= PLAN_FIRST;
+        strncpy(p->last, item->path, PATHSIZE_PLUS);
+        p->last[PATHSIZE_PLUS-1] = '\0';
+        p->lastoff = p->heap;
+        n += fwrite(item->path, pathlen, 1, p->paths);
+        p->heap += pathlen;
+    }
+    else {
+        n++;
+    }
+    r.pathoff = p->lastoff;
+    n += fwrite(&r, sizeof(plan_record), 1, p->items);
+    if (n != 2) {
+        errsend(NONFATAL, "Failed to write plan shard");
+        p->failed = 1;
+        return;
+    }
+    p->count++;
+}
+
+/**
+* Closes this rank's shard of a plan. Failures are returned,
+* for the manager to leave the manifest unwritten.
+*
+* @param p		the shard
+* @param count		gets the number of records written
+*
+* @return 0 on success, -1 if the shard could not be written
+*/
+int close_plan(work_plan *p, uint64_t *count) {
+    int rc = (p->failed)?-1:0;
+
+    if (p->items != NULL && fclose(p->items) != 0) {
+        rc = -1;
+    }
+    if (p->paths != NULL && fclose(p->paths) != 0) {
+        rc = -1;
+    }
+    p->items = NULL;
+    p->paths = NULL;
+    if (rc != 0) {
+        fprintf(stderr, "Failed to write plan shard %s/shard.%d\n", p->dir, p->rank);
+    }
+    *count = p->count;
+    return rc;
+}
+
+/**
+* Writes the manifest of a plan. Called by the manager once
+* every rank has closed its shard.
+*
+* @param dir		the plan directory
+* @param count		the records of each rank's shard. < 0 ->
+* 			the shard failed
+* @param nshards	the number of ranks
+*
+* @return 0 on success, -1 on failure
+*/
+int write_plan_manifest(const char *dir, const double *count, int nshards) {
+    char file[PATHSIZE_PLUS], tmp[PATHSIZE_PLUS];
+    FILE *fp;
+    int i;
+
+    for (i = 0; i < nshards; i++) {
+        if (count[i] < 0) {
+            return -1;
+        }
+    }
+    snprintf(file, PATHSIZE_PLUS, "%s/%s", dir, PLAN_MANIFEST);
+    snprintf(tmp, PATHSIZE_PLUS, "%s/%s.tmp", dir, PLAN_MANIFEST);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        return -1;
+    }
+    fprintf(fp, "%s\n", PLAN_VERSION);
+    for (i = 0; i < nshards; i++) {
+        if (count[i] > 0) {
+            fprintf(fp, "shard %d %.0f\n", i, count[i]);
+        }
+    }
+    if (fclose(fp) != 0) {
+        return -1;
+    }
+    return rename(tmp, file);
+}
+
+/**
+* Reads the manifest of a plan.
+*
+* @param dir		the plan directory
+* @param ranks		gets the ranks of the shards (free() it)
+* @param count		gets the records of the shards (free() it)
+*
+* @return the number of shards, or -1 if the manifest could
+* 	not be read
+*/
+int read_plan_manifest(const char *dir, int **ranks, uint64_t **count) {
+    char file[PATHSIZE_PLUS], line[256];
+    unsigned long long n;
+    FILE *fp;
+    int nshards = 0, size = 0, rank;
+
+    *ranks = NULL;
+    *count = NULL;
+    snprintf(file, PATHSIZE_PLUS, "%s/%s", dir, PLAN_MANIFEST);
+    if ((fp = fopen(file, "r")) == NULL) {
+        return -1;
+    }
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, PLAN_VERSION, strlen(PLAN_VERSION))) {
+        fclose(fp);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "shard %d %llu", &rank, &n) != 2) {
+            continue;
+        }
+        if (nshards == size) {
+            size = (size)?2*size:64;
+            *ranks = (int *) realloc(*ranks, size * sizeof(int));
+            *count = (uint64_t *) realloc(*count, size * sizeof(uint64_t));
+        }
+        (*ranks)[nshards] = rank;
+        (*count)[nshards] = n;
+        nshards++;
+    }
+    fclose(fp);
+    return nshards;
+}
+
+/**
+* Splits a plan into ranges of the records of its shards, one
+* per DIRCMD buffer: chkidx is the shard, chkoff the first
+* record and chklen the number of records. A range ends with
+* the records of the last file started in it (see plan.h).
+*
+* @param dir		the plan directory
+* @param workbuflist	gets the buffers
+* @param workbufsize	the number of buffers
+*
+* @return 0 on success, -1 if the manifest could not be read
+*/
+int pack_plan(const char *dir, work_buf_list **workbuflist, int *workbufsize) {
+    path_list range;
+    int *ranks;
+    uint64_t *count;
+    uint64_t off;
+    int nshards, i;
+
+    if ((nshards = read_plan_manifest(dir, &ranks, &count)) < 0) {
+        return -1;
+    }
+    memset(&range, 0, sizeof(path_list));
+    strncpy(range.data.path, dir, PATHSIZE_PLUS);
+    for (i = 0; i < nshards; i++) {
+        for (off = 0; off < count[i]; off += PLAN_RANGE) {
+            range.data.chkidx = ranks[i];
+            range.data.chkoff = off;
+            range.data.chklen = (count[i] - off < PLAN_RANGE)?(count[i] - off):PLAN_RANGE;
+            pack_list(&range, 1, workbuflist, workbufsize);
+        }
+    }
+    free(ranks);
+    free(count);
+    return 0;
+}
+
+/**
+* Maps a shard of a plan in memory.
+*
+* @param s		gets the mapped shard
+* @param dir		the plan directory
+* @param rank		the rank that wrote the shard
+*
+* @return 0 on success, -1 on failure
+*/
+int open_plan_shard(plan_shard *s, const char *dir, int rank) {
+    char file[PATHSIZE_PLUS];
+    struct stat st;
+    void **map[2];
+    size_t *len[2];
+    const char *suffix[2] = {"item", "path"};
+    int fd;
+    int i;
+
+    memset(s, 0, sizeof(plan_shard));
+    map[0] = (void **) &s->items;
+    map[1] = (void **) &s->paths;
+    len[0] = &s->items_len;
+    len[1] = &s->paths_len;
+    for (i = 0; i < 2; i++) {
+        snprintf(file, PATHSIZE_PLUS, "%s/shard.%d.%s", dir, rank, suffix[i]);
+        if ((fd = open(file, O_RDONLY)) < 0) {
+            close_plan_shard(s);
+            return -1;
+        }
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            close_plan_shard(s);
+            return -1;
+        }
+        *map[i] = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (*map[i] == MAP_FAILED) {
+            *map[i] = NULL;
+            close_plan_shard(s);
+            return -1;
+        }
+        *len[i] = st.st_size;
+        madvise(*map[i], st.st_size, MADV_SEQUENTIAL);
+    }
+    s->count = s->items_len / sizeof(plan_record);
+    return 0;
+}
+
+/**
+* Gets a record of a mapped shard, as the work item that was
+* planned.
+*
+* @param s		the shard
+* @param i		the record
+* @param item		gets the work item (the fields that are
+* 			not planned are 0)
+*
+* @return the flags of the record
+*/
+int plan_item(plan_shard *s, uint64_t i, path_item *item) {
+    plan_record *r = &s->items[i];
+
+    memset(item, 0, sizeof(path_item));
+    strncpy(item->path, s->paths + r->pathoff, PATHSIZE_PLUS);
+    item->path[PATHSIZE_PLUS-1] = '\0';
+    item->st.st_ino = r->ino;
+    item->st.st_size = r->size;
+    item->st.st_blocks = r->blocks;
+    item->st.st_mtim.tv_sec = r->mtime;
+    item->st.st_mtim.tv_nsec = r->mtime_nsec;
+    item->st.st_atim.tv_sec = r->atime;
+    item->st.st_atim.tv_nsec = r->atime_nsec;
+    item->st.st_uid = r->uid;
+    item->st.st_gid = r->gid;
+    item->st.st_mode = r->mode;
+    item->chkidx = r->chkidx;
+    item->chksz = r->chksz;
+    item->ftype = r->ftype;
+    item->desttype = r->desttype;
+    return r->flags;
+}
+
+/**
+* Unmaps a shard of a plan.
+*
+* @param s		the shard
+*/
+void close_plan_shard(plan_shard *s) {
+    if (s->items != NULL) {
+        munmap(s->items, s->items_len);
+    }
+    if (s->paths != NULL) {
+        munmap(s->paths, s->paths_len);
+    }
+    s->items = NULL;
+    s->paths = NULL;
+}
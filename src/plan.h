@@ -0,0 +1,107 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+//
+// Defines for copy plans. A plan-only copy (-g) walks and classifies
+// the source tree as usual, but writes the copy work (whole files and
+// chunks) to a plan instead of copying it. Running the plan later (-G)
+// only moves data.
+//
+// A plan is a directory. Each rank that walks writes its own shard:
+//
+//	shard.<rank>.item	plan_record, one per file or chunk
+//	shard.<rank>.path	heap of NUL terminated paths
+//
+// The records of a file are written together, and the first one has
+// PLAN_FIRST set. Both files can be sorted or split offline, as long as
+// the records of a file stay together. When the walk is done the manager
+// writes the manifest:
+//
+//	pftool plan 1
+//	shard <rank> <items>
+//
+
+#ifndef      __PLAN_H
+#define      __PLAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "pfutils.h"
+
+#define PLAN_MANIFEST "manifest"
+#define PLAN_VERSION "pftool plan 1"
+#define PLAN_RANGE 65536				// records of a task that runs a plan
+
+#define PLAN_FIRST 0x1					// the first record of a file
+
+// A record of a plan: the fields of a path_item that a copy uses
+struct plan_record {
+    uint64_t pathoff;					// offset of the path in the heap
+    uint64_t ino;
+    int64_t size;
+    int64_t blocks;
+    int64_t mtime;
+    int64_t atime;
+    int64_t chksz;
+    uint32_t mtime_nsec;
+    uint32_t atime_nsec;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mode;
+    int32_t chkidx;
+    int32_t ftype;
+    int32_t desttype;
+    uint32_t flags;
+    uint32_t unused;
+};
+typedef struct plan_record plan_record;
+
+// This rank's shard of a plan being written
+struct work_plan {
+    char dir[PATHSIZE_PLUS];				// the plan directory. "" -> no plan
+    int rank;
+    FILE *items;					// opened with the first record
+    FILE *paths;
+    uint64_t count;
+    uint64_t heap;					// bytes in the path heap
+    char last[PATHSIZE_PLUS];				// path of the last record
+    uint64_t lastoff;					// offset of that path in the heap
+    int failed;
+};
+typedef struct work_plan work_plan;
+
+// A shard of a plan, mapped in memory
+struct plan_shard {
+    plan_record *items;
+    char *paths;
+    size_t items_len;
+    size_t paths_len;
+    uint64_t count;
+};
+typedef struct plan_shard plan_shard;
+
+int prepare_plan(const char *dir);
+void init_plan(work_plan *p, const char *dir, int rank);
+void plan_add(work_plan *p, path_item *item);
+int close_plan(work_plan *p, uint64_t *count);
+int write_plan_manifest(const char *dir, const double *count, int nshards);
+int read_plan_manifest(const char *dir, int **ranks, uint64_t **count);
+int pack_plan(const char *dir, work_buf_list **workbuflist, int *workbufsize);
+int open_plan_shard(plan_shard *s, const char *dir, int rank);
+int plan_item(plan_shard *s, uint64_t i, path_item *item);
+void close_plan_shard(plan_shard *s);
+
+#endif
@@ -0,0 +1,396 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+/**
+* Implements limiting the rate of a job (see rate.h)
+*/
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "rate.h"
+
+// 1 -> the manager got SIGUSR1, and reads the control file again
+static volatile sig_atomic_t rate_signaled = 0;
+
+// The pacing of this rank's copies: its share of the rates
+static struct {
+    double bytes_rate;					// 0 -> no limit
+    double ops_rate;
+    double bytes;					// tokens. < 0 -> in debt
+    double ops;
+    double last;
+} pacer = {0.0, 0.0, 0.0, 0.0, 0.0};
+
+static double rate_now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static void rate_signal(int sig) {
+    (void) sig;
+    rate_signaled = 1;
+}
+
+/**
+* Parses rates: bytes per second, and files/chunks per second,
+* separated by a comma. Bytes take units (e.g. 2GB).
+*
+* @param spec		the rates, e.g. 2GB,5000
+* @param bytes_rate	gets the bytes per second. 0 -> no limit
+* @param ops_rate	gets the files/chunks per second. 0 -> no limit
+*
+* @return 0 on success, -1 if they make no sense
+*/
+int parse_rate(const char *spec, double *bytes_rate, double *ops_rate) {
+    char buf[128];
+    char *comma;
+
+    while (*spec == ' ' || *spec == '\t') {
+        spec++;
+    }
+    strncpy(buf, spec, sizeof(buf));
+    buf[sizeof(buf)-1] = '\0';
+    buf[strcspn(buf, " \t\r\n")] = '\0';
+    if (buf[0] == '\0') {
+        return -1;
+    }
+    if ((comma = strchr(buf, ',')) != NULL) {
+        *comma++ = '\0';
+        *ops_rate = atof(comma);
+    }
+    else {
+        *ops_rate = 0.0;
+    }
+    *bytes_rate = (buf[0])?(double) str2Size(buf):0.0;
+    if (*bytes_rate < 0 || *ops_rate < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Sets up SIGUSR1 for changing the rates at runtime: the manager
+* reads the control file again, and the other ranks ignore it.
+* Called by every rank, when there is a control file.
+*
+* @param rank		this rank
+*/
+void catch_rate_signal(int rank) {
+    signal(SIGUSR1, (rank == MANAGER_PROC)?rate_signal:SIG_IGN);
+}
+
+/**
+* Sets up the manager's token buckets. They start full.
+*
+* @param rl		the buckets to set up
+* @param nproc		the number of ranks
+* @param o		the options of the run (the rates)
+*/
+void init_rate_limit(rate_limit *rl, int nproc, struct options o) {
+    memset(rl, 0, sizeof(rate_limit));
+    rl->bytes_rate = o.rate_bytes;
+    rl->ops_rate = o.rate_ops;
+    rl->bytes = rl->bytes_rate * RATE_BURST;
+    rl->ops = rl->ops_rate * RATE_BURST;
+    strncpy(rl->control, o.rate_control, PATHSIZE_PLUS);
+    rl->control[PATHSIZE_PLUS-1] = '\0';
+    rl->sent_bytes = (double *) calloc(nproc, sizeof(double));
+    rl->sent_ops = (double *) calloc(nproc, sizeof(double));
+    rl->last = rate_now();
+    check_rate_control(rl, 0);
+    rl->changes = 0;					// the rates the job starts with are not a change
+}
+
+void free_rate_limit(rate_limit *rl) {
+    free(rl->sent_bytes);
+    free(rl->sent_ops);
+}
+
+/**
+* Tells if a rate is set.
+*/
+int rate_limited(rate_limit *rl) {
+    return (rl->bytes_rate > 0 || rl->ops_rate > 0);
+}
+
+/**
+* Reads the control file again, if it changed since it was last
+* read or SIGUSR1 came, and it is RATE_CHECK seconds since the
+* last look. A file that cannot be read or parsed leaves the
+* rates as they are.
+*
+* @param rl		the token buckets
+* @param verbose	1 -> a change of the rates is written to the output
+*
+* @return 1 if the rates changed, 0 otherwise
+*/
+int check_rate_control(rate_limit *rl, int verbose) {
+    char message[MESSAGESIZE];
+    char buf[128];
+    struct stat st;
+    double now = rate_now();
+    double bytes_rate, ops_rate;
+    FILE *fp;
+    int changed = 0;
+
+    if (!rl->control[0] || (!rate_signaled && now - rl->last_check < RATE_CHECK)) {
+        return 0;
+    }
+    rl->last_check = now;
+    if (stat(rl->control, &st) != 0 || (!rate_signaled && st.st_mtime == rl->control_mtime)) {
+        return 0;
+    }
+    rate_signaled = 0;
+    rl->control_mtime = st.st_mtime;
+    if ((fp = fopen(rl->control, "r")) == NULL) {
+        return 0;
+    }
+    if (fgets(buf, sizeof(buf), fp) != NULL && parse_rate(buf, &bytes_rate, &ops_rate) == 0 &&
+        (bytes_rate != rl->bytes_rate || ops_rate != rl->ops_rate)) {
+        rl->bytes_rate = bytes_rate;
+        rl->ops_rate = ops_rate;
+        rl->bytes = (rl->bytes < bytes_rate * RATE_BURST)?rl->bytes:bytes_rate * RATE_BURST;
+        rl->ops = (rl->ops < ops_rate * RATE_BURST)?rl->ops:ops_rate * RATE_BURST;
+        rl->changes++;
+        changed = 1;
+        if (verbose) {
+            sprintf(message, "INFO  RATE     limit now %.0f bytes/s, %.0f files/s (0 -> no limit)\n", bytes_rate, ops_rate);
+            write_output(message, 1);
+        }
+    }
+    fclose(fp);
+    return changed;
+}
+
+/**
+* Tells if a copy batch may be handed out: both buckets hold
+* tokens, after they are refilled.
+*
+* @param rl		the token buckets
+*
+* @return 1 if it may
+*/
+int rate_may_send(rate_limit *rl) {
+    double now = rate_now();
+    double dt = now - rl->last;
+
+    rl->last = now;
+    if (rl->bytes_rate > 0) {
+        rl->bytes += dt * rl->bytes_rate;
+        if (rl->bytes > rl->bytes_rate * RATE_BURST) {
+            rl->bytes = rl->bytes_rate * RATE_BURST;
+        }
+    }
+    if (rl->ops_rate > 0) {
+        rl->ops += dt * rl->ops_rate;
+        if (rl->ops > rl->ops_rate * RATE_BURST) {
+            rl->ops = rl->ops_rate * RATE_BURST;
+        }
+    }
+    if ((rl->bytes_rate > 0 && rl->bytes <= 0) || (rl->ops_rate > 0 && rl->ops <= 0)) {
+        if (rl->held_since == 0) {
+            rl->held_since = now;
+        }
+        return 0;
+    }
+    if (rl->held_since > 0) {
+        rl->held_secs += now - rl->held_since;
+        rl->held_since = 0;
+    }
+    return 1;
+}
+
+/**
+* Takes a batch that was handed out from the buckets.
+*
+* @param rl		the token buckets
+* @param bytes		the bytes in the batch
+* @param items		the files/chunks in the batch
+*/
+void rate_charge(rate_limit *rl, size_t bytes, int items) {
+    if (rl->bytes_rate > 0) {
+        rl->bytes -= bytes;
+    }
+    if (rl->ops_rate > 0) {
+        rl->ops -= items;
+    }
+}
+
+/**
+* Sends a rank its share of the rates, if it does not have it.
+*
+* @param rl		the token buckets
+* @param rank		the rank
+* @param copiers	the number of ranks copying, with this one
+* @param share		gets the share: bytes/second, files/second
+*/
+static void send_share(rate_limit *rl, int rank, int copiers, double *share) {
+    if (copiers < 1) {
+        copiers = 1;
+    }
+    share[0] = rl->bytes_rate/copiers;
+    share[1] = rl->ops_rate/copiers;
+    if (share[0] == rl->sent_bytes[rank] && share[1] == rl->sent_ops[rank]) {
+        return;
+    }
+    send_command(rank, RATECMD);
+    if (MPI_Send(share, 2, MPI_DOUBLE, rank, rank, MPI_COMM_WORLD) != MPI_SUCCESS) {
+        fprintf(stderr, "Failed to send rate share to rank %d\n", rank);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    rl->sent_bytes[rank] = share[0];
+    rl->sent_ops[rank] = share[1];
+}
+
+/**
+* Counts the ranks copying.
+*
+* @param copying	non 0 for each rank copying
+* @param nproc		the number of ranks
+*/
+static int count_copiers(int *copying, int nproc) {
+    int i, copiers = 0;
+
+    for (i = START_PROC; i < nproc; i++) {
+        if (copying[i]) {
+            copiers++;
+        }
+    }
+    return copiers;
+}
+
+/**
+* Cuts a rank's batch to RATE_BURST seconds of the share of the
+* rates it will have once the batch goes out. Short batches let a
+* change of the rates reach the ranks soon. The rates are split
+* evenly over the ranks copying, so a share changes with the
+* rates and with the number of copiers. The share itself is sent
+* by rate_push(), only after a batch was actually handed out.
+*
+* @param rl		the token buckets
+* @param copying	non 0 for each rank copying
+* @param nproc		the number of ranks
+* @param batch_bytes	the byte target of the batch. Cut to the budget
+* @param batch_count	the most items in the batch. Cut to the budget
+*/
+void rate_cut_batch(rate_limit *rl, int *copying, int nproc, size_t *batch_bytes, int *batch_count) {
+    int copiers = count_copiers(copying, nproc) + 1;			// with the rank the batch is for
+    double share_bytes = rl->bytes_rate/copiers;
+    double share_ops = rl->ops_rate/copiers;
+
+    if (share_bytes > 0 && share_bytes * RATE_BURST < *batch_bytes) {
+        *batch_bytes = (size_t)(share_bytes * RATE_BURST);
+    }
+    if (share_ops > 0 && share_ops * RATE_BURST < *batch_count) {
+        *batch_count = (share_ops * RATE_BURST >= 1)?(int)(share_ops * RATE_BURST):1;
+    }
+}
+
+/**
+* Sends the ranks copying their new share, after the number of
+* copiers or the rates changed. A copier takes it between the
+* blocks of copy_file(), or after its batch.
+*
+* @param rl		the token buckets
+* @param copying	non 0 for each rank copying
+* @param nproc		the number of ranks
+*/
+void rate_push(rate_limit *rl, int *copying, int nproc) {
+    double share[2];
+    int copiers = count_copiers(copying, nproc);
+    int i;
+
+    for (i = START_PROC; i < nproc; i++) {
+        if (copying[i]) {
+            send_share(rl, i, copiers, share);
+        }
+    }
+}
+
+/**
+* Receives this rank's share of the rates from the manager
+* (RATECMD).
+*
+* @param sending_rank	the manager
+*/
+void receive_pace(int sending_rank) {
+    MPI_Status status;
+    double share[2];
+
+    if (MPI_Recv(share, 2, MPI_DOUBLE, sending_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &status) != MPI_SUCCESS) {
+        errsend(FATAL, "Failed to receive rate share\n");
+    }
+    set_pace(share[0], share[1]);
+}
+
+/**
+* Tells if this rank paces its copies.
+*/
+int pace_active() {
+    return (pacer.bytes_rate > 0 || pacer.ops_rate > 0);
+}
+
+/**
+* Sets this rank's share of the rates.
+*
+* @param bytes_rate	bytes/second. 0 -> no limit
+* @param ops_rate	files/chunks per second. 0 -> no limit
+*/
+void set_pace(double bytes_rate, double ops_rate) {
+    pacer.bytes_rate = bytes_rate;
+    pacer.ops_rate = ops_rate;
+    if (pacer.bytes > bytes_rate * RATE_BURST) pacer.bytes = bytes_rate * RATE_BURST;
+    if (pacer.ops > ops_rate * RATE_BURST) pacer.ops = ops_rate * RATE_BURST;
+    pacer.last = rate_now();
+}
+
+/**
+* Paces this rank's copies against its share of the rates:
+* takes what was just done from its buckets, and sleeps until
+* they are out of debt.
+*
+* @param bytes		bytes just written
+* @param ops		files/chunks just done
+*/
+void pace(size_t bytes, int ops) {
+    double now, wait = 0.0;
+
+    if (pacer.bytes_rate <= 0 && pacer.ops_rate <= 0) {
+        return;
+    }
+    now = rate_now();
+    if (pacer.bytes_rate > 0) {
+        pacer.bytes += (now - pacer.last) * pacer.bytes_rate;
+        if (pacer.bytes > pacer.bytes_rate * RATE_BURST) pacer.bytes = pacer.bytes_rate * RATE_BURST;
+        pacer.bytes -= bytes;
+        if (pacer.bytes < 0 && -pacer.bytes/pacer.bytes_rate > wait) wait = -pacer.bytes/pacer.bytes_rate;
+    }
+    if (pacer.ops_rate > 0) {
+        pacer.ops += (now - pacer.last) * pacer.ops_rate;
+        if (pacer.ops > pacer.ops_rate * RATE_BURST) pacer.ops = pacer.ops_rate * RATE_BURST;
+        pacer.ops -= ops;
+        if (pacer.ops < 0 && -pacer.ops/pacer.ops_rate > wait) wait = -pacer.ops/pacer.ops_rate;
+    }
+    pacer.last = now;
+    if (wait > 0.0) {
+        usleep((useconds_t)(wait * 1000000));
+    }
+}
@@ -0,0 +1,75 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+//
+// Defines for limiting the rate of a job (-R, -U). The manager keeps
+// job-wide token buckets of bytes and of files/chunks, refilled at the
+// rates. A copy batch is only handed out while both buckets hold tokens,
+// and its bytes and items are taken from them, so a big batch leaves the
+// buckets in debt for a while. The manager also sends each copying rank
+// its share of the rates (RATECMD): the rates split evenly over the ranks
+// copying. It is sent to all copiers when their number changes, so a
+// rank gets its share right after the batch that made it a copier. copy_file() paces its writes against that share, so a
+// big chunk does not go out in one burst.
+//
+// The rates can be changed while the job runs by writing BYTES[,OPS] to
+// the control file (-U). The manager reads it again when it changes, or
+// at once on SIGUSR1. 0 is no limit.
+//
+
+#ifndef      __RATE_H
+#define      __RATE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "pfutils.h"
+
+#define RATE_BURST 1.0					// seconds of the rates a bucket holds
+#define RATE_CHECK 1.0					// seconds between checks of the control file
+
+// The manager's token buckets
+struct rate_limit {
+    double bytes_rate;					// bytes/second. 0 -> no limit
+    double ops_rate;					// files/chunks per second. 0 -> no limit
+    double bytes;					// tokens. < 0 -> in debt
+    double ops;
+    double last;					// when the buckets were refilled
+    char control[PATHSIZE_PLUS];			// the control file. "" -> none
+    time_t control_mtime;
+    double last_check;
+    double *sent_bytes;					// share of the rates each rank was sent
+    double *sent_ops;
+    double held_since;					// when copy work was first held back because the buckets were empty. 0 -> not held
+    double held_secs;					// time copy work was held back
+    int changes;					// times the rates were changed
+};
+typedef struct rate_limit rate_limit;
+
+int parse_rate(const char *spec, double *bytes_rate, double *ops_rate);
+void catch_rate_signal(int rank);
+void init_rate_limit(rate_limit *rl, int nproc, struct options o);
+void free_rate_limit(rate_limit *rl);
+int rate_limited(rate_limit *rl);
+int check_rate_control(rate_limit *rl, int verbose);
+int rate_may_send(rate_limit *rl);
+void rate_charge(rate_limit *rl, size_t bytes, int items);
+void rate_cut_batch(rate_limit *rl, int *copying, int nproc, size_t *batch_bytes, int *batch_count);
+void rate_push(rate_limit *rl, int *copying, int nproc);
+void receive_pace(int sending_rank);
+int pace_active();
+void set_pace(double bytes_rate, double ops_rate);
+void pace(size_t bytes, int ops);
+
+#endif
@@ -0,0 +1,562 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+/**
+* Implements tree snapshots (see snapshot.h)
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+
+#define SNAP_ALIGN(n) (((n) + 7) & ~((size_t)7))
+
+/**
+* Removes a directory that holds only files.
+*
+* @param path		the directory to remove
+*
+* @return 0 on success, -1 on failure
+*/
+static int remove_flat_dir(const char *path) {
+    DIR *dip;
+    struct dirent *dit;
+    char file[PATHSIZE_PLUS];
+
+    if ((dip = opendir(path)) == NULL) {
+        return (errno == ENOENT)?0:-1;
+    }
+    while ((dit = readdir(dip)) != NULL) {
+        if (strcmp(dit->d_name, ".") && strcmp(dit->d_name, "..")) {
+            snprintf(file, PATHSIZE_PLUS, "%s/%s", path, dit->d_name);
+            unlink(file);
+        }
+    }
+    closedir(dip);
+    return rmdir(path);
+}
+
+/**
+* Sets up a snapshot directory for a run: creates it if
+* needed, and starts an empty next snapshot, with the time
+* the walk starts. Called by the manager before the walk.
+*
+* @param dir		the snapshot directory
+* @param info		what the run is (work type and destination)
+* @param info_matches	set to 1 if the current snapshot was written
+* 			by the same kind of run
+*
+* @return 0 on success, -1 on failure
+*/
+int prepare_snapshot(const char *dir, const char *info, int *info_matches) {
+    char path[PATHSIZE_PLUS];
+    char old_info[PATHSIZE_PLUS];
+    FILE *fp;
+
+    *info_matches = 0;
+    if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(path, PATHSIZE_PLUS, "%s/%s", dir, SNAPSHOT_NEXT);
+    if (remove_flat_dir(path) != 0 || mkdir(path, S_IRWXU) != 0) {
+        return -1;
+    }
+    snprintf(path, PATHSIZE_PLUS, "%s/%s/%s", dir, SNAPSHOT_NEXT, SNAPSHOT_START);
+    if ((fp = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+    fprintf(fp, "%lld\n", (long long) time(NULL));
+    if (fclose(fp) != 0) {
+        return -1;
+    }
+    snprintf(path, PATHSIZE_PLUS, "%s/%s/%s", dir, SNAPSHOT_CURRENT, SNAPSHOT_INFO);
+    if ((fp = fopen(path, "r")) != NULL) {
+        if (fgets(old_info, PATHSIZE_PLUS, fp) != NULL && !strcmp(old_info, info)) {
+            *info_matches = 1;
+        }
+        fclose(fp);
+    }
+    return 0;
+}
+
+/**
+* Makes the next snapshot the current one. Called by the
+* manager once every rank has closed its shard.
+*
+* @param dir		the snapshot directory
+* @param info		what the run was (see prepare_snapshot())
+*
+* @return 0 on success, -1 on failure
+*/
+int commit_snapshot(const char *dir, const char *info) {
+    char next[PATHSIZE_PLUS], current[PATHSIZE_PLUS], old[PATHSIZE_PLUS];
+    FILE *fp;
+
+    snprintf(next, PATHSIZE_PLUS, "%s/%s/%s", dir, SNAPSHOT_NEXT, SNAPSHOT_INFO);
+    if ((fp = fopen(next, "w")) == NULL) {
+        return -1;
+    }
+    fputs(info, fp);
+    if (fclose(fp) != 0) {
+        return -1;
+    }
+    snprintf(next, PATHSIZE_PLUS, "%s/%s", dir, SNAPSHOT_NEXT);
+    snprintf(current, PATHSIZE_PLUS, "%s/%s", dir, SNAPSHOT_CURRENT);
+    snprintf(old, PATHSIZE_PLUS, "%s/old", dir);
+    remove_flat_dir(old);
+    if (rename(current, old) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    if (rename(next, current) != 0) {
+        return -1;
+    }
+    return remove_flat_dir(old);
+}
+
+/**
+* Initializes the snapshots of a worker. Nothing is read
+* or written until a directory is walked.
+*
+* @param s		the snapshots to initialize
+* @param dir		the snapshot directory. "" -> no snapshots
+* @param rank		the rank of the worker
+*/
+void init_snapshot(snapshot *s, const char *dir, int rank) {
+    memset(s, 0, sizeof(snapshot));
+    strncpy(s->dir, dir, PATHSIZE_PLUS);
+    s->dir[PATHSIZE_PLUS-1] = '\0';
+    s->rank = rank;
+}
+
+/**
+* Maps a file in memory, read only.
+*
+* @param path		the file to map
+* @param len		gets the length of the file
+*
+* @return the mapped file, or NULL if it could not be mapped
+*/
+static char *map_file(const char *path, size_t *len) {
+    struct stat st;
+    char *data;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *len = st.st_size;
+    return data;
+}
+
+/**
+* Maps the shards of the current snapshot.
+*
+* @param s		the snapshots of the worker
+*/
+static void load_snapshot(snapshot *s) {
+    char path[PATHSIZE_PLUS], file[PATHSIZE_PLUS];
+    DIR *dip;
+    struct dirent *dit;
+    snap_shard shard;
+    size_t len;
+    int shard_rank;
+    char tail[8];
+    long long start;
+    FILE *fp;
+
+    s->loaded = 1;
+    s->trusted = 0;							// no start time -> nothing is taken as unchanged
+    snprintf(file, PATHSIZE_PLUS, "%s/%s/%s", s->dir, SNAPSHOT_CURRENT, SNAPSHOT_START);
+    if ((fp = fopen(file, "r")) != NULL) {
+        if (fscanf(fp, "%lld", &start) == 1) {
+            s->trusted = (int64_t) start - SNAPSHOT_SLACK;
+        }
+        fclose(fp);
+    }
+    snprintf(path, PATHSIZE_PLUS, "%s/%s", s->dir, SNAPSHOT_CURRENT);
+    if ((dip = opendir(path)) == NULL) {
+        return;
+    }
+    while ((dit = readdir(dip)) != NULL) {
+        if (sscanf(dit->d_name, "shard.%d.%7s", &shard_rank, tail) != 2 || strcmp(tail, "idx")) {
+            continue;
+        }
+        snprintf(file, PATHSIZE_PLUS, "%s/%s", path, dit->d_name);
+        if ((shard.index = (snap_index *) map_file(file, &len)) == NULL) {
+            continue;
+        }
+        shard.count = len/sizeof(snap_index);
+        snprintf(file, PATHSIZE_PLUS, "%s/shard.%d", path, shard_rank);
+        if ((shard.data = map_file(file, &shard.data_len)) == NULL) {
+            munmap(shard.index, len);
+            continue;
+        }
+        s->shards = (snap_shard *) realloc(s->shards, (s->nshards + 1) * sizeof(snap_shard));
+        s->shards[s->nshards++] = shard;
+    }
+    closedir(dip);
+}
+
+/**
+* Finds a directory in the current snapshot.
+*
+* @param s		the snapshots of the worker
+* @param path		the directory to find
+*
+* @return the record of the directory, or NULL if it is not
+* 	in the snapshot
+*/
+static const snap_dir *find_snapshot_dir(snapshot *s, const char *path) {
+    uint64_t hash = name_hash(path);
+    const snap_shard *shard;
+    const snap_dir *d;
+    size_t low, high, mid;
+    int i;
+
+    if (!s->loaded) {
+        load_snapshot(s);
+    }
+    for (i = 0; i < s->nshards; i++) {
+        shard = &s->shards[i];
+        low = 0;
+        high = shard->count;
+        while (low < high) {						// the first index record with this hash
+            mid = (low + high)/2;
+            if (shard->index[mid].hash < hash) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        for (; low < shard->count && shard->index[low].hash == hash; low++) {
+            if (shard->index[low].offset + sizeof(snap_dir) > shard->data_len) {
+                break;
+            }
+            d = (const snap_dir *)(shard->data + shard->index[low].offset);
+            if (!strcmp((const char *)(d + 1), path)) {
+                s->old_next = shard->data + d->entries;
+                return d;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+* Starts walking a directory: looks it up in the current
+* snapshot, and starts its record in this rank's shard of
+* the next snapshot.
+*
+* @param s		the snapshots of the worker
+* @param path		the directory
+* @param st		the stat of the directory
+*
+* @return 1 if the directory has not changed since the current
+* 	snapshot, so that its names can be listed from it with
+* 	snapshot_next_name(), 0 otherwise
+*/
+int snapshot_begin_dir(snapshot *s, const char *path, struct stat *st) {
+    char file[PATHSIZE_PLUS];
+    const snap_entry *e;
+    const char *p;
+    size_t i, j;
+
+    if (s->dir[0] == '\0') {
+        return 0;
+    }
+    free(s->old_map);
+    s->old_map = NULL;
+    s->map_size = 0;
+    s->old_left = 0;
+    if ((s->old = find_snapshot_dir(s, path)) != NULL && s->old->count > 0) {
+        for (s->map_size = 1024; s->map_size < 2*s->old->count; s->map_size *= 2);
+        s->old_map = (const snap_entry **) calloc(s->map_size, sizeof(snap_entry *));
+        p = s->old_next;
+        for (i = 0; s->old_map != NULL && i < s->old->count; i++) {
+            e = (const snap_entry *)p;
+            for (j = name_hash((const char *)(e + 1)) & (s->map_size - 1); s->old_map[j] != NULL; j = (j + 1) & (s->map_size - 1));
+            s->old_map[j] = e;
+            p += e->reclen;
+        }
+    }
+    if (s->out == NULL) {
+        snprintf(file, PATHSIZE_PLUS, "%s/%s/shard.%d", s->dir, SNAPSHOT_NEXT, s->rank);
+        if ((s->out = fopen(file, "w")) == NULL) {
+            snprintf(file, PATHSIZE_PLUS, "Failed to open snapshot shard %s/%s/shard.%d", s->dir, SNAPSHOT_NEXT, s->rank);
+            errsend(NONFATAL, file);
+            s->dir[0] = '\0';
+            return 0;
+        }
+    }
+    s->dir_entries = s->out_off;
+    s->dir_count = 0;
+    if (s->old != NULL && s->old->mtime_sec == st->st_mtim.tv_sec && s->old->mtime_nsec == st->st_mtim.tv_nsec &&
+        s->old->ctime_sec == st->st_ctim.tv_sec && s->old->ctime_nsec == st->st_ctim.tv_nsec &&
+        s->old->mtime_sec < s->trusted && s->old->ctime_sec < s->trusted) {
+        s->old_left = s->old->count;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+* Lists the next name of an unchanged directory from the
+* current snapshot.
+*
+* @param s		the snapshots of the worker
+* @param d_type		gets the type of the entry
+* @param d_ino		gets the inode number of the entry
+*
+* @return the name, or NULL when all names have been listed
+*/
+const char *snapshot_next_name(snapshot *s, unsigned char *d_type, ino_t *d_ino) {
+    const snap_entry *e;
+
+    if (s->old_left == 0) {
+        return NULL;
+    }
+    e = (const snap_entry *)s->old_next;
+    s->old_next += e->reclen;
+    s->old_left--;
+    *d_type = IFTODT(e->mode);
+    *d_ino = e->ino;
+    return (const char *)(e + 1);
+}
+
+/**
+* Tests if an entry of the directory being walked is the same
+* as in the current snapshot.
+*
+* @param s		the snapshots of the worker
+* @param name		the name of the entry
+* @param st		the stat of the entry
+*
+* @return 1 if the entry has not changed, 0 otherwise
+*/
+int snapshot_unchanged(snapshot *s, const char *name, struct stat *st) {
+    const snap_entry *e;
+    size_t j;
+
+    if (s->old_map == NULL) {
+        return 0;
+    }
+    for (j = name_hash(name) & (s->map_size - 1); (e = s->old_map[j]) != NULL; j = (j + 1) & (s->map_size - 1)) {
+        if (!strcmp((const char *)(e + 1), name)) {
+            return (e->mode != 0 && e->mode == st->st_mode && e->ino == st->st_ino && e->size == st->st_size &&
+                    e->mtime_sec == st->st_mtim.tv_sec && e->mtime_nsec == st->st_mtim.tv_nsec &&
+                    e->ctime_sec == st->st_ctim.tv_sec && e->ctime_nsec == st->st_ctim.tv_nsec &&
+                    e->mtime_sec < s->trusted && e->ctime_sec < s->trusted);
+        }
+    }
+    return 0;
+}
+
+/**
+* Writes a shard record, and counts its bytes.
+*
+* @param s		the snapshots of the worker
+* @param rec		the record
+* @param len		the length of the record
+*/
+static void write_snapshot(snapshot *s, const void *rec, size_t len) {
+    if (fwrite(rec, 1, len, s->out) != len) {
+        errsend(NONFATAL, "Failed to write snapshot shard");
+        fclose(s->out);
+        s->out = NULL;
+        s->dir[0] = '\0';
+        return;
+    }
+    s->out_off += len;
+}
+
+/**
+* Adds an entry of the directory being walked to this rank's
+* shard of the next snapshot.
+*
+* @param s		the snapshots of the worker
+* @param name		the name of the entry
+* @param st		the stat of the entry. NULL -> not stat'ed
+* 			here (it always looks changed next time)
+*/
+void snapshot_add_entry(snapshot *s, const char *name, struct stat *st) {
+    char rec[sizeof(snap_entry) + SNAP_ALIGN(PATHSIZE_PLUS + 1)];
+    snap_entry *e = (snap_entry *)rec;
+    size_t namelen = strlen(name);
+
+    if (s->out == NULL || namelen > 65000) {
+        return;
+    }
+    memset(rec, 0, sizeof(snap_entry) + SNAP_ALIGN(namelen + 1));
+    if (st != NULL) {
+        e->ino = st->st_ino;
+        e->size = st->st_size;
+        e->mtime_sec = st->st_mtim.tv_sec;
+        e->mtime_nsec = st->st_mtim.tv_nsec;
+        e->ctime_sec = st->st_ctim.tv_sec;
+        e->ctime_nsec = st->st_ctim.tv_nsec;
+        e->mode = st->st_mode;
+    }
+    e->namelen = namelen;
+    e->reclen = sizeof(snap_entry) + SNAP_ALIGN(namelen + 1);
+    memcpy(e + 1, name, namelen);
+    write_snapshot(s, rec, e->reclen);
+    s->dir_count++;
+}
+
+/**
+* Ends the record of the directory being walked in this rank's
+* shard of the next snapshot.
+*
+* @param s		the snapshots of the worker
+* @param path		the directory
+* @param st		the stat of the directory
+*/
+void snapshot_end_dir(snapshot *s, const char *path, struct stat *st) {
+    char rec[sizeof(snap_dir) + SNAP_ALIGN(PATHSIZE_PLUS + 1)];
+    snap_dir *d = (snap_dir *)rec;
+    size_t pathlen = strlen(path);
+
+    if (s->out == NULL) {
+        return;
+    }
+    memset(rec, 0, sizeof(snap_dir) + SNAP_ALIGN(pathlen + 1));
+    d->hash = name_hash(path);
+    d->mtime_sec = st->st_mtim.tv_sec;
+    d->mtime_nsec = st->st_mtim.tv_nsec;
+    d->ctime_sec = st->st_ctim.tv_sec;
+    d->ctime_nsec = st->st_ctim.tv_nsec;
+    d->entries = s->dir_entries;
+    d->count = s->dir_count;
+    d->pathlen = pathlen;
+    d->reclen = sizeof(snap_dir) + SNAP_ALIGN(pathlen + 1);
+    memcpy(d + 1, path, pathlen);
+    if (s->new_count == s->new_size) {
+        s->new_size = (s->new_size)?2*s->new_size:1024;
+        s->new_index = (snap_index *) realloc(s->new_index, s->new_size * sizeof(snap_index));
+    }
+    s->new_index[s->new_count].hash = d->hash;
+    s->new_index[s->new_count].offset = s->out_off;
+    s->new_count++;
+    write_snapshot(s, rec, d->reclen);
+}
+
+// qsort() order of index records
+static int snap_index_cmp(const void *a, const void *b) {
+    const snap_index *x = (const snap_index *)a, *y = (const snap_index *)b;
+
+    return (x->hash < y->hash)?-1:(x->hash > y->hash);
+}
+
+/**
+* Closes the snapshots of a worker: writes the index of this
+* rank's shard of the next snapshot, and unmaps the current one.
+* This happens after the manager stopped counting errors, so
+* failures are returned, for the manager not to commit the
+* snapshot.
+*
+* @param s		the snapshots of the worker
+*
+* @return 0 on success, -1 if the shard could not be written
+*/
+int close_snapshot(snapshot *s) {
+    char file[PATHSIZE_PLUS];
+    FILE *fp;
+    int rc = 0;
+    int i;
+
+    if (s->out != NULL) {
+        snprintf(file, PATHSIZE_PLUS, "%s/%s/shard.%d.idx", s->dir, SNAPSHOT_NEXT, s->rank);
+        if (fclose(s->out) != 0) {
+            rc = -1;
+        }
+        else if ((fp = fopen(file, "w")) == NULL) {
+            rc = -1;
+        }
+        else {
+            qsort(s->new_index, s->new_count, sizeof(snap_index), snap_index_cmp);
+            if (fwrite(s->new_index, sizeof(snap_index), s->new_count, fp) != s->new_count) {
+                rc = -1;
+            }
+            if (fclose(fp) != 0) {
+                rc = -1;
+            }
+        }
+        if (rc != 0) {
+            fprintf(stderr, "Failed to write snapshot shard %s\n", file);
+        }
+        s->out = NULL;
+    }
+    for (i = 0; i < s->nshards; i++) {
+        munmap(s->shards[i].data, s->shards[i].data_len);
+        munmap(s->shards[i].index, s->shards[i].count * sizeof(snap_index));
+    }
+    free(s->shards);
+    free(s->old_map);
+    free(s->new_index);
+    s->shards = NULL;
+    s->old_map = NULL;
+    s->new_index = NULL;
+    return rc;
+}
+
+/**
+* Adds a batch of stat'ed entries of the directory being
+* walked to this rank's shard of the next snapshot, and
+* optionally drops the files that have not changed since the
+* current snapshot, so that they are not processed again.
+*
+* @param s		the snapshots of the worker
+* @param items		the stat'ed entries
+* @param count		the number of entries. Returns the number left
+* @param filter		1 -> drop unchanged files
+* @param skipped	incremented by the number of files dropped
+* @param skipped_bytes	incremented by the bytes of files dropped
+*/
+void snapshot_items(snapshot *s, path_item *items, int *count, int filter, int *skipped, size_t *skipped_bytes) {
+    const char *name;
+    int i, kept = 0;
+
+    if (s->dir[0] == '\0') {
+        return;
+    }
+    for (i = 0; i < *count; i++) {
+        name = strrchr(items[i].path, '/');
+        name = (name)?name + 1:items[i].path;
+        if (filter && !S_ISDIR(items[i].st.st_mode) && snapshot_unchanged(s, name, &items[i].st)) {
+            (*skipped)++;
+            (*skipped_bytes) += items[i].st.st_size;
+        }
+        else {
+            items[kept++] = items[i];
+        }
+        snapshot_add_entry(s, name, &items[i].st);
+    }
+    *count = kept;
+}
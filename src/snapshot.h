@@ -0,0 +1,128 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+//
+// Defines for tree snapshots (-I). A snapshot records what a walk saw:
+// the mtime/ctime of every directory, and the size/mtime/ctime/inode of
+// every entry. A later run uses it to skip reading unchanged directories,
+// and (pfcp -n) to skip files that did not change since the last run.
+//
+// A snapshot is a directory. The last complete snapshot is in "current",
+// the one being written is in "next". Each rank that walks writes its own
+// shard, shard.<rank>, of records:
+//
+//	entry records of a directory, then the directory record
+//
+// and at the end of the run an index, shard.<rank>.idx, of the directory
+// records sorted by the hash of their paths. Shards and indexes are
+// mmap'ed for lookups. The manager makes "next" the "current" snapshot
+// only if the run had no errors.
+//
+// The manager records when the walk started in "start". A directory or
+// entry whose mtime or ctime is within SNAPSHOT_SLACK of that time, or
+// later, may have changed after it was read, in the same timestamp tick.
+// It is never taken as unchanged from that snapshot.
+//
+
+#ifndef      __SNAPSHOT_H
+#define      __SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "pfutils.h"
+
+#define SNAPSHOT_CURRENT "current"
+#define SNAPSHOT_NEXT "next"
+#define SNAPSHOT_INFO "info"				// the work type and destination of the run that wrote the snapshot
+#define SNAPSHOT_START "start"				// when the walk of the snapshot started, seconds since the epoch
+#define SNAPSHOT_SLACK 2				// seconds of timestamp granularity and clock skew allowed for
+
+// An entry of a directory, on disk. Followed by the name, NUL terminated and padded to 8 bytes
+struct snap_entry {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    uint32_t mode;					// 0 -> not stat'ed. Never the same as a stat
+    uint16_t namelen;
+    uint16_t reclen;					// length of the record, with the name
+};
+typedef struct snap_entry snap_entry;
+
+// A directory, on disk. Follows its entries, and is followed by the path, NUL terminated and padded to 8 bytes
+struct snap_dir {
+    uint64_t hash;					// name_hash() of the path
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    uint64_t entries;					// offset of the first entry in the shard
+    uint64_t count;					// number of entries
+    uint32_t pathlen;
+    uint32_t reclen;					// length of the record, with the path
+};
+typedef struct snap_dir snap_dir;
+
+// An index record: where the record of a directory is in a shard
+struct snap_index {
+    uint64_t hash;
+    uint64_t offset;
+};
+typedef struct snap_index snap_index;
+
+// A shard of the last snapshot, mapped in memory
+struct snap_shard {
+    char *data;
+    size_t data_len;
+    snap_index *index;
+    size_t count;					// number of directories in the index
+};
+typedef struct snap_shard snap_shard;
+
+// The snapshots of a worker rank: the last one, for lookups, and its shard of the next one
+struct snapshot {
+    char dir[PATHSIZE_PLUS];				// the snapshot directory. "" -> no snapshots
+    int rank;
+    int loaded;						// 1 -> shards has been read
+    int64_t trusted;					// times before this are trusted to be from before the walk of the last snapshot
+    snap_shard *shards;
+    int nshards;
+    //the directory being walked, in the last snapshot
+    const snap_dir *old;
+    const snap_entry **old_map;				// its entries, hashed by name
+    size_t map_size;
+    const char *old_next;				// the next entry to list from the last snapshot
+    size_t old_left;					// entries left to list
+    //this rank's shard of the next snapshot
+    FILE *out;
+    uint64_t out_off;
+    snap_index *new_index;
+    size_t new_count, new_size;
+    uint64_t dir_entries;				// offset of the first entry of the directory being written
+    uint64_t dir_count;
+};
+typedef struct snapshot snapshot;
+
+int prepare_snapshot(const char *dir, const char *info, int *info_matches);
+int commit_snapshot(const char *dir, const char *info);
+void init_snapshot(snapshot *s, const char *dir, int rank);
+int snapshot_begin_dir(snapshot *s, const char *path, struct stat *st);
+const char *snapshot_next_name(snapshot *s, unsigned char *d_type, ino_t *d_ino);
+int snapshot_unchanged(snapshot *s, const char *name, struct stat *st);
+void snapshot_add_entry(snapshot *s, const char *name, struct stat *st);
+void snapshot_end_dir(snapshot *s, const char *path, struct stat *st);
+void snapshot_items(snapshot *s, path_item *items, int *count, int filter, int *skipped, size_t *skipped_bytes);
+int close_snapshot(snapshot *s);
+
+#endif
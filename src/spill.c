@@ -0,0 +1,252 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+/**
+* Implements spilling of the manager's queues (see spill.h)
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "spill.h"
+
+// The spill state of this process
+static struct {
+    size_t budget;					// bytes of queued buffers kept in memory. 0 -> no spilling
+    size_t in_memory;					// bytes of queued buffers in memory
+    char dir[PATHSIZE_PLUS];				// where the segment files go
+    int fd;						// segment being written. -1 -> none
+    int seg;						// its number
+    off_t seg_off;					// its size
+    int *live;						// buffers not yet sent, per segment
+    int nsegs;
+    int failed;						// 1 -> a write failed. Nothing more is spilled
+    size_t spilled_buffers;				// totals, for the footer
+    size_t spilled_bytes;
+} spill = {0, 0, "", -1, -1, 0, NULL, 0, 0, 0, 0};
+
+/**
+* Gets the path of a segment file.
+*
+* @param seg		the segment
+* @param path		gets the path, PATHSIZE_PLUS bytes
+*/
+static void segment_path(int seg, char *path) {
+    snprintf(path, PATHSIZE_PLUS, "%s/pftool.spill.%d.%d", spill.dir, (int) getpid(), seg);
+}
+
+/**
+* Sets the memory budget of the queues. Called by the manager
+* before anything is queued.
+*
+* @param budget		bytes of queued buffers kept in memory.
+* 			0 -> no spilling
+*/
+void init_queue_spill(size_t budget) {
+    const char *tmpdir = getenv("TMPDIR");
+
+    spill.budget = budget;
+    strncpy(spill.dir, (tmpdir && tmpdir[0])?tmpdir:"/tmp", PATHSIZE_PLUS);
+    spill.dir[PATHSIZE_PLUS-1] = '\0';
+}
+
+/**
+* Starts the next segment file.
+*
+* @return 0 on success, -1 on failure
+*/
+static int next_segment() {
+    char path[PATHSIZE_PLUS];
+
+    if (spill.fd >= 0) {
+        close(spill.fd);
+        if (spill.live[spill.seg] == 0) {			// all of it was sent while it was written
+            segment_path(spill.seg, path);
+            unlink(path);
+        }
+    }
+    spill.seg++;
+    spill.seg_off = 0;
+    spill.live = (int *) realloc(spill.live, (spill.seg + 1) * sizeof(int));
+    spill.live[spill.seg] = 0;
+    spill.nsegs = spill.seg + 1;
+    segment_path(spill.seg, path);
+    if ((spill.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+* Accounts a buffer that was just queued. If the queues hold
+* the budget already, the buffer is written to the segment
+* file instead, and freed: item->seg and item->off tell where
+* it is. Otherwise item->seg is -1.
+*
+* @param item		the queued buffer
+*/
+void spill_buf(work_buf_list *item) {
+    size_t len = item->size * sizeof(path_item);
+    ssize_t n;
+    size_t done = 0;
+
+    item->seg = -1;
+    item->off = 0;
+    if (!spill.budget || spill.failed || len == 0 || spill.in_memory + len <= spill.budget) {
+        spill.in_memory += len;
+        return;
+    }
+    if ((spill.fd < 0 || spill.seg_off >= SPILL_SEGMENT) && next_segment() != 0) {
+        fprintf(stderr, "Failed to open queue spill segment in %s. Queues are kept in memory\n", spill.dir);
+        spill.failed = 1;
+        spill.in_memory += len;
+        return;
+    }
+    while (done < len && (n = write(spill.fd, item->buf + done, len - done)) > 0) {
+        done += n;
+    }
+    if (done < len) {
+        fprintf(stderr, "Failed to write queue spill segment in %s. Queues are kept in memory\n", spill.dir);
+        spill.failed = 1;
+        spill.in_memory += len;
+        return;
+    }
+    free(item->buf);
+    item->buf = NULL;
+    item->seg = spill.seg;
+    item->off = spill.seg_off;
+    spill.seg_off += len;
+    spill.live[spill.seg]++;
+    spill.spilled_buffers++;
+    spill.spilled_bytes += len;
+}
+
+/**
+* Gets the data of a queued buffer, mapping it from its
+* segment file if it was spilled.
+*
+* @param item		the queued buffer
+*
+* @return the packed path_items, or NULL if a spilled
+* 	buffer could not be read back
+*/
+char *load_buf(work_buf_list *item) {
+    char path[PATHSIZE_PLUS];
+    size_t len = item->size * sizeof(path_item);
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start;
+    char *map;
+    int fd;
+
+    if (item->seg < 0 || item->buf != NULL) {
+        return item->buf;
+    }
+    start = item->off - item->off % page;
+    segment_path(item->seg, path);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    map = mmap(NULL, len + (item->off - start), PROT_READ, MAP_PRIVATE, fd, start);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    item->buf = map + (item->off - start);
+    return item->buf;
+}
+
+/**
+* Releases a buffer that left its queue: frees it, or unmaps
+* it. A segment is removed when the last of its buffers is
+* released, unless it is still being written.
+*
+* @param item		the buffer
+*/
+void release_buf(work_buf_list *item) {
+    char path[PATHSIZE_PLUS];
+    size_t len = item->size * sizeof(path_item);
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t start;
+
+    if (item->seg < 0) {
+        free(item->buf);
+        spill.in_memory -= (len < spill.in_memory)?len:spill.in_memory;
+        return;
+    }
+    if (item->buf != NULL) {
+        start = item->off - item->off % page;
+        munmap(item->buf - (item->off - start), len + (item->off - start));
+    }
+    if (--spill.live[item->seg] == 0 && item->seg != spill.seg) {
+        segment_path(item->seg, path);
+        unlink(path);
+    }
+}
+
+/**
+* Accounts memory the queues use for items that are not in
+* buffers (see enqueue_size_queue()).
+*
+* @param bytes		bytes added, or taken away if < 0
+*/
+void queue_memory(long bytes) {
+    if (bytes < 0 && (size_t) -bytes > spill.in_memory) {
+        spill.in_memory = 0;
+    }
+    else {
+        spill.in_memory += bytes;
+    }
+}
+
+/**
+* Tells if the queues would go past their budget.
+*
+* @param bytes		bytes that are about to be queued
+*
+* @return 1 if they would, and spilling is on. Otherwise 0
+*/
+int queue_memory_full(size_t bytes) {
+    return (spill.budget && !spill.failed && spill.in_memory + bytes > spill.budget);
+}
+
+/**
+* Removes the segment files that are left, and gets the
+* totals of what was spilled.
+*
+* @param buffers	gets the number of buffers spilled
+* @param bytes		gets the bytes spilled
+*/
+void free_queue_spill(size_t *buffers, size_t *bytes) {
+    char path[PATHSIZE_PLUS];
+    int i;
+
+    if (spill.fd >= 0) {
+        close(spill.fd);
+        spill.fd = -1;
+    }
+    for (i = 0; i < spill.nsegs; i++) {
+        segment_path(i, path);
+        if (unlink(path) != 0 && errno != ENOENT) {
+            fprintf(stderr, "Failed to remove queue spill segment %s\n", path);
+        }
+    }
+    free(spill.live);
+    spill.live = NULL;
+    spill.nsegs = 0;
+    *buffers = spill.spilled_buffers;
+    *bytes = spill.spilled_bytes;
+}
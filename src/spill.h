@@ -0,0 +1,45 @@
+/*
+*This material was prepared by the Los Alamos National Security, LLC (LANS) under
+*Contract DE-AC52-06NA25396 with the U.S. Department of Energy (DOE). All rights
+*in the material are reserved by DOE on behalf of the Government and LANS
+*pursuant to the contract. You are authorized to use the material for Government
+*purposes but it is not to be released or distributed to the public. NEITHER THE
+*UNITED STATES NOR THE UNITED STATES DEPARTMENT OF ENERGY, NOR THE LOS ALAMOS
+*NATIONAL SECURITY, LLC, NOR ANY OF THEIR EMPLOYEES, MAKES ANY WARRANTY, EXPRESS
+*OR IMPLIED, OR ASSUMES ANY LEGAL LIABILITY OR RESPONSIBILITY FOR THE ACCURACY,
+*COMPLETENESS, OR USEFULNESS OF ANY INFORMATION, APPARATUS, PRODUCT, OR PROCESS
+*DISCLOSED, OR REPRESENTS THAT ITS USE WOULD NOT INFRINGE PRIVATELY OWNED RIGHTS.
+*/
+
+
+//
+// Defines for spilling the manager's queues (-q). The buffers of packed
+// path_items that wait in the queues count against a memory budget.
+// A buffer queued past the budget is appended to a segment file instead,
+// and is mapped back in when it is sent. Queues are FIFO, so segments
+// are read back in the order they were written, and a segment is
+// removed once all of its buffers are sent.
+//
+// Segment files are $TMPDIR/pftool.spill.<pid>.<segment> (/tmp if
+// TMPDIR is not set). Only the manager queues work, so the spill state
+// is kept here, once per process.
+//
+
+#ifndef      __SPILL_H
+#define      __SPILL_H
+
+#include <sys/types.h>
+
+#include "pfutils.h"
+
+#define SPILL_SEGMENT 67108864				// bytes of a segment file, before the next one is started
+
+void init_queue_spill(size_t budget);
+void spill_buf(work_buf_list *item);
+char *load_buf(work_buf_list *item);
+void release_buf(work_buf_list *item);
+void queue_memory(long bytes);
+int queue_memory_full(size_t bytes);
+void free_queue_spill(size_t *buffers, size_t *bytes);
+
+#endif